@@ -0,0 +1,293 @@
+// Memory balloon of the VM, driven by the memory pressure of the host
+//
+// The VM is created with a memory ceiling (<vm_memory> in the project
+// preferences, 256 MB by default) and the guest additions inflate a balloon
+// inside the guest to give part of it back to the host:
+//
+//  - under pressure (little MemAvailable, or memory PSI above
+//    BALLOON_PSI_HIGH on Linux) the balloon grows, up to the ceiling minus
+//    <vm_memory_min>
+//  - when the host has been idle for BALLOON_IDLE_CHECKS checks in a row
+//    the balloon shrinks again, one step at a time, as long as the host
+//    keeps enough memory available afterwards
+//
+// Between the two water marks nothing changes, so the balloon does not
+// follow every small change of the host. Every adjustment is logged. A
+// booting guest has no guest additions running yet, so a failed adjustment
+// is tried again later, with a delay that doubles up to BALLOON_MAX_BACKOFF.
+
+#ifndef BALLOON_H
+#define BALLOON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#endif
+
+#include "hypervisor.h"
+#include "trace.h"
+
+// Seconds between two looks at the host memory
+#define BALLOON_PERIOD 10.0
+// Memory of the VM when the preferences do not set it, and smallest memory
+// left to the guest by the balloon
+#define BALLOON_DEFAULT_MB 256
+// Size of a step of the balloon
+#define BALLOON_STEP_MB 128
+// Memory PSI (some avg10, in %) above which the host is under pressure,
+// and below which it is idle
+#define BALLOON_PSI_HIGH 10.0
+#define BALLOON_PSI_LOW 1.0
+// Idle checks in a row before memory is given back to the guest
+#define BALLOON_IDLE_CHECKS 6
+// Longest delay before a failed adjustment is tried again, in seconds
+#define BALLOON_MAX_BACKOFF 600.0
+
+namespace Balloon
+{
+        struct HostMemory {
+                double total_mb;
+                double available_mb;
+                bool   has_pressure;
+                double pressure;        // some avg10 of /proc/pressure/memory
+        };
+
+        // Root of the proc file system, e.g. a copy of it for testing
+        std::string proc_dir = "/proc";
+
+        #if !defined(_WIN32) && !defined(__APPLE__)
+        // Value in kB of a /proc/meminfo line, -1 if it is not there
+        double meminfo_kb(const std::string &meminfo, const char *key)
+        {
+                size_t pos = meminfo.find(std::string("\n") + key + ":");
+                if (pos == std::string::npos) return -1;
+                return strtod(meminfo.c_str() + pos + strlen(key) + 2, NULL);
+        }
+        #endif
+
+        bool read_host(HostMemory &host)
+        {
+                host.total_mb = host.available_mb = 0;
+                host.has_pressure = false;
+                host.pressure = 0;
+
+                #ifdef _WIN32
+                MEMORYSTATUSEX status;
+                status.dwLength = sizeof(status);
+                if (!GlobalMemoryStatusEx(&status)) return false;
+                host.total_mb = status.ullTotalPhys / (1024.0*1024);
+                host.available_mb = status.ullAvailPhys / (1024.0*1024);
+                return true;
+                #elif defined(__APPLE__)
+                unsigned long long memsize = 0;
+                size_t len = sizeof(memsize);
+                int mib[2] = { CTL_HW, HW_MEMSIZE };
+                if (sysctl(mib, 2, &memsize, &len, NULL, 0)) return false;
+                vm_statistics_data_t vmstat;
+                mach_msg_type_number_t count = HOST_VM_INFO_COUNT;
+                if (host_statistics(mach_host_self(), HOST_VM_INFO, (host_info_t)&vmstat, &count) != KERN_SUCCESS) return false;
+                host.total_mb = memsize / (1024.0*1024);
+                // Inactive pages are given back without swapping
+                host.available_mb = ((double)vmstat.free_count + vmstat.inactive_count) * vm_page_size / (1024.0*1024);
+                return true;
+                #else
+                char buffer[4096];
+                FILE *f = fopen((proc_dir + "/meminfo").c_str(), "r");
+                if (!f) return false;
+                size_t n = fread(buffer + 1, 1, sizeof(buffer) - 2, f);
+                fclose(f);
+                // The leading newline lets every key be found as "\n<key>:"
+                buffer[0] = '\n';
+                buffer[n + 1] = 0;
+                std::string meminfo(buffer);
+
+                double total = meminfo_kb(meminfo, "MemTotal");
+                double available = meminfo_kb(meminfo, "MemAvailable");
+                if (available < 0) {
+                        // Kernels older than 3.14
+                        available = meminfo_kb(meminfo, "MemFree") + meminfo_kb(meminfo, "Buffers") + meminfo_kb(meminfo, "Cached");
+                }
+                if (total <= 0 || available < 0) return false;
+                host.total_mb = total / 1024;
+                host.available_mb = available / 1024;
+
+                // Pressure stall information, Linux 4.20 and later:
+                // some avg10=1.53 avg60=0.87 avg300=0.22 total=123456
+                f = fopen((proc_dir + "/pressure/memory").c_str(), "r");
+                if (f) {
+                        double avg10;
+                        if (fscanf(f, "some avg10=%lf", &avg10) == 1) {
+                                host.has_pressure = true;
+                                host.pressure = avg10;
+                        }
+                        fclose(f);
+                }
+                return true;
+                #endif
+        }
+
+        class Controller {
+        public:
+                int ceiling_mb;         // memory of the VM
+                int floor_mb;           // memory always left to the guest
+
+                Controller() : ceiling_mb(BALLOON_DEFAULT_MB), floor_mb(BALLOON_DEFAULT_MB),
+                               balloon_mb(-1), idle_checks(0), failures(0), retry_at(0), enabled(false) {}
+
+                void parse_preferences(const char *prefs)
+                {
+                        int mb;
+                        if (!prefs) return;
+                        if (parse_int(prefs, "<vm_memory>", mb) && mb >= BALLOON_DEFAULT_MB) ceiling_mb = mb;
+                        if (parse_int(prefs, "<vm_memory_min>", mb) && mb > 0) floor_mb = mb;
+                        if (floor_mb > ceiling_mb) floor_mb = ceiling_mb;
+                }
+
+                // Start controlling the balloon of a running VM. The ceiling is
+                // read back from the VM, as the preferences may have changed
+                // since it was created.
+                void attach(const std::string &vm)
+                {
+                        string output;
+                        vm_name = vm;
+                        if (hypervisor->run("showvminfo " + vm + " --machinereadable", output) == 0) {
+                                size_t pos = output.find("\nmemory=");
+                                if (pos != string::npos) ceiling_mb = atoi(output.c_str() + pos + 8);
+                        }
+                        if (floor_mb > ceiling_mb) floor_mb = ceiling_mb;
+
+                        HostMemory host;
+                        enabled = (ceiling_mb > floor_mb) && read_host(host);
+                        balloon_mb = -1;
+                        idle_checks = 0;
+                        failures = 0;
+                        retry_at = 0;
+                        if (enabled) {
+                                LOG_NOTICE("Memory balloon: the VM has " << ceiling_mb << " MB and can give back up to "
+                                           << ceiling_mb - floor_mb << " MB to the host");
+                        }
+                }
+
+                // Called from the main loop every BALLOON_PERIOD seconds while the VM runs
+                void update()
+                {
+                        if (!enabled || dtime() < retry_at) return;
+
+                        HostMemory host;
+                        if (!read_host(host)) return;
+
+                        double low = low_water(host);
+                        double high = high_water(host);
+                        bool pressure = (host.available_mb < low) || (host.has_pressure && host.pressure > BALLOON_PSI_HIGH);
+                        bool idle = (host.available_mb > high) && (!host.has_pressure || host.pressure < BALLOON_PSI_LOW);
+                        int limit = ceiling_mb - floor_mb;
+
+                        if (balloon_mb < 0) {
+                                // Size unknown, e.g. restored from a saved state
+                                if (!pressure) adjust(0, host, "start from an empty balloon");
+                                else adjust(step_up(host, low, 0, limit), host, "host under memory pressure");
+                                return;
+                        }
+
+                        if (pressure) {
+                                idle_checks = 0;
+                                if (balloon_mb < limit) adjust(step_up(host, low, balloon_mb, limit), host, "host under memory pressure");
+                                return;
+                        }
+
+                        if (!idle || balloon_mb == 0) {
+                                idle_checks = 0;
+                                return;
+                        }
+
+                        // Give the memory back only if the host stays idle afterwards
+                        if (++idle_checks < BALLOON_IDLE_CHECKS) return;
+                        int target = balloon_mb - BALLOON_STEP_MB;
+                        if (target < 0) target = 0;
+                        if (host.available_mb - (balloon_mb - target) > high) adjust(target, host, "host is idle");
+                        idle_checks = 0;
+                }
+
+                int size() const { return balloon_mb; }
+
+        private:
+                string vm_name;
+                int balloon_mb;         // -1 until it is set
+                int idle_checks;
+                int failures;           // in a row
+                double retry_at;        // dtime() before which a failed adjustment is not tried again
+                bool enabled;
+
+                // Less than this is memory pressure: 5% of the host, at least 256 MB
+                double low_water(const HostMemory &host) const
+                {
+                        double mb = host.total_mb * 0.05;
+                        return (mb < 256) ? 256 : mb;
+                }
+
+                // More than this is an idle host: 20% of the host, at least 1 GB
+                double high_water(const HostMemory &host) const
+                {
+                        double mb = host.total_mb * 0.20;
+                        return (mb < 1024) ? 1024 : mb;
+                }
+
+                // Grow by a step, or by what the host misses if that is more
+                int step_up(const HostMemory &host, double low, int current, int limit) const
+                {
+                        int step = BALLOON_STEP_MB;
+                        if (low - host.available_mb > step) step = (int)(low - host.available_mb);
+                        return (current + step > limit) ? limit : current + step;
+                }
+
+                void adjust(int target, const HostMemory &host, const char *reason)
+                {
+                        Trace::Span span("Balloon::adjust");
+                        span.arg("from", (double)balloon_mb);
+                        span.arg("to", (double)target);
+                        std::ostringstream arg_list;
+                        arg_list << "controlvm " << vm_name << " guestmemoryballoon " << target;
+                        string output;
+                        if (hypervisor->run(arg_list.str(), output) != 0) {
+                                // The guest additions may not be running yet
+                                double backoff = BALLOON_PERIOD;
+                                for (int i = 0; i < failures && backoff < BALLOON_MAX_BACKOFF; i++) backoff *= 2;
+                                if (backoff > BALLOON_MAX_BACKOFF) backoff = BALLOON_MAX_BACKOFF;
+                                failures++;
+                                retry_at = dtime() + backoff;
+                                LOG_WARNING("Impossible to set the memory balloon to " << target << " MB, trying again in "
+                                            << (int)backoff << " s");
+                                if (!output.empty()) LOG_WARNING(output);
+                                return;
+                        }
+                        if (failures) LOG_NOTICE("Memory balloon available after " << failures << " failed attempts");
+                        failures = 0;
+                        retry_at = 0;
+
+                        std::ostringstream psi;
+                        if (host.has_pressure) psi << ", memory PSI " << host.pressure << "%";
+                        if (balloon_mb < 0) {
+                                LOG_NOTICE("Memory balloon set to " << target << " MB (" << reason << ": "
+                                           << (int)host.available_mb << " MB available" << psi.str() << ")");
+                        }
+                        else {
+                                LOG_NOTICE("Memory balloon " << balloon_mb << " -> " << target << " MB, the guest has "
+                                           << ceiling_mb - target << " MB (" << reason << ": "
+                                           << (int)host.available_mb << " MB available" << psi.str() << ")");
+                        }
+                        balloon_mb = target;
+                        Trace::counter("memory balloon MB", target);
+                }
+        };
+}
+
+#endif // BALLOON_H
@@ -63,6 +63,21 @@
 #include "error_numbers.h"
 #include "graphics2.h"
 #include "vbox.h"
+#include "gc.h"
+
+// CPU time of the work unit: the one of the VM where it can be read, the
+// one of the wrapper otherwise. Where the VM is followed, BOINC gets it
+// here instead of from the status messages of the API.
+double report_cpu_time(double frac_done)
+{
+        CpuTime::update();
+        double cpu_time = boinc_worker_thread_cpu_time();
+        if (CpuTime::total() > cpu_time) cpu_time = CpuTime::total();
+        #if !defined(_WIN32) && !defined(__APPLE__)
+        boinc_report_app_status(cpu_time, cpu_time, frac_done);
+        #endif
+        return cpu_time;
+}
 
 int main(int argc, char** argv) 
 {
@@ -75,30 +90,40 @@ int main(int argc, char** argv)
         bool vrde = false;
         bool vm_name = false;
         bool retval = false;
-        // Name for the VM vmdk filename
-        string cernvm = "cernvm.vmdk";
         string resolved_name;
+        string backend = "cli";
+        string backend_endpoint;
+        string backend_credentials;
+        bool gc = false;
+        string gc_slots;
+        string storage_bus;
+        bool io_throttle = false;
+        int prefetch_mb = -1;
+        bool fresh_disk = false;
+        bool proxy = false;
+        bool proxy_server = false;
+        int proxy_cache_mb = 0;
+        string guest_channel;
     
         VM vm;
         vm.poll_err_number = 0;
     
         // Registering time for progress accounting
         time_t init_secs = time (NULL); 
+        double startup_time = dtime();
     
         for (i = 1; i < (unsigned int)argc; i++) {
                 if (!strcmp(argv[i], "--debug")) {
                         std::istringstream ArgStream(argv[i+1]);
-                        if (ArgStream >> vm.debug_level)
-                                if (vm.debug_level >= 4) {
-                                        cerr << "INFO: Setting DEBUG level to: " << vm.debug_level << endl;
-                                }
+                        if (ArgStream >> vm.debug_level) {
+                                Log::level = vm.debug_level;
+                                LOG_INFO("Setting DEBUG level to: " << vm.debug_level);
+                        }
                 }
 
                 if (!strcmp(argv[i], "--vmname")) {
                         vm.virtual_machine_name = argv[i+1];
-                        if (vm.debug_level >= 3) {
-                                cerr << "NOTICE: The name of the VM is: " << vm.virtual_machine_name << endl;
-                        }
+                        LOG_NOTICE("The name of the VM is: " << vm.virtual_machine_name);
                 }
 
                 // --nthreads to use BOINC mt class
@@ -106,6 +131,113 @@ int main(int argc, char** argv)
                         vm.n_cpus = atoi(argv[i+1]);
                 }
 
+                // --trace to write a trace-event timeline of the wrapper to the slot directory
+                if (!strcmp(argv[i], "--trace")) {
+                        if (!Trace::open()) {
+                                LOG_WARNING("Impossible to open " << TRACE_FN << ", tracing disabled");
+                        }
+                }
+
+                // --backend cli|session|mock to select how VBoxManage commands are run
+                if (!strcmp(argv[i], "--backend") && (i+1 < (unsigned int)argc)) {
+                        backend = argv[i+1];
+                }
+
+                // --backend-endpoint HOST:PORT of vboxwebsrv for the session backend
+                if (!strcmp(argv[i], "--backend-endpoint") && (i+1 < (unsigned int)argc)) {
+                        backend_endpoint = argv[i+1];
+                }
+
+                // --backend-credentials FILE with the user and the password of vboxwebsrv, one per line
+                if (!strcmp(argv[i], "--backend-credentials") && (i+1 < (unsigned int)argc)) {
+                        backend_credentials = argv[i+1];
+                }
+
+                // --vboxmanage PATH of the VBoxManage program used by the cli backend
+                if (!strcmp(argv[i], "--vboxmanage") && (i+1 < (unsigned int)argc)) {
+                        Backend::cli.program = string("\"") + argv[i+1] + "\" -q ";
+                }
+
+                // --storage ide|sata|virtio-scsi to choose the disk controller on this host
+                if (!strcmp(argv[i], "--storage") && (i+1 < (unsigned int)argc)) {
+                        if (StorageProfile::valid_bus(argv[i+1])) storage_bus = argv[i+1];
+                        else LOG_WARNING("Unknown storage profile " << argv[i+1] << ", use ide, sata or virtio-scsi");
+                }
+
+                // --io-throttle to lower the disk bandwidth of the VM when the host is under I/O pressure
+                if (!strcmp(argv[i], "--io-throttle")) {
+                        io_throttle = true;
+                }
+
+                // --prefetch-mb N of the disk read ahead before the first boot, 0 to disable
+                if (!strcmp(argv[i], "--prefetch-mb") && (i+1 < (unsigned int)argc)) {
+                        prefetch_mb = atoi(argv[i+1]);
+                }
+
+                // --proxy to share a caching HTTP proxy between the VMs of this host
+                if (!strcmp(argv[i], "--proxy")) {
+                        proxy = true;
+                }
+
+                // --proxy-server to only run the caching HTTP proxy
+                if (!strcmp(argv[i], "--proxy-server")) {
+                        proxy_server = true;
+                }
+
+                // --proxy-port PORT of the HTTP proxy, 3128 by default
+                if (!strcmp(argv[i], "--proxy-port") && (i+1 < (unsigned int)argc)) {
+                        Proxy::port = atoi(argv[i+1]);
+                }
+
+                // --proxy-cache DIR of the HTTP proxy cache
+                if (!strcmp(argv[i], "--proxy-cache") && (i+1 < (unsigned int)argc)) {
+                        Proxy::cache_dir = argv[i+1];
+                }
+
+                // --proxy-cache-mb SIZE of the HTTP proxy cache
+                if (!strcmp(argv[i], "--proxy-cache-mb") && (i+1 < (unsigned int)argc)) {
+                        proxy_cache_mb = atoi(argv[i+1]);
+                }
+
+                // --guest-channel guestproperty|file:DIR for the small messages of the guest, besides the floppy
+                if (!strcmp(argv[i], "--guest-channel") && (i+1 < (unsigned int)argc)) {
+                        guest_channel = argv[i+1];
+                }
+
+                // --gc to remove the VMs and disks left behind by crashed slots, and exit
+                if (!strcmp(argv[i], "--gc")) {
+                        gc = true;
+                }
+
+                // --gc-slots DIR when --gc is not run from a slot directory
+                if (!strcmp(argv[i], "--gc-slots") && (i+1 < (unsigned int)argc)) {
+                        gc_slots = argv[i+1];
+                }
+
+        }
+
+        hypervisor = Backend::select(backend, backend_endpoint);
+        if (!hypervisor) {
+                LOG_ERROR("Unknown backend " << backend << ", use cli, session or mock");
+                return 1;
+        }
+
+        if (hypervisor == Backend::session && !backend_credentials.empty() &&
+            !Backend::session->read_credentials(backend_credentials)) {
+                LOG_WARNING("Impossible to read the credentials of vboxwebsrv in " << backend_credentials);
+        }
+        LOG_NOTICE("Running VBoxManage commands with the " << hypervisor->name() << " backend");
+
+        if (proxy_server) {
+                if (proxy_cache_mb > 0) Proxy::cache_limit = proxy_cache_mb * 1024.0 * 1024;
+                return Proxy::serve();
+        }
+
+        if (gc) {
+                #ifdef _WIN32
+                Helper::SettingWindowsPath();
+                #endif
+                return Gc::run(gc_slots);
         }
     
         // If the wrapper has not be called with the command line argument --vmname NAME, give a default name to the VM
@@ -117,29 +249,41 @@ int main(int argc, char** argv)
         options.main_program = true;
         options.check_heartbeat = true;
         options.handle_process_control = true;
+        #if !defined(_WIN32) && !defined(__APPLE__)
+        // The CPU time of the VM is reported by the main loop
+        options.send_status_msgs = false;
+        #else
         options.send_status_msgs = true;
+        #endif
         
-        boinc_init_options(&options);
+        {
+                Trace::Span span("boinc_init_options");
+                boinc_init_options(&options);
+        }
+
+        // From now on NOTICE and INFO messages are written by a background thread
+        Log::start();
     
         #ifdef _WIN32
         // Setting up the PATH for Windows machines:
         if (!Helper::SettingWindowsPath()) {
-                cerr << "ERROR: Impossible to set VirtualBox path" << endl;
-                cerr << "Aborting!" << endl;
-                boinc_finish(0);
+                LOG_ERROR("Impossible to set VirtualBox path");
+                LOG_MSG("Aborting!");
+                Log::finish(0);
         }
         #endif
     
         // First print the version of VirtualBox
         string arg_list = " --version";
         char version[BUFSIZE];
-    
-        if (vbm_popen(arg_list, version, sizeof(version))) {
-                cerr << endl;
-                cerr << endl;
-                cerr << "====================================" << endl;
-                cerr << "VirtualBox version: " << version << endl;
-                cerr << "====================================" << endl;
+        {
+                Trace::Span span("VirtualBox version");
+                if (vbm_popen(arg_list, version, sizeof(version))) {
+                        span.arg("version", version);
+                        LOG_MSG("====================================");
+                        LOG_MSG("VirtualBox version: " << version);
+                        LOG_MSG("====================================");
+                }
         }
 
         // Get BOINC APP INIT DATA to set several values for the VM
@@ -148,16 +292,61 @@ int main(int argc, char** argv)
         // Check if we have to run the VM in headless mode
         if (aid.project_preferences) {
                 if (parse_bool(aid.project_preferences, "vm_headless_mode", headless)) {
-                        cerr << "NOTICE: User has set the VM to run in headless mode!" << endl;
+                        LOG_NOTICE("User has set the VM to run in headless mode!");
                         headless = true;
                 }
                 else {
-                        cerr << "NOTICE: Running the VM in full mode!" << endl;
+                        LOG_NOTICE("Running the VM in full mode!");
                         headless = false;
                 }
         }
         else {
-                cerr << "WARNING: Impossible to get user preferences for the project" << endl;
+                LOG_WARNING("Impossible to get user preferences for the project");
+        }
+
+        Snapshot::set_init_data(aid);
+
+        // Storage profile: project preferences, then the host setting
+        vm.storage.parse_preferences(aid.project_preferences);
+        if (!storage_bus.empty()) vm.storage.bus = storage_bus;
+
+        // Disk bandwidth of the VM following the I/O pressure of the host
+        vm.io_throttle.parse_preferences(aid.project_preferences);
+        if (io_throttle) vm.io_throttle.wanted = true;
+        vm.io_throttle.configure(vm.storage);
+
+        // Read ahead of the disk before the VM boots, through the page cache
+        if (aid.project_preferences) {
+                int value;
+                if (parse_int(aid.project_preferences, "<vm_prefetch_mb>", value) && value >= 0) Prefetch::default_mb = value;
+        }
+        if (prefetch_mb >= 0) Prefetch::default_mb = prefetch_mb;
+        if (vm.storage.hostiocache == 0) Prefetch::default_mb = 0;
+        if (aid.project_dir[0]) Prefetch::profile_dir = string(aid.project_dir) + "/" PREFETCH_PROFILE_DIRNAME;
+
+        // Memory of the VM and how much of it the balloon can give back
+        vm.balloon.parse_preferences(aid.project_preferences);
+
+        // Caching HTTP proxy for the guest, shared with the other VMs of the host
+        if (aid.project_preferences) {
+                int value;
+                if (parse_int(aid.project_preferences, "<vm_http_proxy>", value) && value) proxy = true;
+                if (!proxy_cache_mb && parse_int(aid.project_preferences, "<vm_proxy_cache_mb>", value) && value > 0) proxy_cache_mb = value;
+        }
+        if (proxy) {
+                if (proxy_cache_mb > 0) Proxy::cache_limit = proxy_cache_mb * 1024.0 * 1024;
+                if (Proxy::cache_dir.empty() && aid.project_dir[0]) {
+                        Proxy::cache_dir = string(aid.project_dir) + Proxy::SEPARATOR + PROXY_CACHE_DIRNAME;
+                }
+                Proxy::start();
+        }
+
+        // Extra VBox.log signatures can be shipped with the work unit
+        if (!boinc_resolve_filename_s(LOGSCAN_SIGNATURES_FN, resolved_name)) {
+                int n = vm.log_scanner.load_signatures(resolved_name.c_str());
+                if (n) {
+                        LOG_NOTICE("Loaded " << n << " VBox.log signatures from " << resolved_name);
+                }
         }
 
         // BOINC user name and authenticator to authenticate users in Co-Pilot
@@ -184,149 +373,217 @@ int main(int argc, char** argv)
         // Multi-core debug information
         if (vm.n_cpus > 2) {
                 vm.n_cpus = 2;
-                cerr << "=========================================================================================" << endl;
-                cerr << "WARNING: This Virtual Machine will get any performance improvement with more than 2 cores" << endl;
-                cerr << "WARNING: Forcing VM to use only 2 cores" << endl;
-                cerr << "=========================================================================================" << endl;
+                LOG_MSG("=========================================================================================");
+                LOG_WARNING("This Virtual Machine will get any performance improvement with more than 2 cores");
+                LOG_WARNING("Forcing VM to use only 2 cores");
+                LOG_MSG("=========================================================================================");
         }
 
-        cerr << "This work unit will use " << vm.n_cpus << " cores" << endl;
+        LOG_MSG("This work unit will use " << vm.n_cpus << " cores");
 
         // We check if the VM has already been created and launched
         if (!vm.exists()) {
-                // First remove old versions
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: Cleaning old VMs of the project..." << endl;
-                }
-
-                vm.remove();
-
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: Cleaning completed" << endl;
-                }
-
                 std::ifstream f(PROGRESS_FN);
                 if (f.is_open()) {
-                    if (vm.debug_level >= 3) {
-                            cerr << "NOTICE: ProgressFile should not exists. Deleting it" << endl;
-                    }
+                    LOG_NOTICE("ProgressFile should not exists. Deleting it");
                     f.close();
                     remove(PROGRESS_FN);
                 }
+                remove(GUEST_PROGRESS_FN);
+                remove(CPU_TIME);
 
-                // Then, Decompress the new VM.gz file
-                cerr << endl << "Initializing the VM..." << endl;
-                cerr << "Decompressing the VM" << endl;
-                retval = boinc_resolve_filename_s("cernvm.vmdk.gz", resolved_name);
+                retval = Helper::resolve_image(resolved_name);
                 if (retval) {
-                        cerr << "ERROR: Impossible to resolve file name: cernvm.vmdk.gz" << endl;
-                        cerr << "ERROR: Aborting WU" << endl;
-                        boinc_finish(1);
+                        LOG_ERROR("Impossible to resolve the VM image: cernvm.vmdk.zst, cernvm.vmdk.xz or cernvm.vmdk.gz");
+                        LOG_ERROR("Aborting WU");
+                        Log::finish(1);
                 }
 
-                Helper::unzip(resolved_name.c_str(), cernvm.c_str());
-                cerr << "Virtual Disk uncompressed. Ready to create the VM" << endl;
-
-                // Create VM and register
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: Virtual machine name: " << vm.virtual_machine_name << endl; 
-                }
-                cerr << "Registering a new VM from unzipped image..." << endl;
-                vm.create();
-                cerr << "VM successfully registered and created!" << endl;
+                // Clean old versions, decompress the new VM.gz file and register the VM at the same time
+                LOG_MSG("Initializing the VM...");
+                LOG_NOTICE("Virtual machine name: " << vm.virtual_machine_name);
+                LOG_MSG("Cleaning old VMs, decompressing the VM and registering it...");
+                create_pipelined(vm, resolved_name);
+                fresh_disk = true;
+                LOG_MSG("VM successfully registered and created!");
         }
         else {
-                cerr << "VM exists, starting it..." << endl;
+                LOG_MSG("VM exists, starting it...");
+                // Keep the controller the VM was created with
+                Journal::State journal;
+                if (Journal::replay(journal) && !journal.storage.empty()) vm.storage.bus = journal.storage;
         }
 
+        // The guest reports its progress through the floppy
+        if (vm.floppy_name.empty()) {
+                std::ifstream f("FloppyName.txt");
+                f >> vm.floppy_name;
+        }
+        Guest::load();
+
         time_t elapsed_secs = 0; 
         long int t = 0;
         double frac_done = 0, dif_secs = 0; 
     
+        // The boot reads the disk all over: prefetch what it needs. A VM
+        // restored from its saved state does not boot.
+        {
+                string state, output;
+                if (!hypervisor->state(vm.virtual_machine_name, state, output) || (state != "saved" && state != "paused")) {
+                        Prefetch::start(vm.disk_name, fresh_disk);
+                }
+        }
         vm.start(vrde, headless);
         vm.last_poll_point = time(NULL);
+        LOG_NOTICE("Time to first running: " << dtime() - startup_time << " seconds");
+        CpuTime::start(vm.virtual_machine_name);
+
+        // Guest properties for the progress and the heartbeats, as the VM runs
+        if (!guest_channel.empty()) {
+                PropertyChannel *channel = NULL;
+                if (guest_channel == "guestproperty") channel = new GuestPropertyChannel(vm.virtual_machine_name, *hypervisor);
+                else if (guest_channel.compare(0, 5, "file:") == 0) channel = new FilePropertyChannel(guest_channel.substr(5));
+
+                if (!channel) LOG_WARNING("Unknown guest channel " << guest_channel << ", use guestproperty or file:DIR");
+                else if (!channel->start()) LOG_WARNING("Impossible to follow the guest channel, using only the floppy");
+                else {
+                        LOG_NOTICE("Exchanging the small messages with the guest through " << guest_channel);
+                        Guest::channel = channel;
+                }
+        }
     
         #ifdef APP_GRAPHICS
         // create shared mem segment for graphics, and arrange to update it
         Share::data = (Share::SharedData*)boinc_graphics_make_shmem("cernvm", sizeof(Share::SharedData));
         if (!Share::data) {
-                cerr << "ERROR: failed to created shared mem segment" << endl;
+                LOG_ERROR("failed to created shared mem segment");
         }
+        else {
+                // Filled once, the timer callback only refreshes the cached fields
+                boinc_get_init_data(Share::data->init_data);
+        }
+        Snapshot::publish();
         Helper::update_shmem();
         boinc_register_timer_callback(Helper::update_shmem);
         #endif
         
-        cerr << "DEBUG level: " << vm.debug_level << endl;
+        LOG_MSG("DEBUG level: " << vm.debug_level);
+        // Each task at its own cadence: suspend and quit requests are seen
+        // within STATUS_PERIOD, VBoxManage only runs every VM_POLL_PERIOD
+        // unless something happens to the VM
+        Scheduler tasks;
+        int status_task = tasks.add(STATUS_PERIOD);
+        int vm_task = tasks.add(VM_POLL_PERIOD);
+        int progress_task = tasks.add(POLL_PERIOD);
+        int balloon_task = tasks.add(BALLOON_PERIOD, BALLOON_PERIOD);
+        int io_throttle_task = tasks.add(IOTHROTTLE_PERIOD, IOTHROTTLE_PERIOD);
+        int proxy_task = tasks.add(PROXY_REPORT_PERIOD, PROXY_REPORT_PERIOD);
+        int prefetch_task = tasks.add(YEAR_SECS, PREFETCH_RECORD_DELAY);
+        // Tasks on the running VM, held while BOINC has suspended the work unit
+        int vm_tasks[] = {vm_task, balloon_task, io_throttle_task, proxy_task, prefetch_task};
         while (1) {
-                boinc_get_status(&status);
-                poll_boinc_messages(vm, status);
-                
-                // Report progress to BOINC client
-                if (!status.suspended) {
+                if (tasks.due(status_task)) {
+                        bool was_suspended = vm.suspended;
+                        boinc_get_status(&status);
+                        poll_boinc_messages(vm, status);
+                        Snapshot::current.status = status;
+                        // Paused or resumed: see the new state of the VM at once
+                        if (vm.suspended != was_suspended) {
+                                tasks.trigger(vm_task);
+                                tasks.trigger(progress_task);
+                        }
+                }
+
+                for (size_t i = 0; i < sizeof(vm_tasks) / sizeof(vm_tasks[0]); i++) tasks.hold(vm_tasks[i], status.suspended);
+                if (status.suspended) {
+                        if (tasks.due(progress_task)) {
+                                init_secs = time(NULL);
+                                report_cpu_time(frac_done);
+                                Snapshot::publish();
+                        }
+                        tasks.wait();
+                        continue;
+                }
+
+                if (tasks.due(vm_task)) {
                         vm.poll();
                         if (vm.suspended) {
-                                if (vm.debug_level >= 2) {
-                                        cerr << "WARNING: VM should be running as the WU is not suspended" << endl;
-                                }
+                                LOG_WARNING("VM should be running as the WU is not suspended");
                                 vm.resume();
                         }
+                        // Look again soon while the VM is in trouble
+                        if (vm.poll_err_number || vm.poweroff_err_number || vm.suspended) tasks.delay(vm_task, POLL_PERIOD);
+                }
+                if (tasks.due(balloon_task)) vm.balloon.update();
+                if (tasks.due(io_throttle_task)) vm.io_throttle.update();
+                if (tasks.due(proxy_task)) Proxy::report(true);
+                if (tasks.due(prefetch_task)) Prefetch::record();
+
+                // Report progress to BOINC client
+                if (tasks.due(progress_task)) {
+                        // Something in VBox.log: check the state of the VM too
+                        if (vm.check_log()) tasks.trigger(vm_task);
     
                         elapsed_secs = time(NULL);
                         dif_secs = Helper::update_progress(difftime(elapsed_secs,init_secs));
+                        init_secs = elapsed_secs;
                         // Convert it for Windows machines:
                         t = static_cast<int>(dif_secs);
-                        if (vm.debug_level >= 4) {
-                                cerr << "INFO: Running seconds " << dif_secs << endl;
-                        }
-                        // For 24 hours:
-                        frac_done = floor((t / 86400.0) * 100.0) / 100.0;
+                        LOG_INFO("Running seconds " << dif_secs);
+                        // The progress of the guest, if it reports it, otherwise the
+                        // running time. 24 hours is the limit in any case.
+                        Guest::poll(vm.floppy_name);
+                        Guest::heartbeat(dif_secs);
+                        bool time_limit = (t >= 86400);
+                        if (Guest::report.reported) frac_done = Guest::report.progress;
+                        else frac_done = floor((t / 86400.0) * 100.0) / 100.0;
+                        if (time_limit || Guest::report.drained) frac_done = 1.0;
                         
-                        if (vm.debug_level >= 4) {
-                                cerr << "INFO: Fraction done " << frac_done << endl;
-                        }
+                        LOG_INFO("Fraction done " << frac_done);
                         // Checkpoint for reporting correctly the time
                         boinc_time_to_checkpoint();
                         boinc_checkpoint_completed();
                         boinc_fraction_done(frac_done);
+                        double cpu_time = report_cpu_time(frac_done);
+
+                        // Publish the state for the graphics timer callback
+                        Snapshot::current.fraction_done = frac_done;
+                        Snapshot::current.running_secs = dif_secs;
+                        Snapshot::current.cpu_time = cpu_time;
+                        Snapshot::current.poll_errors = vm.poll_err_number;
+                        Snapshot::current.n_cpus = vm.n_cpus;
+                        Snapshot::publish();
                         if (frac_done >= 1.0) {
-                                if (vm.debug_level >= 3) {
-                                        cerr << "NOTICE: Stopping the VM..." << endl; 
-                                }
+                                if (Guest::report.drained) LOG_NOTICE("The guest has no more jobs to run after " << dif_secs << " seconds");
+                                else if (time_limit) LOG_NOTICE("The work unit has reached its limit of 24 hours");
+                                LOG_NOTICE("Stopping the VM...");
                                 vm.savestate();
-                                if (vm.debug_level >= 3) {
-                                        cerr << "NOTICE: VM stopped!" << endl; 
-                                }
+                                LOG_NOTICE("VM stopped!");
                                 vm.remove();
                                 // Update the ProgressFile for starting from zero next WU
                                 Helper::write_progress(0);
-                                if (vm.debug_level >= 3) {
-                                        cerr << "NOTICE: Work Unit completed" << endl;
-                                        cerr << "NOTICE: Creating output file..." << endl;
-                                }
+                                remove(GUEST_PROGRESS_FN);
+                                CpuTime::reset();
+                                LOG_NOTICE("Work Unit completed");
+                                LOG_NOTICE("Creating output file...");
                                 std::ofstream f("output");
                                 if (f.is_open()) {
                                         if (f.good()) {
                                                 f << "Work Unit completed!\n";
+                                                f << "reason=" << (Guest::report.drained ? "queue drained" : (time_limit ? "time limit" : "guest finished")) << "\n";
+                                                f << "running_secs=" << dif_secs << "\n";
+                                                if (Guest::report.jobs_done >= 0) f << "jobs_done=" << Guest::report.jobs_done << "\n";
                                                 f.close();
                                         }
                                 }
-                                if (vm.debug_level >= 3) {
-                                        cerr << "NOTICE: Done!" << endl; 
-                                }
-                                #ifdef APP_GRAPHICS
-                                Helper::update_shmem();
-                                #endif
-                                boinc_finish(0);
-                        }
-                        else {
-                                init_secs = elapsed_secs;
-                                boinc_sleep(POLL_PERIOD);
+                                LOG_NOTICE("Done!");
+                                Snapshot::set_vm_state("removed");
+                                Snapshot::publish();
+                                Log::finish(0);
                         }
                 }
-                else {
-                        init_secs = time(NULL);
-                        boinc_sleep(POLL_PERIOD);
-                }
+
+                tasks.wait();
         }
 }
 
@@ -0,0 +1,27 @@
+// Channels between the hypervisor and the guest
+//
+// A channel carries messages, the KEY=VALUE lines the wrapper sends to the
+// guest (BOINC_USERNAME=...) and the guest sends back (PROGRESS=...). The
+// floppy image (FloppyIO) is the channel for bulk data and is always
+// there. Guest properties (guestprop.h) are a second one for the small,
+// frequent messages, which arrive as soon as the guest sets them instead
+// of at the next look at the floppy.
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <string>
+
+class Channel {
+public:
+    virtual ~Channel() {}
+
+    // Send a message to the peer
+    virtual void        send(const std::string &strData) = 0;
+    // The next message of the peer, empty if there is none
+    virtual std::string receive() = 0;
+    // Whether receive() has a message
+    virtual bool        available() = 0;
+};
+
+#endif // CHANNEL_H
@@ -0,0 +1,244 @@
+// CPU time used by the VM, for the accounting of the work unit
+//
+// The wrapper itself hardly uses the CPU: the work runs in the VirtualBox
+// process of the VM (VBoxHeadless, or VirtualBoxVM with a window). On
+// Linux that process is found once in /proc by the "--comment <vm name>"
+// VirtualBox starts it with, and its utime + stime are then read from
+// /proc/<pid>/stat through a file descriptor kept open, one pread() per
+// sample.
+//
+// The process changes when the VM is started again, so the CPU time of
+// the previous ones is kept in CpuTime with the identity (pid and start
+// time) of the current one, and the total survives restarts of the wrapper.
+// Elsewhere, or while the process is not found, available() is false and
+// the wrapper reports its own CPU time as before.
+
+#ifndef CPUTIME_H
+#define CPUTIME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <fstream>
+#include <iterator>
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+
+#define CPU_TIME "CpuTime"
+// Seconds between two searches of the process while it is not found
+#define CPUTIME_SEARCH_PERIOD 30.0
+// Seconds between two saves of the total to CPU_TIME
+#define CPUTIME_SAVE_PERIOD 60.0
+
+namespace CpuTime
+{
+        // Root of the proc file system, e.g. a copy of it for testing
+        std::string proc_dir = "/proc";
+
+        // CPU seconds of the processes of the VM that are gone
+        double base = 0;
+        // The current process: its pid, start time (in clock ticks after
+        // boot, which tells a new process with the same pid apart) and
+        // CPU seconds at the last sample
+        long pid = -1;
+        unsigned long long start_time = 0;
+        double process_secs = 0;
+
+        int stat_fd = -1;
+        double last_search = -CPUTIME_SEARCH_PERIOD;
+        double last_save = 0;
+        std::string vm_name;
+
+        bool available()
+        {
+                return stat_fd >= 0;
+        }
+
+        // CPU seconds of the VM since the work unit started
+        double total()
+        {
+                return base + process_secs;
+        }
+
+        void save()
+        {
+                std::ofstream f(CPU_TIME);
+                f.precision(15);
+                if (f.is_open()) f << base << " " << pid << " " << start_time << " " << process_secs << "\n";
+                last_save = dtime();
+        }
+
+        void load()
+        {
+                std::ifstream f(CPU_TIME);
+                if (!f.is_open()) return;
+                double secs = 0;
+                if (!(f >> base >> pid >> start_time >> secs)) {
+                        base = 0;
+                        pid = -1;
+                        return;
+                }
+                process_secs = secs;
+        }
+
+        #if !defined(_WIN32) && !defined(__APPLE__)
+        // utime + stime in seconds and the start time of a /proc/<pid>/stat
+        // line. The name of the command, in parentheses, may have spaces.
+        bool parse_stat(const char *stat, double &secs, unsigned long long &started)
+        {
+                const char *p = strrchr(stat, ')');
+                if (!p) return false;
+                // Fields after the name, from the state (field 3)
+                unsigned long utime = 0, stime = 0;
+                int field = 3;
+                for (p++; *p && field <= 22; field++) {
+                        while (*p == ' ') p++;
+                        if (field == 14) utime = strtoul(p, NULL, 10);
+                        else if (field == 15) stime = strtoul(p, NULL, 10);
+                        else if (field == 22) started = strtoull(p, NULL, 10);
+                        while (*p && *p != ' ') p++;
+                }
+                if (field <= 22) return false;
+                static long ticks = sysconf(_SC_CLK_TCK);
+                secs = (double)(utime + stime) / (ticks > 0 ? ticks : 100);
+                return true;
+        }
+
+        // Whether a NUL-separated command line is the VirtualBox process of the VM
+        bool is_vm_process(const std::string &cmdline, const std::string &name)
+        {
+                size_t end = cmdline.find('\0');
+                std::string program = cmdline.substr(0, end);
+                size_t slash = program.rfind('/');
+                if (slash != std::string::npos) program = program.substr(slash + 1);
+                if (program != "VBoxHeadless" && program != "VirtualBoxVM" && program != "VirtualBox") return false;
+
+                std::string previous;
+                size_t begin = (end == std::string::npos) ? cmdline.size() : end + 1;
+                while (begin < cmdline.size()) {
+                        end = cmdline.find('\0', begin);
+                        if (end == std::string::npos) end = cmdline.size();
+                        std::string arg = cmdline.substr(begin, end - begin);
+                        if ((previous == "--comment" || previous == "--startvm") && arg == name) return true;
+                        previous = arg;
+                        begin = end + 1;
+                }
+                return false;
+        }
+
+        // Read the current process. Returns false when it is gone.
+        bool sample()
+        {
+                char buffer[1024];
+                ssize_t n = pread(stat_fd, buffer, sizeof(buffer) - 1, 0);
+                if (n <= 0) return false;
+                buffer[n] = 0;
+                double secs;
+                unsigned long long started = 0;
+                if (!parse_stat(buffer, secs, started) || started != start_time) return false;
+                process_secs = secs;
+                return true;
+        }
+
+        // Look for the process of the VM in /proc and open its stat file
+        bool search()
+        {
+                last_search = dtime();
+                DIR *dir = opendir(proc_dir.c_str());
+                if (!dir) return false;
+                struct dirent *entry;
+                long found = -1;
+                while ((entry = readdir(dir)) != NULL) {
+                        char *end;
+                        long candidate = strtol(entry->d_name, &end, 10);
+                        if (*end || candidate <= 0) continue;
+                        std::string path = proc_dir + "/" + entry->d_name + "/cmdline";
+                        std::ifstream f(path.c_str(), std::ios::binary);
+                        if (!f.is_open()) continue;
+                        std::string cmdline((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+                        if (is_vm_process(cmdline, vm_name)) {
+                                found = candidate;
+                                break;
+                        }
+                }
+                closedir(dir);
+                if (found < 0) return false;
+
+                char path[64];
+                snprintf(path, sizeof(path), "/%ld/stat", found);
+                int fd = open((proc_dir + path).c_str(), O_RDONLY);
+                if (fd < 0) return false;
+                char buffer[1024];
+                ssize_t n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+                double secs;
+                unsigned long long started = 0;
+                if (n > 0) buffer[n] = 0;
+                if (n <= 0 || !parse_stat(buffer, secs, started)) {
+                        close(fd);
+                        return false;
+                }
+
+                // The same process as in CpuTime after a restart of the wrapper
+                // keeps counting from where it is, another one adds to the total
+                if (found != pid || started != start_time) {
+                        base += process_secs;
+                        process_secs = 0;
+                }
+                pid = found;
+                start_time = started;
+                stat_fd = fd;
+                sample();
+                LOG_NOTICE("Accounting the CPU time of the VM process " << pid << " (" << process_secs << " s so far)");
+                save();
+                return true;
+        }
+        #endif
+
+        // Follow the CPU time of the process of the VM vm
+        void start(const std::string &vm)
+        {
+                vm_name = vm;
+                load();
+                #if !defined(_WIN32) && !defined(__APPLE__)
+                search();
+                #endif
+        }
+
+        // Sample the CPU time, from the main loop. Cheap while the process
+        // is there: one pread(). Returns available().
+        bool update()
+        {
+                #if !defined(_WIN32) && !defined(__APPLE__)
+                if (stat_fd >= 0 && !sample()) {
+                        // The process is gone (VM stopped or started again)
+                        close(stat_fd);
+                        stat_fd = -1;
+                        save();
+                }
+                if (stat_fd < 0 && !vm_name.empty() && dtime() - last_search >= CPUTIME_SEARCH_PERIOD) search();
+                if (stat_fd >= 0 && dtime() - last_save >= CPUTIME_SAVE_PERIOD) {
+                        save();
+                        Trace::counter("vm cpu time", total());
+                }
+                #endif
+                return available();
+        }
+
+        // Forget the CPU time, when the work unit is over
+        void reset()
+        {
+                base = process_secs = 0;
+                pid = -1;
+                start_time = 0;
+                remove(CPU_TIME);
+        }
+}
+
+#endif // CPUTIME_H
@@ -0,0 +1,133 @@
+// CRC32C (Castagnoli) of the decompressed image
+//
+// Computed in the same pass as the decompression, so verifying the disk
+// costs no extra read. The SSE4.2 crc32 instruction is used when the CPU
+// has it and the compiler can target it without -msse4.2 (gcc >= 4.9,
+// MSVC); otherwise a slice-by-8 table does the work.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HW_GCC
+#include <cpuid.h>
+#include <nmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CRC32C_HW_MSVC
+#include <intrin.h>
+#include <nmmintrin.h>
+#endif
+
+namespace Crc32c
+{
+        typedef unsigned int uint32;
+
+        uint32 table[8][256];
+        bool table_ready = false;
+        int hardware = -1;      // unknown until the first call
+
+        void init_table()
+        {
+                for (uint32 i = 0; i < 256; i++) {
+                        uint32 crc = i;
+                        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+                        table[0][i] = crc;
+                }
+                for (uint32 i = 0; i < 256; i++) {
+                        for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+                }
+                table_ready = true;
+        }
+
+        uint32 update_table(uint32 crc, const unsigned char *p, size_t n)
+        {
+                if (!table_ready) init_table();
+                while (n && ((size_t)p & 7)) {
+                        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+                        n--;
+                }
+                #ifndef __BIG_ENDIAN__
+                while (n >= 8) {
+                        uint32 lo, hi;
+                        memcpy(&lo, p, 4);
+                        memcpy(&hi, p + 4, 4);
+                        lo ^= crc;
+                        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+                              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+                              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+                              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+                        p += 8;
+                        n -= 8;
+                }
+                #endif
+                while (n--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+                return crc;
+        }
+
+        #if defined(CRC32C_HW_GCC) || defined(CRC32C_HW_MSVC)
+        #ifdef CRC32C_HW_GCC
+        __attribute__((target("sse4.2")))
+        #endif
+        uint32 update_hw(uint32 crc, const unsigned char *p, size_t n)
+        {
+                #if defined(__x86_64__) || defined(_M_X64)
+                unsigned long long crc64 = crc;
+                while (n && ((size_t)p & 7)) {
+                        crc64 = _mm_crc32_u8((uint32)crc64, *p++);
+                        n--;
+                }
+                while (n >= 8) {
+                        unsigned long long v;
+                        memcpy(&v, p, 8);
+                        crc64 = _mm_crc32_u64(crc64, v);
+                        p += 8;
+                        n -= 8;
+                }
+                crc = (uint32)crc64;
+                #else
+                while (n >= 4) {
+                        uint32 v;
+                        memcpy(&v, p, 4);
+                        crc = _mm_crc32_u32(crc, v);
+                        p += 4;
+                        n -= 4;
+                }
+                #endif
+                while (n--) crc = _mm_crc32_u8(crc, *p++);
+                return crc;
+        }
+        #endif
+
+        bool has_hardware()
+        {
+                if (hardware < 0) {
+                        hardware = 0;
+                        #if defined(CRC32C_HW_GCC)
+                        unsigned int eax, ebx, ecx, edx;
+                        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) hardware = (ecx & bit_SSE4_2) ? 1 : 0;
+                        #elif defined(CRC32C_HW_MSVC)
+                        int info[4];
+                        __cpuid(info, 1);
+                        hardware = (info[2] & (1 << 20)) ? 1 : 0;
+                        #endif
+                }
+                return (hardware == 1);
+        }
+
+        // crc = Crc32c::update(crc, data, size), starting from 0
+        uint32 update(uint32 crc, const void *data, size_t n)
+        {
+                const unsigned char *p = static_cast<const unsigned char *>(data);
+                crc = ~crc;
+                #if defined(CRC32C_HW_GCC) || defined(CRC32C_HW_MSVC)
+                if (has_hardware()) return ~update_hw(crc, p, n);
+                #endif
+                return ~update_table(crc, p, n);
+        }
+}
+
+#endif // CRC32C_H
@@ -8,19 +8,21 @@
 // For the guest-side, check the perl scripts that
 // were available with this code.
 // 
-// Here is the layout of the floppy disk image (Example of 28k):
+// The layout of the image is described in floppyLayout.h.
 //
-// +-----------------+------------------------------------------------+
-// | 0x0000 - 0x37FF |  Hypervisor -> Guest Buffer                    |
-// | 0x3800 - 0x6FFE |  Guest -> Hypervisor Buffer                    |
-// |     0x6FFF      |  "Data available for guest" flag byte          |
-// |     0x7000      |  "Data available for hypervisor" flag byte     |
-// +-----------------+------------------------------------------------+
-// 
 // Created on November 24, 2011, 12:30 PM
 
 #include "floppyIO.h"
 
+#include <time.h>
+#include "zlib.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
 
 // Floppy file constructor
 // 
@@ -30,25 +32,7 @@
 // @param filename The filename of the floppy disk image
 
 FloppyIO::FloppyIO(const char * filename) {
-    
-  // Open file
-  fstream *fIO = new fstream(filename, fstream::in | fstream::out | fstream::trunc);
-  
-  // Prepare floppy info
-  this->fIO = fIO;
-  this->szFloppy = DEFAULT_FLOPPY_SIZE;
-  
-  // Setup offsets and sizes of the I/O parts
-  this->szOutput = this->szFloppy/2-1;
-  this->ofsOutput = 0;
-  this->szInput = this->szOutput;
-  this->ofsInput = this->szOutput;
-  this->ofsCtrlByteOut = this->szInput+this->szOutput;
-  this->ofsCtrlByteIn = this->szInput+this->szOutput+1;
-  
-  // Reset floppy file
-  this->reset();
-
+  this->open(filename, 0, DEFAULT_FLOPPY_SIZE);
 }
 
 // Advanced Floppy file constructor
@@ -59,15 +43,36 @@ FloppyIO::FloppyIO(const char * filename) {
 // F_NOCREATE       Does not truncate the file at open (If not exists, the file will be created)
 // F_SYNCHRONIZED   The communication is synchronized, meaning that the code will block until the 
 //                  data are read/written from the guest. [NOT YET IMPLEMENTED]
+// F_GUEST          Talks to the hypervisor instead of the guest
 // 
 // @param filename The filename of the floppy disk image
 
 FloppyIO::FloppyIO(const char * filename, int flags) {
+  this->open(filename, flags, DEFAULT_FLOPPY_SIZE);
+}
+
+// Floppy file constructor with another geometry
+//
+// Both sides have to use the same size. Up to MAX_FLOPPY_SIZE, the size of
+// a real 1.44 Mb floppy, which VirtualBox also accepts.
+//
+// @param size The size of the floppy disk image in bytes
+
+FloppyIO::FloppyIO(const char * filename, int flags, int size) {
+  this->open(filename, flags, floppySize(size));
+}
+
+void FloppyIO::open(const char * filename, int flags, int size) {
     
   // Open file
   ios_base::openmode fOpenFlags = fstream::in | fstream::out;
-  if ((flags & F_NOCREATE) == 0) fOpenFlags = fstream::trunc;
+  if ((flags & F_NOCREATE) == 0) fOpenFlags |= fstream::trunc;
   fstream *fIO = new fstream(filename, fOpenFlags);
+  this->fIO = fIO;
+  this->szFloppy = size;
+
+  // Frames and received messages go through this buffer, allocated once
+  this->buffer = new char[this->szFloppy/2];
   
   // Check for errors while F_NOCREATE is there
   if ((flags & F_NOCREATE) != 0) {
@@ -93,16 +98,16 @@ FloppyIO::FloppyIO(const char * filename, int flags) {
   }
   
   // Prepare floppy info
-  this->fIO = fIO;
-  this->szFloppy = DEFAULT_FLOPPY_SIZE;
   
-  // Setup offsets and sizes of the I/O parts
-  this->szOutput = this->szFloppy/2-1;
-  this->ofsOutput = 0;
-  this->szInput = this->szOutput;
-  this->ofsInput = this->szOutput;
-  this->ofsCtrlByteOut = this->szInput+this->szOutput;
-  this->ofsCtrlByteIn = this->szInput+this->szOutput+1;
+  // Setup offsets and sizes of the I/O parts. The guest writes where
+  // the hypervisor reads.
+  FloppyLayout layout = floppyLayout(this->szFloppy, (flags & F_GUEST) != 0);
+  this->szOutput = layout.szOutput;
+  this->ofsOutput = layout.ofsOutput;
+  this->szInput = layout.szInput;
+  this->ofsInput = layout.ofsInput;
+  this->ofsCtrlByteOut = layout.ofsCtrlByteOut;
+  this->ofsCtrlByteIn = layout.ofsCtrlByteIn;
   
   // Reset floppy file
   if ((flags & F_NOINIT) == 0) this->reset();
@@ -119,76 +124,240 @@ FloppyIO::~FloppyIO() {
     
     // Release memory
     delete this->fIO;
+    delete[] this->buffer;
 }
 
 // Reset the floppy disk image
 // This function zeroes-out the contents of the FD image
  
 void FloppyIO::reset() {
+  static const char zeroes[4096] = { 0 };
   this->fIO->seekp(0);
-  char * buffer = new char[this->szFloppy];
-  this->fIO->write(buffer, this->szFloppy);
-  delete[] buffer;      
+  for (int left = this->szFloppy; left > 0; left -= sizeof(zeroes)) {
+    this->fIO->write(zeroes, (left < (int)sizeof(zeroes)) ? left : sizeof(zeroes));
+  }
+  this->fIO->flush();
 }
 
 // Send data to the floppy image I/O
-// @param data
-// @return 
-void FloppyIO::send(string strData) {
-    // Prepare send buffer
-    char * dataToSend = new char[this->szOutput];
-    memset(dataToSend, 0, this->szOutput);
-    
-    // Initialize variables
-    int szData = strData.length();
-    int szPad = 0;
-    
-    // Copy the first szInput bytes
-    if (szData > this->szOutput-1) {
+// The data are written with their terminating null byte, which is where
+// the reader stops, so nothing is copied or allocated.
+// @param data The bytes to send
+// @param size Their number, cut to szOutput-1
+void FloppyIO::send(const char * data, size_t size) {
+    if (size > (size_t)this->szOutput-1) {
         // Data more than the pad size? Trim...
-        strData.copy(dataToSend, this->szOutput-1, 0);
-    } else {
-        // Else, copy the string to send buffer
-        strData.copy(dataToSend, szData, 0);
+        cerr << "FloppyIO: " << size << " bytes do not fit in the buffer, sending the first "
+             << this->szOutput-1 << " (use sendChunked)\n";
+        size = this->szOutput-1;
     }
     
     // Write the data to file
+    this->fIO->clear();
     this->fIO->seekp(this->ofsOutput);
-    this->fIO->write(dataToSend, this->szOutput);
+    this->fIO->write(data, size);
+    this->fIO->write("", 1);
     
     // Notify the client that we placed data (Client should clear this on read)
-    this->fIO->seekp(this->ofsCtrlByteOut);
-    this->fIO->write("\x01", 1);
+    this->writeCtrl(this->ofsCtrlByteOut, FLOPPY_CTRL_DATA);
     
 }
 
+void FloppyIO::send(const string &strData) {
+    this->send(strData.data(), strData.size());
+}
 
-// Receive the input buffer contents
-// @return Returns a string object with the file contents
 
-string FloppyIO::receive() {
-    static string ansBuffer;
-    char * dataToReceive = new char[this->szInput];
-    int dataLength = this->szInput;
+// Check if the guest has placed data in the input buffer
+// @return Returns true if the "Data available for hypervisor" flag is set
+
+bool FloppyIO::available() {
+    return (this->readCtrl(this->ofsCtrlByteIn) == FLOPPY_CTRL_DATA);
+}
+
+
+// Receive the input buffer contents into a buffer of the caller
+// @param data The buffer, always null-terminated
+// @param size Its size
+// @return Returns the length of the data, without the null byte
+
+size_t FloppyIO::receive(char * data, size_t size) {
+    if (size == 0) return 0;
+    size_t toRead = (size-1 < (size_t)this->szInput) ? size-1 : this->szInput;
     
-    // Find the size of the input string
-    for (int i=0; i<this->szInput; i++) {
-        if (dataToReceive[0] == '\0') {
-            dataLength=i;
+    // Read the input bytes from FD, a block at a time up to the null
+    // byte that ends the data, instead of the whole buffer
+    this->fIO->clear();
+    this->fIO->seekg(this->ofsInput, ios_base::beg);
+    size_t dataLength = 0;
+    while (dataLength < toRead) {
+        size_t block = (toRead - dataLength < FLOPPY_READ_BLOCK) ? toRead - dataLength : FLOPPY_READ_BLOCK;
+        this->fIO->read(data + dataLength, block);
+        size_t got = this->fIO->gcount();
+        const char * end = (const char *)memchr(data + dataLength, '\0', got);
+        if (end) {
+            dataLength = end - data;
             break;
         }
+        dataLength += got;
+        if (got < block) break;
     }
-    
-    // Read the input bytes from FD
-    this->fIO->seekg(this->ofsInput, ios_base::beg);
-    this->fIO->read(dataToReceive, this->szInput);
+    this->fIO->clear();
     
     // Notify the client that we have read the data
-    this->fIO->seekp(this->ofsCtrlByteIn);
-    this->fIO->write("\x00", 1);
+    this->writeCtrl(this->ofsCtrlByteIn, FLOPPY_CTRL_EMPTY);
     
-    // Copy input data to string object
-    ansBuffer = dataToReceive;
-    return ansBuffer;
+    data[dataLength] = '\0';
+    return dataLength;
     
 }
+
+// Receive the input buffer contents
+// @return Returns a string object with the file contents
+
+string FloppyIO::receive() {
+    size_t dataLength = this->receive(this->buffer, this->szInput+1);
+    return string(this->buffer, dataLength);
+}
+
+
+// Control bytes
+// The stream is flushed, so the other side sees the value at once
+
+int FloppyIO::readCtrl(int offset) {
+    char value = 0;
+    this->fIO->clear();
+    this->fIO->seekg(offset, ios_base::beg);
+    this->fIO->read(&value, 1);
+    if (this->fIO->fail()) {
+        this->fIO->clear();
+        return -1;
+    }
+    return (unsigned char)value;
+}
+
+void FloppyIO::writeCtrl(int offset, char value) {
+    this->fIO->clear();
+    this->fIO->seekp(offset);
+    this->fIO->write(&value, 1);
+    this->fIO->flush();
+}
+
+// Wait while the control byte at offset is busy
+// @return Returns false on timeout
+
+bool FloppyIO::waitCtrl(int offset, int busy, int timeout) {
+    time_t deadline = time(NULL) + timeout;
+    while (this->readCtrl(offset) == busy) {
+        if (time(NULL) > deadline) return false;
+#ifdef _WIN32
+        Sleep(FLOPPY_POLL_USEC / 1000 ? FLOPPY_POLL_USEC / 1000 : 1);
+#else
+        usleep(FLOPPY_POLL_USEC);
+#endif
+    }
+    return true;
+}
+
+// Check if the peer has placed a frame in the input buffer
+
+bool FloppyIO::frameAvailable() {
+    return (this->readCtrl(this->ofsCtrlByteIn) == FLOPPY_CTRL_FRAME);
+}
+
+// Send a message of any size as a sequence of frames
+// @param strData The message
+// @param timeout Seconds to wait for the peer to take each frame
+// @return Returns false if the peer did not acknowledge a frame
+
+bool FloppyIO::sendChunked(const string &strData, int timeout) {
+    int szChunk = this->szOutput - FLOPPY_FRAME_HEADER;
+    unsigned char * frame = (unsigned char *)this->buffer;
+    unsigned long total = strData.size();
+    unsigned long offset = 0;
+    unsigned long seq = 0;
+
+    do {
+        unsigned long length = total - offset;
+        if (length > (unsigned long)szChunk) length = szChunk;
+        const unsigned char * chunk = (const unsigned char *)strData.data() + offset;
+
+        floppyFrameHeader(frame, seq, total, length, offset + length == total,
+                          crc32(crc32(0L, Z_NULL, 0), chunk, length));
+        if (length) memcpy(&frame[FLOPPY_FRAME_HEADER], chunk, length);
+
+        int retries = 0;
+        for (;;) {
+            // The previous frame must have been taken
+            if (!this->waitCtrl(this->ofsCtrlByteOut, FLOPPY_CTRL_FRAME, timeout)) return false;
+
+            this->fIO->clear();
+            this->fIO->seekp(this->ofsOutput);
+            this->fIO->write((const char *)&frame[0], FLOPPY_FRAME_HEADER + length);
+            this->writeCtrl(this->ofsCtrlByteOut, FLOPPY_CTRL_FRAME);
+
+            // Cleared when the peer has taken the frame, NAK if it was damaged
+            if (!this->waitCtrl(this->ofsCtrlByteOut, FLOPPY_CTRL_FRAME, timeout)) return false;
+            if (this->readCtrl(this->ofsCtrlByteOut) != FLOPPY_CTRL_NAK) break;
+            if (++retries > FLOPPY_FRAME_RETRIES) return false;
+        }
+
+        offset += length;
+        seq++;
+    } while (offset < total);
+    return true;
+}
+
+// Receive a message sent with sendChunked
+// @param strData The message
+// @param timeout Seconds to wait for each frame
+// @return Returns false on timeout or if the frames are not consistent
+
+bool FloppyIO::receiveChunked(string &strData, int timeout) {
+    unsigned char * frame = (unsigned char *)this->buffer;
+    unsigned long expected = 0;
+    unsigned long total = 0;
+
+    strData.clear();
+    for (;;) {
+        time_t deadline = time(NULL) + timeout;
+        while (!this->frameAvailable()) {
+            if (time(NULL) > deadline) return false;
+#ifdef _WIN32
+            Sleep(FLOPPY_POLL_USEC / 1000 ? FLOPPY_POLL_USEC / 1000 : 1);
+#else
+            usleep(FLOPPY_POLL_USEC);
+#endif
+        }
+
+        this->fIO->clear();
+        this->fIO->seekg(this->ofsInput, ios_base::beg);
+        this->fIO->read((char *)&frame[0], this->szInput);
+        if (this->fIO->fail()) this->fIO->clear();
+
+        unsigned long seq = floppyGetLE32(&frame[4]);
+        unsigned long length = floppyGetLE32(&frame[12]);
+        bool valid = floppyFrameHeaderValid(frame, this->szInput) &&
+                     (crc32(crc32(0L, Z_NULL, 0), &frame[FLOPPY_FRAME_HEADER], length) == floppyGetLE32(&frame[16]));
+        if (!valid) {
+            this->writeCtrl(this->ofsCtrlByteIn, FLOPPY_CTRL_NAK);
+            continue;
+        }
+        if (seq != expected) {
+            // A frame sent again because our ack was lost
+            this->writeCtrl(this->ofsCtrlByteIn, FLOPPY_CTRL_EMPTY);
+            if (seq + 1 == expected) continue;
+            return false;
+        }
+
+        if (seq == 0) {
+            total = floppyGetLE32(&frame[8]);
+            strData.reserve(total);
+        }
+        strData.append((const char *)&frame[FLOPPY_FRAME_HEADER], length);
+        this->writeCtrl(this->ofsCtrlByteIn, FLOPPY_CTRL_EMPTY);
+        expected++;
+
+        if (frame[3] & FLOPPY_FRAME_LAST) return (strData.size() == total);
+    }
+}
@@ -8,15 +8,8 @@
 //  For the guest-side, check the perl scripts that
 //  were available with this code.
 //  
-//  Here is the layout of the floppy disk image (Example of 28k):
-// 
-//  +-----------------+------------------------------------------------+
-//  | 0x0000 - 0x37FF |  Hypervisor -> Guest Buffer                    |
-//  | 0x3800 - 0x6FFE |  Guest -> Hypervisor Buffer                    |
-//  |     0x6FFF      |  "Data available for guest" flag byte          |
-//  |     0x7000      |  "Data available for hypervisor" flag byte     |
-//  +-----------------+------------------------------------------------+
-//  
+//  The layout of the image is described in floppyLayout.h.
+//
 //  Created on November 24, 2011, 12:30 PM
 
 #ifndef FLOPPYIO_H
@@ -26,6 +19,9 @@
 #include <fstream>
 #include <string.h>
 
+#include "channel.h"
+#include "floppyLayout.h"
+
 using namespace std;
 
 
@@ -47,28 +43,45 @@ using namespace std;
 
 #define F_SYNCHRONIZED 4
 
-// Default floppy disk size (In bytes)
-// 
-// VirtualBox complains if bigger than 28K
-// It's supposed to go till 1474560 however (!.44 Mb)
+// Open the image from the guest side: the buffers and the control
+// bytes are swapped, so the same class talks to the hypervisor.
+// (Flag used at FloppyIO constructor)
 
-#define DEFAULT_FLOPPY_SIZE 28672
+#define F_GUEST 8
+
+// The layout of the image, the control byte values and the frames of the
+// chunked transfers are in floppyLayout.h, shared with the guest tools.
+
+// Microseconds between two looks at a control byte
+#define FLOPPY_POLL_USEC 1000
+// Bytes read at a time by receive(), which stops at the end of the data
+#define FLOPPY_READ_BLOCK 4096
 
 
 // Floppy I/O Communication class
 
-class FloppyIO {
+class FloppyIO : public Channel {
 public:
     
     // Construcors
     FloppyIO(const char * filename);
     FloppyIO(const char * filename, int flags);
+    FloppyIO(const char * filename, int flags, int size);
     virtual ~FloppyIO();
     
     // Functions
     void        reset();
-    void        send(string strData);
+    void        send(const char * data, size_t size);
+    void        send(const string &strData);
+    size_t      receive(char * data, size_t size);
     string      receive();
+    bool        available();
+
+    // Chunked transfers of messages of any size. They block until the
+    // peer has acknowledged (or sent) every frame, or for timeout seconds.
+    bool        sendChunked(const string &strData, int timeout);
+    bool        receiveChunked(string &strData, int timeout);
+    bool        frameAvailable();
     
     // Topology info
     int     ofsInput;   // Input buffer offset & size
@@ -84,6 +97,12 @@ private:
     // Floppy Info
     fstream * fIO;
     int     szFloppy;
+    char *  buffer;     // szFloppy/2 bytes, a frame or a received message
+
+    void        open(const char * filename, int flags, int size);
+    int         readCtrl(int offset);
+    void        writeCtrl(int offset, char value);
+    bool        waitCtrl(int offset, int busy, int timeout);
     
 };
 
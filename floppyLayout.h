@@ -0,0 +1,139 @@
+//  File:   floppyLayout.h
+//
+//  Layout of the floppy disk image shared by the hypervisor (FloppyIO) and
+//  the guest tools (floppyio-guest/), so that both sides compute the same
+//  offsets and frames.
+//
+//  Here is the layout of the floppy disk image (Example of 28k):
+//
+//  +-----------------+------------------------------------------------+
+//  | 0x0000 - 0x37FE |  Hypervisor -> Guest Buffer                    |
+//  | 0x37FF - 0x6FFD |  Guest -> Hypervisor Buffer                    |
+//  |     0x6FFE      |  "Data available for guest" flag byte          |
+//  |     0x6FFF      |  "Data available for hypervisor" flag byte     |
+//  +-----------------+------------------------------------------------+
+
+#ifndef FLOPPYLAYOUT_H
+#define FLOPPYLAYOUT_H
+
+// Default floppy disk size (In bytes)
+//
+// VirtualBox complains if bigger than 28K
+// It's supposed to go till 1474560 however (!.44 Mb)
+
+#define DEFAULT_FLOPPY_SIZE 28672
+#define MAX_FLOPPY_SIZE 1474560
+#define MIN_FLOPPY_SIZE 1024
+
+// Control byte values
+//
+// A sender sets its control byte, the receiver clears it once the data
+// are read. Chunked transfers use FRAME instead of DATA, and the receiver
+// answers NAK when a chunk does not match its checksum.
+
+#define FLOPPY_CTRL_EMPTY 0
+#define FLOPPY_CTRL_DATA  1
+#define FLOPPY_CTRL_FRAME 2
+#define FLOPPY_CTRL_NAK   3
+
+// Chunked transfers
+//
+// Messages longer than a buffer are sent as a sequence of frames, one at a
+// time, each acknowledged by the receiver before the next one is written.
+// A frame is a 20-byte header followed by the chunk, all numbers are
+// little-endian:
+//
+//  +--------+--------------------------------------------------------+
+//  | 0 - 1  |  "FC" magic                                            |
+//  |   2    |  Version (1)                                          |
+//  |   3    |  Flags (1 = last frame of the message)                |
+//  | 4 - 7  |  Sequence number, from 0                              |
+//  | 8 - 11 |  Total length of the message                          |
+//  | 12 - 15|  Length of this chunk                                 |
+//  | 16 - 19|  CRC-32 (zlib) of the chunk                           |
+//  +--------+--------------------------------------------------------+
+
+#define FLOPPY_FRAME_HEADER 20
+#define FLOPPY_FRAME_VERSION 1
+#define FLOPPY_FRAME_LAST 1
+// Times a chunk is sent again after a NAK
+#define FLOPPY_FRAME_RETRIES 5
+
+
+// Offsets and sizes of the buffers and control bytes, as seen from one side
+
+struct FloppyLayout {
+    int     szFloppy;
+    int     ofsInput;       // Input buffer offset & size
+    int     szInput;
+    int     ofsOutput;      // Output buffer offset & size
+    int     szOutput;
+    int     ofsCtrlByteIn;  // Control byte offset for input
+    int     ofsCtrlByteOut; // Control byte offset for output
+};
+
+// A size both sides accept: MIN_FLOPPY_SIZE to MAX_FLOPPY_SIZE, even
+
+inline int floppySize(int size) {
+    if (size < MIN_FLOPPY_SIZE) size = MIN_FLOPPY_SIZE;
+    if (size > MAX_FLOPPY_SIZE) size = MAX_FLOPPY_SIZE;
+    return size & ~1;
+}
+
+// The layout of a floppy of size bytes, from the hypervisor side or,
+// when guest is true, from the guest side: the buffers and the control
+// bytes are swapped.
+
+inline FloppyLayout floppyLayout(int size, bool guest) {
+    FloppyLayout l;
+    l.szFloppy = size;
+    l.szOutput = size/2-1;
+    l.szInput = l.szOutput;
+    if (!guest) {
+        l.ofsOutput = 0;
+        l.ofsInput = l.szOutput;
+        l.ofsCtrlByteOut = l.szInput+l.szOutput;
+        l.ofsCtrlByteIn = l.szInput+l.szOutput+1;
+    } else {
+        l.ofsOutput = l.szInput;
+        l.ofsInput = 0;
+        l.ofsCtrlByteOut = l.szInput+l.szOutput+1;
+        l.ofsCtrlByteIn = l.szInput+l.szOutput;
+    }
+    return l;
+}
+
+inline void floppyPutLE32(unsigned char * p, unsigned long v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+inline unsigned long floppyGetLE32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// Fill the header of a frame, crc is the CRC-32 of the chunk
+
+inline void floppyFrameHeader(unsigned char * frame, unsigned long seq, unsigned long total,
+                              unsigned long length, bool last, unsigned long crc) {
+    frame[0] = 'F';
+    frame[1] = 'C';
+    frame[2] = FLOPPY_FRAME_VERSION;
+    frame[3] = last ? FLOPPY_FRAME_LAST : 0;
+    floppyPutLE32(&frame[4], seq);
+    floppyPutLE32(&frame[8], total);
+    floppyPutLE32(&frame[12], length);
+    floppyPutLE32(&frame[16], crc);
+}
+
+// Whether the header of a frame read from a buffer of szBuffer bytes is
+// sound. The CRC-32 of the chunk is left to the caller.
+
+inline bool floppyFrameHeaderValid(const unsigned char * frame, int szBuffer) {
+    return (frame[0] == 'F') && (frame[1] == 'C') && (frame[2] == FLOPPY_FRAME_VERSION) &&
+           (floppyGetLE32(&frame[12]) <= (unsigned long)szBuffer - FLOPPY_FRAME_HEADER);
+}
+
+#endif // FLOPPYLAYOUT_H
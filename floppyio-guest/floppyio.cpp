@@ -0,0 +1,297 @@
+// File:   floppyio.cpp
+//
+// Guest side of the floppy channel, a native replacement for read.pl and
+// write.pl built from the same layout as FloppyIO (floppyLayout.h):
+//
+//     floppyio read [--chunked] [--size BYTES] [--floppy DEV] [--timeout SECONDS] > my_config.sh
+//     printf "PROGRESS=0.42\n" | floppyio write [--chunked] ...
+//
+// read writes the message of the hypervisor to STDOUT, write sends STDIN
+// to it. --chunked reads or sends the frames of FloppyIO::sendChunked and
+// FloppyIO::receiveChunked, for messages longer than a buffer.
+//
+// The floppy is read and written a whole sector at a time with O_DIRECT,
+// so every read sees what the hypervisor wrote instead of a stale page of
+// the cache, without read.pl's trick of writing the control byte first.
+// Where O_DIRECT is refused (an image file on tmpfs, for testing) the
+// cached pages are dropped with posix_fadvise(POSIX_FADV_DONTNEED) before
+// every read and the writes are pushed with fdatasync().
+//
+// Build it in the guest, or statically on the host (make floppyio-guest/floppyio):
+//
+//     g++ -O2 -I.. -o floppyio floppyio.cpp -lz
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+
+#include "zlib.h"
+#include "floppyLayout.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+// Unit of the I/O with the floppy, and alignment of the buffer for O_DIRECT
+#define SECTOR_SIZE 512
+// Bytes read at a time when looking for the end of a message
+#define READ_BLOCK 4096
+// Microseconds between two looks at a control byte
+#define POLL_USEC 1000
+
+class GuestFloppy {
+public:
+    GuestFloppy() : image(NULL), fd(-1), direct(false) {}
+
+    ~GuestFloppy() {
+        if (fd >= 0) close(fd);
+        free(image);
+    }
+
+    bool open(const char * path, int size) {
+        layout = floppyLayout(floppySize(size), true);
+        szImage = (layout.szFloppy + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        if (posix_memalign((void **)&image, SECTOR_SIZE, szImage) != 0) return false;
+        memset(image, 0, szImage);
+
+        fd = ::open(path, O_RDWR | O_DIRECT);
+        direct = (fd >= 0) && (O_DIRECT != 0);
+        if (fd < 0 && errno == EINVAL) fd = ::open(path, O_RDWR);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Copy size bytes at offset of the floppy to data
+    bool read(int offset, void * data, int size) {
+        if (!load(offset, size)) return false;
+        if (data != image + offset) memcpy(data, image + offset, size);
+        return true;
+    }
+
+    // Write size bytes of data at offset. The sectors they share with
+    // other data are read first.
+    bool write(int offset, const void * data, int size) {
+        int first = offset / SECTOR_SIZE * SECTOR_SIZE;
+        int end = span_end(offset + size);
+        if (offset != first && !load(first, SECTOR_SIZE)) return false;
+        if ((offset + size) % SECTOR_SIZE && !load(end - SECTOR_SIZE, SECTOR_SIZE)) return false;
+        memcpy(image + offset, data, size);
+        if (pwrite(fd, image + first, end - first, first) != end - first) {
+            fprintf(stderr, "Error writing the floppy: %s\n", strerror(errno));
+            return false;
+        }
+        if (!direct) fdatasync(fd);
+        return true;
+    }
+
+    int ctrl(int offset) {
+        unsigned char value;
+        if (!read(offset, &value, 1)) return -1;
+        return value;
+    }
+
+    bool setCtrl(int offset, unsigned char value) {
+        return write(offset, &value, 1);
+    }
+
+    // Wait while the control byte at offset is busy (or until it is
+    // value, when until is true). Returns false on timeout or error.
+    bool waitCtrl(int offset, int value, int timeout, bool until = false) {
+        time_t deadline = time(NULL) + timeout;
+        for (;;) {
+            int current = ctrl(offset);
+            if (current < 0) return false;
+            if ((current == value) == until) return true;
+            if (time(NULL) > deadline) return false;
+            usleep(POLL_USEC);
+        }
+    }
+
+    FloppyLayout layout;
+    unsigned char * image;  // the floppy as last read, sector-aligned
+
+private:
+    int fd;
+    bool direct;
+    int szImage;
+
+    // The end of the sectors up to end, within the image
+    int span_end(int end) {
+        end = (end + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        // Without O_DIRECT the image file is not made longer
+        if (!direct && end > layout.szFloppy) end = layout.szFloppy;
+        return end;
+    }
+
+    // Read the sectors of size bytes at offset into image
+    bool load(int offset, int size) {
+        int first = offset / SECTOR_SIZE * SECTOR_SIZE;
+        int end = span_end(offset + size);
+        if (!direct) posix_fadvise(fd, first, end - first, POSIX_FADV_DONTNEED);
+        ssize_t n = pread(fd, image + first, end - first, first);
+        int needed = ((offset + size < layout.szFloppy) ? offset + size : layout.szFloppy) - first;
+        if (n < needed) {
+            fprintf(stderr, "Error reading the floppy: %s\n", n < 0 ? strerror(errno) : "short read");
+            return false;
+        }
+        return true;
+    }
+};
+
+// The message in the input buffer, up to its null byte
+bool readMessage(GuestFloppy &floppy) {
+    FloppyLayout &l = floppy.layout;
+    // Notify the hypervisor that we have read the data
+    if (!floppy.setCtrl(l.ofsCtrlByteIn, FLOPPY_CTRL_EMPTY)) return false;
+    for (int offset = 0; offset < l.szInput; offset += READ_BLOCK) {
+        int size = (l.szInput - offset < READ_BLOCK) ? l.szInput - offset : READ_BLOCK;
+        if (!floppy.read(l.ofsInput + offset, floppy.image + l.ofsInput + offset, size)) return false;
+        const char * data = (const char *)floppy.image + l.ofsInput + offset;
+        const char * end = (const char *)memchr(data, '\0', size);
+        fwrite(data, 1, end ? end - data : size, stdout);
+        if (end) break;
+    }
+    return true;
+}
+
+bool writeMessage(GuestFloppy &floppy, std::string data) {
+    FloppyLayout &l = floppy.layout;
+    if (data.size() > (size_t)l.szOutput - 1) {
+        fprintf(stderr, "Reached EOF, cutting %d out of %lu\n", l.szOutput - 1, (unsigned long)data.size());
+        data.resize(l.szOutput - 1);
+    }
+    data += '\0';
+    // Notify the hypervisor that there are data in the buffer
+    // (It should then clear this byte when it's read)
+    return floppy.write(l.ofsOutput, data.data(), data.size()) &&
+           floppy.setCtrl(l.ofsCtrlByteOut, FLOPPY_CTRL_DATA);
+}
+
+bool readChunked(GuestFloppy &floppy, int timeout) {
+    FloppyLayout &l = floppy.layout;
+    unsigned long expected = 0, received = 0, total = 0;
+    for (;;) {
+        if (!floppy.waitCtrl(l.ofsCtrlByteIn, FLOPPY_CTRL_FRAME, timeout, true)) {
+            fprintf(stderr, "Timeout waiting for frame %lu\n", expected);
+            return false;
+        }
+
+        // The header first, then only the sectors of the chunk
+        unsigned char * frame = floppy.image + l.ofsInput;
+        if (!floppy.read(l.ofsInput, frame, FLOPPY_FRAME_HEADER)) return false;
+        unsigned long seq = floppyGetLE32(&frame[4]);
+        unsigned long length = floppyGetLE32(&frame[12]);
+        bool valid = floppyFrameHeaderValid(frame, l.szInput);
+        if (valid && !floppy.read(l.ofsInput + FLOPPY_FRAME_HEADER, frame + FLOPPY_FRAME_HEADER, length)) return false;
+        valid = valid && (crc32(crc32(0L, Z_NULL, 0), frame + FLOPPY_FRAME_HEADER, length) == floppyGetLE32(&frame[16]));
+        if (!valid) {
+            // Damaged, ask for it again
+            floppy.setCtrl(l.ofsCtrlByteIn, FLOPPY_CTRL_NAK);
+            continue;
+        }
+        if (seq != expected) {
+            // Sent again because our acknowledgment was lost
+            floppy.setCtrl(l.ofsCtrlByteIn, FLOPPY_CTRL_EMPTY);
+            if (seq + 1 == expected) continue;
+            fprintf(stderr, "Frame %lu received, %lu expected\n", seq, expected);
+            return false;
+        }
+
+        fwrite(frame + FLOPPY_FRAME_HEADER, 1, length, stdout);
+        total = floppyGetLE32(&frame[8]);
+        received += length;
+        expected++;
+        bool last = (frame[3] & FLOPPY_FRAME_LAST) != 0;
+        floppy.setCtrl(l.ofsCtrlByteIn, FLOPPY_CTRL_EMPTY);
+        if (last) break;
+    }
+    if (received != total) {
+        fprintf(stderr, "Received %lu bytes out of %lu\n", received, total);
+        return false;
+    }
+    return true;
+}
+
+bool writeChunked(GuestFloppy &floppy, const std::string &data, int timeout) {
+    FloppyLayout &l = floppy.layout;
+    unsigned long total = data.size(), offset = 0, seq = 0;
+    unsigned long szChunk = l.szOutput - FLOPPY_FRAME_HEADER;
+    std::string frame(l.szOutput, '\0');
+    do {
+        unsigned long length = (total - offset < szChunk) ? total - offset : szChunk;
+        const unsigned char * chunk = (const unsigned char *)data.data() + offset;
+        floppyFrameHeader((unsigned char *)&frame[0], seq, total, length, offset + length == total,
+                          crc32(crc32(0L, Z_NULL, 0), chunk, length));
+        if (length) memcpy(&frame[FLOPPY_FRAME_HEADER], chunk, length);
+
+        int retries = 0;
+        for (;;) {
+            if (!floppy.waitCtrl(l.ofsCtrlByteOut, FLOPPY_CTRL_FRAME, timeout)) {
+                fprintf(stderr, "Timeout waiting for the hypervisor\n");
+                return false;
+            }
+            if (!floppy.write(l.ofsOutput, frame.data(), FLOPPY_FRAME_HEADER + length) ||
+                !floppy.setCtrl(l.ofsCtrlByteOut, FLOPPY_CTRL_FRAME)) return false;
+            if (!floppy.waitCtrl(l.ofsCtrlByteOut, FLOPPY_CTRL_FRAME, timeout)) {
+                fprintf(stderr, "Timeout waiting for frame %lu to be acknowledged\n", seq);
+                return false;
+            }
+            if (floppy.ctrl(l.ofsCtrlByteOut) != FLOPPY_CTRL_NAK) break;
+            if (++retries > FLOPPY_FRAME_RETRIES) {
+                fprintf(stderr, "Frame %lu damaged %d times\n", seq, retries - 1);
+                return false;
+            }
+        }
+        offset += length;
+        seq++;
+    } while (offset < total);
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    const char * device = "/dev/fd0";
+    int size = DEFAULT_FLOPPY_SIZE;
+    int timeout = 60;
+    bool chunked = false;
+    std::string command;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--chunked")) chunked = true;
+        else if (!strcmp(argv[i], "--size") && i+1 < argc) size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--floppy") && i+1 < argc) device = argv[++i];
+        else if (!strcmp(argv[i], "--timeout") && i+1 < argc) timeout = atoi(argv[++i]);
+        else if (command.empty() && (!strcmp(argv[i], "read") || !strcmp(argv[i], "write"))) command = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s read|write [--chunked] [--size BYTES] [--floppy DEV] [--timeout SECONDS]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (command.empty()) {
+        fprintf(stderr, "Usage: %s read|write [--chunked] [--size BYTES] [--floppy DEV] [--timeout SECONDS]\n", argv[0]);
+        return 2;
+    }
+
+    GuestFloppy floppy;
+    if (!floppy.open(device, size)) return 1;
+
+    bool ok;
+    if (command == "read") {
+        ok = chunked ? readChunked(floppy, timeout) : readMessage(floppy);
+    } else {
+        std::string data;
+        char buffer[READ_BLOCK];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) data.append(buffer, n);
+        ok = chunked ? writeChunked(floppy, data, timeout) : writeMessage(floppy, data);
+    }
+    fflush(stdout);
+    return ok ? 0 : 1;
+}
@@ -16,16 +16,21 @@
 #
 #  ./read.pl > my_config.sh 2>/dev/null
 #
+#  Messages longer than the buffer are sent by the hypervisor in frames
+#  (FloppyIO::sendChunked). Read them with:
+#
+#  ./read.pl --chunked > my_config.sh
+#
+#  --size BYTES sets the size of the floppy image, the same as the
+#  hypervisor uses (up to 1474560), and --timeout SECONDS how long to wait
+#  for each frame.
+#
+#  "floppyio read" (floppyio.cpp) does the same natively, with sector-sized
+#  uncached I/O and the offsets of floppyLayout.h.
+#
 #======================================================================
 #  
-#  Here is the layout of the floppy disk image (Example of 28k):
-#
-#  +-----------------+------------------------------------------------+
-#  | 0x0000 - 0x37FF |  Hypervisor -> Guest Buffer                    |
-#  | 0x3800 - 0x6FFE |  Guest -> Hypervisor Buffer                    |
-#  |     0x6FFF      |  "Data available for guest" flag byte          |
-#  |     0x7000      |  "Data available for hypervisor" flag byte     |
-#  +-----------------+------------------------------------------------+
+#  The layout of the image is described in floppyLayout.h.
 #
 #======================================================================
 #
@@ -36,12 +41,18 @@
 
 use strict;
 use warnings;
+use Getopt::Long;
 
 # ==[ CONFIGURATION ]====================
 my $FLOPPY = "/dev/fd0";
 my $FLOPPY_SIZE = 28672;
+my $TIMEOUT = 60;
 # =======================================
 
+my $CHUNKED = 0;
+GetOptions("chunked" => \$CHUNKED, "size=i" => \$FLOPPY_SIZE,
+           "floppy=s" => \$FLOPPY, "timeout=i" => \$TIMEOUT) or die "Invalid options\n";
+
 # Calculate buffer positions
 my $IN_OFS=0; my $IN_SIZE=$FLOPPY_SIZE/2-1;
 
@@ -49,6 +60,12 @@ my $IN_OFS=0; my $IN_SIZE=$FLOPPY_SIZE/2-1;
 open FD, "+<$FLOPPY" or die $!;
 binmode FD;
 
+if ($CHUNKED) {
+    read_chunked();
+    close FD;
+    exit 0;
+}
+
 # The following serves for 2 purposes:
 # 1) Force the OS to actually read the floppy device 
 #    (Because there is the case that the first 12K are just cached)
@@ -73,3 +90,66 @@ while (($n = read FD, $data, 1) != 0) {
 # Close FD when done
 close FD;
 
+# ==[ CHUNKED TRANSFERS ]================
+# Frame: "FC", version, flags (1 = last), sequence, total length,
+# chunk length, CRC-32 of the chunk, then the chunk (little-endian)
+
+# Drop the cached blocks of the device, so the writes of the hypervisor
+# are seen (BLKFLSBUF, fails harmlessly on an image file)
+sub refresh {
+    ioctl FD, 0x1261, 0;
+}
+
+sub ctrl {
+    my $value;
+    refresh();
+    sysseek FD, $FLOPPY_SIZE-2, 0;
+    sysread FD, $value, 1;
+    return ord($value || "\0");
+}
+
+sub set_ctrl {
+    refresh();
+    sysseek FD, $FLOPPY_SIZE-2, 0;
+    syswrite FD, chr($_[0]);
+    refresh();
+}
+
+sub read_chunked {
+    require Compress::Zlib;
+    my ($expected, $received, $total) = (0, 0, 0);
+    while (1) {
+        # Wait for the next frame
+        my $deadline = time + $TIMEOUT;
+        while (ctrl() != 2) {
+            die "Timeout waiting for frame $expected\n" if time > $deadline;
+            select undef, undef, undef, 0.01;
+        }
+
+        my $frame;
+        sysseek FD, $IN_OFS, 0;
+        sysread FD, $frame, $IN_SIZE;
+        my ($magic, $version, $flags, $seq, $tot, $len, $crc) = unpack "a2 C C V V V V", $frame;
+        my $chunk = substr $frame, 20, $len;
+        if ($magic ne "FC" || $version != 1 || $len > $IN_SIZE-20 ||
+            length($chunk) != $len || Compress::Zlib::crc32($chunk) != $crc) {
+            # Damaged, ask for it again
+            set_ctrl(3);
+            next;
+        }
+        if ($seq != $expected) {
+            # Sent again because our acknowledgment was lost
+            set_ctrl(0);
+            next if $seq+1 == $expected;
+            die "Frame $seq received, $expected expected\n";
+        }
+
+        print $chunk;
+        $total = $tot;
+        $received += $len;
+        $expected++;
+        set_ctrl(0);
+        last if $flags & 1;
+    }
+    die "Received $received bytes out of $total\n" if $received != $total;
+}
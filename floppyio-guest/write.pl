@@ -16,16 +16,22 @@
 #
 #  cat /var/log/my.log | ./write.sh 2>/dev/null
 #
+#  Messages longer than the buffer are cut. With --chunked they are sent
+#  in frames instead, each one acknowledged by the hypervisor
+#  (FloppyIO::receiveChunked):
+#
+#  cat summary.txt | ./write.pl --chunked
+#
+#  --size BYTES sets the size of the floppy image, the same as the
+#  hypervisor uses (up to 1474560), and --timeout SECONDS how long to wait
+#  for the hypervisor to take each frame.
+#
+#  "floppyio write" (floppyio.cpp) does the same natively, with sector-sized
+#  uncached I/O and the offsets of floppyLayout.h.
+#
 #======================================================================
 #  
-#  Here is the layout of the floppy disk image (Example of 28k):
-#
-#  +-----------------+------------------------------------------------+
-#  | 0x0000 - 0x37FF |  Hypervisor -> Guest Buffer                    |
-#  | 0x3800 - 0x6FFE |  Guest -> Hypervisor Buffer                    |
-#  |     0x6FFF      |  "Data available for guest" flag byte          |
-#  |     0x7000      |  "Data available for hypervisor" flag byte     |
-#  +-----------------+------------------------------------------------+
+#  The layout of the image is described in floppyLayout.h.
 #
 #======================================================================
 #
@@ -36,18 +42,33 @@
 
 use strict;
 use warnings;
+use Getopt::Long;
 
 # ==[ CONFIGURATION ]====================
 my $FLOPPY = "/dev/fd0";
 my $FLOPPY_SIZE = 28672;
+my $TIMEOUT = 60;
 # =======================================
 
+my $CHUNKED = 0;
+GetOptions("chunked" => \$CHUNKED, "size=i" => \$FLOPPY_SIZE,
+           "floppy=s" => \$FLOPPY, "timeout=i" => \$TIMEOUT) or die "Invalid options\n";
+
 # Calculate buffer positions
 my $OUT_SIZE=$FLOPPY_SIZE/2-1; my $OUT_OFS=$OUT_SIZE;
 
 # Try to open file for input
 open FD, "+<$FLOPPY" or die $!;
 binmode FD;
+
+if ($CHUNKED) {
+    binmode STDIN;
+    local $/;
+    my $data = <STDIN>;
+    write_chunked(defined $data ? $data : "");
+    close FD;
+    exit 0;
+}
 seek FD, $OUT_OFS, 0;
 
 # Process STDIN
@@ -77,3 +98,66 @@ print FD "\x01";
 
 # Close FD when done
 close FD;
+
+# ==[ CHUNKED TRANSFERS ]================
+# Frame: "FC", version, flags (1 = last), sequence, total length,
+# chunk length, CRC-32 of the chunk, then the chunk (little-endian)
+
+# Drop the cached blocks of the device, so the writes of the hypervisor
+# are seen and ours reach it (BLKFLSBUF, fails harmlessly on an image file)
+sub refresh {
+    ioctl FD, 0x1261, 0;
+}
+
+sub ctrl {
+    my $value;
+    refresh();
+    sysseek FD, $FLOPPY_SIZE-1, 0;
+    sysread FD, $value, 1;
+    return ord($value || "\0");
+}
+
+sub set_ctrl {
+    refresh();
+    sysseek FD, $FLOPPY_SIZE-1, 0;
+    syswrite FD, chr($_[0]);
+    refresh();
+}
+
+# Wait while the hypervisor has not taken the frame
+sub wait_ctrl {
+    my $deadline = time + $TIMEOUT;
+    while (ctrl() == 2) {
+        return 0 if time > $deadline;
+        select undef, undef, undef, 0.01;
+    }
+    return 1;
+}
+
+sub write_chunked {
+    require Compress::Zlib;
+    my $data = shift;
+    my $total = length $data;
+    my $chunk_size = $OUT_SIZE - 20;
+    my ($offset, $seq) = (0, 0);
+    do {
+        my $chunk = substr $data, $offset, $chunk_size;
+        my $len = length $chunk;
+        my $flags = ($offset + $len == $total) ? 1 : 0;
+        my $frame = pack("a2 C C V V V V", "FC", 1, $flags, $seq, $total, $len,
+                         Compress::Zlib::crc32($chunk)) . $chunk;
+        my $retries = 0;
+        while (1) {
+            wait_ctrl() or die "Timeout waiting for the hypervisor\n";
+            refresh();
+            sysseek FD, $OUT_OFS, 0;
+            syswrite FD, $frame;
+            set_ctrl(2);
+            wait_ctrl() or die "Timeout waiting for frame $seq to be acknowledged\n";
+            last if ctrl() != 3;
+            die "Frame $seq damaged $retries times\n" if ++$retries > 5;
+        }
+        $offset += $len;
+        $seq++;
+    } while ($offset < $total);
+}
@@ -0,0 +1,222 @@
+// floppyio_bench.cpp: cost of the floppy channel
+//
+// Usage: floppyio_bench [IMAGE] [SIZE...]
+//
+// First, plain messages go through the string API and through the
+// allocation-free one (a pointer and a size to send, a buffer of the
+// caller to receive), with the messages per second and the heap
+// allocations per message of each.
+//
+// Then messages of several sizes go with the chunked protocol from the
+// hypervisor side to a guest side running in another thread, and back.
+//
+// Everything goes through IMAGE (floppyio_bench.img in the current
+// directory by default, put it on a tmpfs to leave the disk out), for
+// every floppy size given (28672 and 1474560 by default). Every message
+// is checked on arrival.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "floppyIO.h"
+#include "threads.h"
+
+#define BENCH_TIMEOUT 30
+// Bytes sent for every message size
+#define BENCH_BYTES (8*1024*1024)
+// Plain messages sent through each API
+#define BENCH_MESSAGES 20000
+#define BENCH_MESSAGE "BOINC_USERNAME=volunteer\nBOINC_USERID=12345\nBOINC_HOSTID=67890\nBOINC_AUTHENTICATOR=0123456789abcdef"
+
+// Heap allocations, counted while an API is measured
+long allocations = 0;
+
+// Dynamic exception specifications are gone since C++17
+#if __cplusplus < 201103L
+#define BENCH_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define BENCH_NOTHROW throw()
+#else
+#define BENCH_THROWS_BAD_ALLOC
+#define BENCH_NOTHROW noexcept
+#endif
+
+void *operator new(size_t size) BENCH_THROWS_BAD_ALLOC
+{
+        allocations++;
+        void *p = malloc(size ? size : 1);
+        if (!p) throw std::bad_alloc();
+        return p;
+}
+
+void *operator new[](size_t size) BENCH_THROWS_BAD_ALLOC
+{
+        return operator new(size);
+}
+
+void operator delete(void *p) BENCH_NOTHROW
+{
+        free(p);
+}
+
+void operator delete[](void *p) BENCH_NOTHROW
+{
+        free(p);
+}
+
+// Sized deallocation, used since C++14
+#if __cplusplus >= 201402L
+void operator delete(void *p, size_t) noexcept
+{
+        free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+        free(p);
+}
+#endif
+
+struct Peer {
+        const char *image;
+        int size;
+        size_t message_size;
+        int count;
+        bool to_guest;
+        bool ok;
+};
+
+double now()
+{
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+std::string message(size_t size, int n)
+{
+        std::string data(size, ' ');
+        for (size_t i = 0; i < size; i++) data[i] = (char)('a' + (i * 7 + n) % 26);
+        return data;
+}
+
+// The side that receives
+void receiver(void *arg)
+{
+        Peer *peer = (Peer *)arg;
+        FloppyIO floppy(peer->image, F_NOINIT | F_NOCREATE | (peer->to_guest ? F_GUEST : 0), peer->size);
+        peer->ok = true;
+        for (int i = 0; i < peer->count; i++) {
+                std::string data;
+                if (!floppy.receiveChunked(data, BENCH_TIMEOUT) || data != message(peer->message_size, i)) {
+                        peer->ok = false;
+                        return;
+                }
+        }
+}
+
+// Seconds to send peer->count messages, -1 on error
+double run(Peer &peer)
+{
+        {
+                // Zero the image
+                FloppyIO floppy(peer.image, 0, peer.size);
+        }
+        std::vector<std::string> messages;
+        for (int i = 0; i < peer.count; i++) messages.push_back(message(peer.message_size, i));
+
+        FloppyIO floppy(peer.image, F_NOINIT | F_NOCREATE | (peer.to_guest ? 0 : F_GUEST), peer.size);
+        Threads::Handle handle;
+        if (!Threads::spawn(handle, receiver, &peer)) return -1;
+        double t0 = now();
+        bool sent = true;
+        for (int i = 0; i < peer.count && sent; i++) sent = floppy.sendChunked(messages[i], BENCH_TIMEOUT);
+        Threads::join(handle);
+        double secs = now() - t0;
+        return (sent && peer.ok) ? secs : -1;
+}
+
+// Plain messages from the hypervisor to the guest side, through the string
+// API or the allocation-free one. Returns the messages per second.
+double run_api(const char *image, int size, bool strings, double &per_message)
+{
+        FloppyIO host(image, 0, size);
+        FloppyIO guest(image, F_NOINIT | F_NOCREATE | F_GUEST, size);
+        std::string message = BENCH_MESSAGE;
+        std::vector<char> buffer(size / 2);
+        size_t received = 0;
+
+        long before = allocations;
+        double t0 = now();
+        for (int i = 0; i < BENCH_MESSAGES; i++) {
+                if (strings) {
+                        host.send(message);
+                        received += guest.receive().size();
+                }
+                else {
+                        host.send(message.data(), message.size());
+                        received += guest.receive(&buffer[0], buffer.size());
+                }
+        }
+        double secs = now() - t0;
+        per_message = (double)(allocations - before) / BENCH_MESSAGES;
+        if (received != message.size() * BENCH_MESSAGES) return -1;
+        return BENCH_MESSAGES / secs;
+}
+
+int main(int argc, char **argv)
+{
+        const char *image = (argc > 1) ? argv[1] : "floppyio_bench.img";
+        std::vector<int> sizes;
+        for (int i = 2; i < argc; i++) sizes.push_back(atoi(argv[i]));
+        if (sizes.empty()) {
+                sizes.push_back(DEFAULT_FLOPPY_SIZE);
+                sizes.push_back(MAX_FLOPPY_SIZE);
+        }
+        size_t message_sizes[] = { 1024, 14000, 64*1024, 1024*1024 };
+        int failures = 0;
+
+        printf("%-9s %-10s %10s %14s\n", "floppy", "api", "msg/s", "allocs/msg");
+        for (size_t s = 0; s < sizes.size(); s++) {
+                for (int strings = 1; strings >= 0; strings--) {
+                        double per_message;
+                        double rate = run_api(image, sizes[s], strings != 0, per_message);
+                        if (rate < 0) failures++;
+                        printf("%-9d %-10s %10.0f %14.2f%s\n", sizes[s], strings ? "string" : "buffer", rate, per_message,
+                               rate < 0 ? "   FAILED" : "");
+                }
+        }
+        printf("\n");
+
+        printf("%-9s %-10s %10s %8s %10s %10s\n", "floppy", "direction", "message", "count", "msg/s", "MB/s");
+        for (size_t s = 0; s < sizes.size(); s++) {
+                for (int direction = 0; direction < 2; direction++) {
+                        for (size_t m = 0; m < sizeof(message_sizes) / sizeof(message_sizes[0]); m++) {
+                                Peer peer;
+                                peer.image = image;
+                                peer.size = sizes[s];
+                                peer.message_size = message_sizes[m];
+                                peer.count = (int)(BENCH_BYTES / message_sizes[m]);
+                                if (peer.count > 2000) peer.count = 2000;
+                                peer.to_guest = (direction == 0);
+                                peer.ok = false;
+                                double secs = run(peer);
+                                if (secs < 0) {
+                                        printf("%-9d %-10s %10lu   FAILED\n", peer.size, peer.to_guest ? "to guest" : "to host",
+                                               (unsigned long)peer.message_size);
+                                        failures++;
+                                        continue;
+                                }
+                                printf("%-9d %-10s %10lu %8d %10.1f %10.2f\n", peer.size, peer.to_guest ? "to guest" : "to host",
+                                       (unsigned long)peer.message_size, peer.count, peer.count / secs,
+                                       peer.count * (double)peer.message_size / (1024*1024) / secs);
+                        }
+                }
+        }
+        remove(image);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,562 @@
+// Host-wide collector of orphaned VMs (--gc)
+//
+// Slots that crashed leave registered VMs, disks in the media registry and
+// folders in "VirtualBox VMs" behind, and VBoxSVC gets slower as they pile
+// up. The collector lists the VMs and the disks once, and only considers
+// the disks that live under the BOINC slots directory. A disk is orphaned
+// when its file is gone, or when its slot no longer holds a task (no
+// init_data.xml, and nobody holds boinc_lockfile). A VM is orphaned when
+// it only uses orphaned disks. VMs and disks outside the slots are never
+// touched.
+//
+// Orphaned VMs are powered off and unregistered with their folders, then
+// the orphaned disks are closed and deleted, by several threads at once.
+// A lock file keeps two collectors on the same host from running at the
+// same time. It lives in a directory of the BOINC data directory that
+// only this user can use, so that nobody else can hold it.
+
+#ifndef GC_H
+#define GC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "threads.h"
+
+#define GC_LOCK_DIRNAME "cernvm-gc"
+#define GC_LOCK_FN "cernvm-wrapper-gc.lock"
+#define GC_THREADS 4
+#define GC_LIST_SIZE (1024*1024)
+
+namespace Gc
+{
+        struct Medium {
+                std::string uuid;
+                std::string location;
+                std::vector<std::string> vms;   // UUIDs of the VMs using it
+                bool orphaned;
+        };
+
+        struct Machine {
+                std::string name;
+                std::string uuid;
+                std::vector<Medium *> media;
+                bool orphaned;
+                bool removed;
+        };
+
+        // Work shared by the removal threads
+        struct Work {
+                std::vector<Machine *> machines;
+                std::vector<Medium *> media;
+                size_t next;
+                Threads::Mutex mutex;
+                double reclaimed;
+                int vms_removed;
+                int media_removed;
+                int failures;
+        };
+
+        #ifdef _WIN32
+        const char SEPARATOR = '\\';
+        #else
+        const char SEPARATOR = '/';
+        #endif
+
+        // Paths are compared case insensitively on Windows
+        std::string normalize(const std::string &path)
+        {
+                std::string result = path;
+                #ifdef _WIN32
+                for (size_t i = 0; i < result.size(); i++) {
+                        if (result[i] == '/') result[i] = '\\';
+                        else result[i] = tolower(result[i]);
+                }
+                #endif
+                while (result.size() > 1 && result[result.size() - 1] == SEPARATOR) result.erase(result.size() - 1);
+                return result;
+        }
+
+        std::string current_dir()
+        {
+                char buffer[4096];
+                #ifdef _WIN32
+                if (!_getcwd(buffer, sizeof(buffer))) return "";
+                #else
+                if (!getcwd(buffer, sizeof(buffer))) return "";
+                #endif
+                return buffer;
+        }
+
+        // The wrapper runs in <BOINC data>/slots/<n>
+        std::string default_slots_dir()
+        {
+                std::string cwd = normalize(current_dir());
+                size_t sep = cwd.rfind(SEPARATOR);
+                if (sep == std::string::npos || sep == 0) return "";
+                std::string parent = cwd.substr(0, sep);
+                size_t name = parent.rfind(SEPARATOR);
+                if (parent.substr(name + 1) != "slots") return "";
+                return parent;
+        }
+
+        bool file_exists(const std::string &path)
+        {
+                struct stat st;
+                return (stat(path.c_str(), &st) == 0);
+        }
+
+        double file_size(const std::string &path)
+        {
+                struct stat st;
+                if (stat(path.c_str(), &st)) return 0;
+                return (double)st.st_size;
+        }
+
+        // Bytes used by a directory tree
+        double dir_size(const std::string &path)
+        {
+                double total = 0;
+                #ifdef _WIN32
+                WIN32_FIND_DATA data;
+                HANDLE h = FindFirstFile((path + "\\*").c_str(), &data);
+                if (h == INVALID_HANDLE_VALUE) return 0;
+                do {
+                        if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, "..")) continue;
+                        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                                total += dir_size(path + "\\" + data.cFileName);
+                        }
+                        else {
+                                total += (double)data.nFileSizeHigh * 4294967296.0 + data.nFileSizeLow;
+                        }
+                } while (FindNextFile(h, &data));
+                FindClose(h);
+                #else
+                DIR *dir = opendir(path.c_str());
+                if (!dir) return 0;
+                struct dirent *entry;
+                while ((entry = readdir(dir)) != NULL) {
+                        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+                        std::string child = path + "/" + entry->d_name;
+                        struct stat st;
+                        if (lstat(child.c_str(), &st)) continue;
+                        if (S_ISDIR(st.st_mode)) total += dir_size(child);
+                        else total += (double)st.st_size;
+                }
+                closedir(dir);
+                #endif
+                return total;
+        }
+
+        // Delete a directory tree. Symbolic links are removed, not followed.
+        // Returns false if something could not be deleted.
+        bool remove_tree(const std::string &path)
+        {
+                bool ok = true;
+                #ifdef _WIN32
+                WIN32_FIND_DATA data;
+                HANDLE h = FindFirstFile((path + "\\*").c_str(), &data);
+                if (h != INVALID_HANDLE_VALUE) {
+                        do {
+                                if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, "..")) continue;
+                                std::string child = path + "\\" + data.cFileName;
+                                if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                                    !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                                        if (!remove_tree(child)) ok = false;
+                                }
+                                else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                                        if (!RemoveDirectory(child.c_str())) ok = false;
+                                }
+                                else if (!DeleteFile(child.c_str())) ok = false;
+                        } while (FindNextFile(h, &data));
+                        FindClose(h);
+                }
+                if (!RemoveDirectory(path.c_str())) ok = false;
+                #else
+                DIR *dir = opendir(path.c_str());
+                if (dir) {
+                        struct dirent *entry;
+                        while ((entry = readdir(dir)) != NULL) {
+                                if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+                                std::string child = path + "/" + entry->d_name;
+                                struct stat st;
+                                if (lstat(child.c_str(), &st)) continue;
+                                if (S_ISDIR(st.st_mode)) {
+                                        if (!remove_tree(child)) ok = false;
+                                }
+                                else if (unlink(child.c_str())) ok = false;
+                        }
+                        closedir(dir);
+                }
+                if (rmdir(path.c_str())) ok = false;
+                #endif
+                return ok;
+        }
+
+        // A slot holds a task until the client cleans it up
+        bool slot_live(const std::string &slot)
+        {
+                if (file_exists(slot + SEPARATOR + "init_data.xml")) return true;
+
+                std::string lockfile = slot + SEPARATOR + "boinc_lockfile";
+                #ifdef _WIN32
+                HANDLE h = CreateFile(lockfile.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+                if (h != INVALID_HANDLE_VALUE) {
+                        CloseHandle(h);
+                        return false;
+                }
+                return (GetLastError() == ERROR_SHARING_VIOLATION);
+                #else
+                int fd = open(lockfile.c_str(), O_RDWR);
+                if (fd < 0) return false;
+                struct flock fl;
+                memset(&fl, 0, sizeof(fl));
+                fl.l_type = F_WRLCK;
+                fl.l_whence = SEEK_SET;
+                bool locked = (fcntl(fd, F_GETLK, &fl) == 0) && (fl.l_type != F_UNLCK);
+                close(fd);
+                return locked;
+                #endif
+        }
+
+        // Directory of the lock: <BOINC data>/GC_LOCK_DIRNAME, next to the slots
+        std::string lock_dir(const std::string &slots_dir)
+        {
+                size_t sep = slots_dir.rfind(SEPARATOR);
+                if (sep == std::string::npos) return GC_LOCK_DIRNAME;
+                return slots_dir.substr(0, sep) + SEPARATOR + GC_LOCK_DIRNAME;
+        }
+
+        // Host-wide lock in dir, released when the process exits
+        bool lock_host(const std::string &dir)
+        {
+                std::string path = dir + SEPARATOR + GC_LOCK_FN;
+                #ifdef _WIN32
+                HANDLE h = CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                                      FILE_FLAG_DELETE_ON_CLOSE, NULL);
+                return (h != INVALID_HANDLE_VALUE);
+                #else
+                int fd = open(path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+                if (fd < 0) return false;
+                struct flock fl;
+                memset(&fl, 0, sizeof(fl));
+                fl.l_type = F_WRLCK;
+                fl.l_whence = SEEK_SET;
+                if (fcntl(fd, F_SETLK, &fl)) {
+                        close(fd);
+                        return false;
+                }
+                return true;
+                #endif
+        }
+
+        std::string virtualbox_xml()
+        {
+                const char *home = getenv("VBOX_USER_HOME");
+                if (home && *home) return std::string(home) + SEPARATOR + "VirtualBox.xml";
+                #ifdef _WIN32
+                const char *drive = getenv("HOMEDRIVE");
+                const char *path = getenv("HOMEPATH");
+                if (!drive || !path) return "";
+                return std::string(drive) + path + "\\.VirtualBox\\VirtualBox.xml";
+                #else
+                home = getenv("HOME");
+                if (!home) return "";
+                std::string xml = home;
+                if (xml.find("Users") == std::string::npos) return xml + "/.VirtualBox/VirtualBox.xml";
+                return xml + "/Library/VirtualBox/VirtualBox.xml";
+                #endif
+        }
+
+        std::string trim(const std::string &s)
+        {
+                size_t begin = s.find_first_not_of(" \t\r");
+                if (begin == std::string::npos) return "";
+                size_t end = s.find_last_not_of(" \t\r");
+                return s.substr(begin, end - begin + 1);
+        }
+
+        // "name" {uuid} lines of list vms
+        void parse_vms(const std::string &output, std::vector<Machine> &machines)
+        {
+                std::istringstream in(output);
+                std::string line;
+                while (std::getline(in, line)) {
+                        size_t open = line.rfind('{'), close = line.rfind('}');
+                        size_t first = line.find('"'), last = line.rfind('"');
+                        if (open == std::string::npos || close == std::string::npos || close < open) continue;
+                        if (first == std::string::npos || last <= first) continue;
+                        Machine m;
+                        m.name = line.substr(first + 1, last - first - 1);
+                        m.uuid = line.substr(open + 1, close - open - 1);
+                        m.orphaned = false;
+                        m.removed = false;
+                        machines.push_back(m);
+                }
+        }
+
+        // Blocks of "Key: value" lines of list hdds
+        void parse_hdds(const std::string &output, std::vector<Medium> &media)
+        {
+                std::istringstream in(output);
+                std::string line;
+                Medium m;
+                m.orphaned = false;
+                for (;;) {
+                        bool more = !std::getline(in, line).fail();
+                        line = trim(line);
+                        if (!more || line.empty()) {
+                                if (!m.uuid.empty()) media.push_back(m);
+                                m = Medium();
+                                m.orphaned = false;
+                                if (!more) break;
+                                continue;
+                        }
+                        size_t colon = line.find(':');
+                        if (colon == std::string::npos) continue;
+                        std::string key = line.substr(0, colon);
+                        std::string value = trim(line.substr(colon + 1));
+                        if (key == "UUID") m.uuid = value;
+                        else if (key == "Location") m.location = value;
+                        else if (key == "In use by VMs") {
+                                // NAME (UUID: uuid) [, NAME (UUID: uuid)]...
+                                size_t pos = 0;
+                                while ((pos = value.find("UUID: ", pos)) != std::string::npos) {
+                                        pos += 6;
+                                        size_t end = value.find(')', pos);
+                                        if (end == std::string::npos) break;
+                                        m.vms.push_back(value.substr(pos, end - pos));
+                                }
+                        }
+                }
+        }
+
+        void count(Work &work, double bytes, int vms, int media, int failures)
+        {
+                Threads::Lock lock(work.mutex);
+                work.reclaimed += bytes;
+                work.vms_removed += vms;
+                work.media_removed += media;
+                work.failures += failures;
+        }
+
+        void remove_machine(Work &work, Machine &m)
+        {
+                char buffer[BUFSIZE];
+                std::string folder;
+
+                if (vbm_popen("showvminfo " + m.uuid + " --machinereadable", buffer, sizeof(buffer))) {
+                        std::string info = buffer;
+                        size_t begin = info.find("CfgFile=\"");
+                        if (begin != std::string::npos) {
+                                begin += 9;
+                                size_t end = info.find('"', begin);
+                                std::string cfg = info.substr(begin, end - begin);
+                                size_t sep = cfg.find_last_of("/\\");
+                                if (sep != std::string::npos) folder = cfg.substr(0, sep);
+                        }
+                        // Nobody is going to save it any more
+                        if (info.find("VMState=\"running\"") != std::string::npos ||
+                            info.find("VMState=\"paused\"") != std::string::npos) {
+                                vbm_popen("controlvm " + m.uuid + " poweroff");
+                        }
+                        else if (info.find("VMState=\"saved\"") != std::string::npos) {
+                                vbm_popen("discardstate " + m.uuid);
+                        }
+                }
+
+                double before = folder.empty() ? 0 : dir_size(folder);
+                for (size_t i = 0; i < m.media.size(); i++) before += file_size(m.media[i]->location);
+                if (!vbm_popen("unregistervm " + m.uuid + " --delete")) {
+                        LOG_WARNING("GC: impossible to unregister " << m.name << " {" << m.uuid << "}");
+                        count(work, 0, 0, 0, 1);
+                        return;
+                }
+                // --delete leaves what VirtualBox does not know about (logs of old sessions...)
+                if (!folder.empty() && file_exists(folder) && !remove_tree(folder)) {
+                        LOG_WARNING("GC: impossible to delete " << folder);
+                }
+                double after = folder.empty() ? 0 : dir_size(folder);
+                for (size_t i = 0; i < m.media.size(); i++) after += file_size(m.media[i]->location);
+                m.removed = true;
+                LOG_NOTICE("GC: removed VM " << m.name << " {" << m.uuid << "}");
+                count(work, before - after, 1, 0, 0);
+        }
+
+        void remove_medium(Work &work, Medium &m)
+        {
+                bool exists = file_exists(m.location);
+                double before = exists ? file_size(m.location) : 0;
+                // Close it first: --delete fails for a disk whose file is gone
+                if (!vbm_popen("closemedium disk " + m.uuid + (exists ? " --delete" : ""))) {
+                        LOG_WARNING("GC: impossible to close " << m.location);
+                        count(work, 0, 0, 0, 1);
+                        return;
+                }
+                double after = file_exists(m.location) ? file_size(m.location) : 0;
+                LOG_NOTICE("GC: removed disk " << m.location);
+                count(work, before - after, 0, 1, 0);
+        }
+
+        void worker(void *arg)
+        {
+                Work *work = static_cast<Work *>(arg);
+                for (;;) {
+                        size_t i;
+                        {
+                                Threads::Lock lock(work->mutex);
+                                i = work->next++;
+                        }
+                        if (i < work->machines.size()) remove_machine(*work, *work->machines[i]);
+                        else if (i - work->machines.size() < work->media.size()) {
+                                remove_medium(*work, *work->media[i - work->machines.size()]);
+                        }
+                        else return;
+                }
+        }
+
+        // Remove everything in work with GC_THREADS threads
+        void run_parallel(Work &work)
+        {
+                Threads::Handle threads[GC_THREADS];
+                bool started[GC_THREADS];
+                work.next = 0;
+                for (int i = 0; i < GC_THREADS; i++) started[i] = Threads::spawn(threads[i], worker, &work);
+                // Whatever the threads could not take is done here
+                worker(&work);
+                for (int i = 0; i < GC_THREADS; i++) {
+                        if (started[i]) Threads::join(threads[i]);
+                }
+        }
+
+        // Returns the exit code of --gc
+        int run(std::string slots_dir)
+        {
+                Trace::Span span("gc");
+                double t0 = dtime();
+
+                if (slots_dir.empty()) slots_dir = default_slots_dir();
+                if (slots_dir.empty()) {
+                        LOG_ERROR("GC: not running in a BOINC slot, use --gc-slots DIR");
+                        return 1;
+                }
+                slots_dir = normalize(slots_dir);
+                std::string dir = lock_dir(slots_dir);
+                if (!Helper::private_dir(dir)) {
+                        LOG_ERROR("GC: " << dir << " is not a directory that only this user can use");
+                        return 1;
+                }
+                if (!lock_host(dir)) {
+                        LOG_NOTICE("GC: another collector is running on this host");
+                        return 0;
+                }
+                LOG_NOTICE("GC: looking for orphaned VMs and disks under " << slots_dir);
+
+                std::vector<char> buffer(GC_LIST_SIZE);
+                std::vector<Machine> machines;
+                std::vector<Medium> media;
+                if (!vbm_popen("list vms", &buffer[0], buffer.size())) {
+                        LOG_ERROR("GC: impossible to list the VMs");
+                        return 1;
+                }
+                parse_vms(&buffer[0], machines);
+                if (!vbm_popen("list hdds", &buffer[0], buffer.size())) {
+                        LOG_ERROR("GC: impossible to list the disks");
+                        return 1;
+                }
+                parse_hdds(&buffer[0], media);
+
+                std::string xml = virtualbox_xml();
+                double registry_before = file_size(xml);
+
+                // Disks under the slots directory
+                std::map<std::string, bool> live;
+                std::map<std::string, Machine *> by_uuid;
+                for (size_t i = 0; i < machines.size(); i++) by_uuid[machines[i].uuid] = &machines[i];
+                Work work;
+                for (size_t i = 0; i < media.size(); i++) {
+                        Medium &m = media[i];
+                        std::string location = normalize(m.location);
+                        if (location.compare(0, slots_dir.size() + 1, slots_dir + SEPARATOR)) continue;
+
+                        size_t end = location.find(SEPARATOR, slots_dir.size() + 1);
+                        if (end == std::string::npos) continue;
+                        std::string slot = location.substr(0, end);
+                        if (!live.count(slot)) live[slot] = slot_live(slot);
+
+                        m.orphaned = !live[slot] || !file_exists(m.location);
+                        for (size_t j = 0; j < m.vms.size(); j++) {
+                                std::map<std::string, Machine *>::iterator it = by_uuid.find(m.vms[j]);
+                                if (it != by_uuid.end()) it->second->media.push_back(&m);
+                        }
+                        if (m.orphaned) work.media.push_back(&m);
+                }
+
+                // VMs that only use orphaned disks
+                for (size_t i = 0; i < machines.size(); i++) {
+                        Machine &vm = machines[i];
+                        if (vm.media.empty()) continue;
+                        vm.orphaned = true;
+                        for (size_t j = 0; j < vm.media.size(); j++) {
+                                if (!vm.media[j]->orphaned) vm.orphaned = false;
+                        }
+                        if (vm.orphaned) work.machines.push_back(&vm);
+                }
+
+                LOG_NOTICE("GC: " << machines.size() << " VMs and " << media.size() << " disks registered, "
+                           << work.machines.size() << " VMs and " << work.media.size() << " disks orphaned");
+
+                work.reclaimed = 0;
+                work.vms_removed = work.media_removed = work.failures = 0;
+
+                // The VMs first, a disk cannot be closed while it is attached
+                std::vector<Medium *> orphaned_media = work.media;
+                work.media.clear();
+                run_parallel(work);
+                work.machines.clear();
+                work.media = orphaned_media;
+                // unregistervm --delete has already removed the disks of the removed VMs
+                std::vector<Medium *> still_there;
+                for (size_t i = 0; i < work.media.size(); i++) {
+                        bool removed = false;
+                        for (size_t j = 0; j < work.media[i]->vms.size(); j++) {
+                                std::map<std::string, Machine *>::iterator it = by_uuid.find(work.media[i]->vms[j]);
+                                if (it != by_uuid.end() && it->second->removed) removed = true;
+                        }
+                        if (removed) work.media_removed++;
+                        else still_there.push_back(work.media[i]);
+                }
+                work.media = still_there;
+                run_parallel(work);
+
+                double registry_after = file_size(xml);
+                span.arg("vms_removed", (double)work.vms_removed);
+                span.arg("media_removed", (double)work.media_removed);
+                span.arg("reclaimed_bytes", work.reclaimed);
+                LOG_NOTICE("GC: removed " << work.vms_removed << " VMs and " << work.media_removed << " disks in "
+                           << dtime() - t0 << " seconds, " << work.failures << " failures");
+                LOG_NOTICE("GC: reclaimed " << work.reclaimed / (1024*1024) << " MB of disk space");
+                LOG_NOTICE("GC: registry shrank from " << machines.size() << " to " << machines.size() - work.vms_removed
+                           << " VMs and from " << media.size() << " to " << media.size() - work.media_removed << " disks, "
+                           << "VirtualBox.xml from " << registry_before / 1024 << " to " << registry_after / 1024 << " KB");
+                return work.failures ? 1 : 0;
+        }
+}
+
+#endif // GC_H
@@ -0,0 +1,164 @@
+// Progress of the work running in the guest
+//
+// The guest reports how far its jobs are through the guest -> hypervisor
+// buffer of the floppy, with the same KEY=VALUE lines the wrapper sends to
+// it, e.g. from the job agent:
+//
+//     printf "PROGRESS=0.42\nJOBS_DONE=17\n" | write.pl
+//     printf "QUEUE_DRAINED=1\n" | write.pl
+//
+// PROGRESS (0 to 1) becomes the fraction done of the work unit, and
+// QUEUE_DRAINED tells the wrapper that the guest has nothing left to do, so
+// the work unit ends at once instead of idling until the 24 hour limit,
+// which stays as a safety net. The last report is kept in GuestProgress,
+// as a message read from the floppy is gone after a restart.
+//
+// With --guest-channel the same lines can also come as guest properties
+// (guestprop.h), taken as soon as they arrive, and the wrapper sends a
+// HEARTBEAT to the guest every GUEST_HEARTBEAT_PERIOD seconds through them.
+
+#ifndef GUEST_H
+#define GUEST_H
+
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <sstream>
+#include <fstream>
+
+#include "floppyIO.h"
+#include "trace.h"
+
+#define GUEST_PROGRESS_FN "GuestProgress"
+// Seconds between two looks at the floppy
+#define GUEST_POLL_PERIOD 10.0
+// Seconds to wait for the next frame of a chunked message
+#define GUEST_FRAME_TIMEOUT 30
+// Seconds between two heartbeats of the wrapper on the guest channel
+#define GUEST_HEARTBEAT_PERIOD 60.0
+
+namespace Guest
+{
+        struct Report {
+                bool   reported;        // the guest has sent a progress report
+                double progress;
+                long   jobs_done;
+                bool   drained;
+
+                Report() : reported(false), progress(0), jobs_done(-1), drained(false) {}
+        };
+
+        Report report;
+        double last_poll = 0;
+        double last_heartbeat = 0;
+        // Channel for the small messages, besides the floppy. NULL if there is none.
+        Channel *channel = NULL;
+
+        // Apply the KEY=VALUE lines of a message. Unknown keys are ignored.
+        bool parse(const std::string &message, Report &r)
+        {
+                std::istringstream lines(message);
+                std::string line;
+                bool changed = false;
+                while (std::getline(lines, line)) {
+                        size_t eq = line.find('=');
+                        if (eq == std::string::npos) continue;
+                        std::string key = line.substr(0, eq);
+                        const char *value = line.c_str() + eq + 1;
+                        if (key == "PROGRESS") {
+                                double progress = strtod(value, NULL);
+                                if (progress < 0) progress = 0;
+                                if (progress > 1) progress = 1;
+                                // The fraction done never goes back
+                                if (!r.reported || progress > r.progress) r.progress = progress;
+                                r.reported = changed = true;
+                        }
+                        else if (key == "JOBS_DONE") {
+                                r.jobs_done = atol(value);
+                                changed = true;
+                        }
+                        else if (key == "QUEUE_DRAINED") {
+                                r.drained = (atoi(value) != 0);
+                                changed = true;
+                        }
+                }
+                return changed;
+        }
+
+        void save()
+        {
+                std::ofstream f(GUEST_PROGRESS_FN);
+                if (f.is_open()) {
+                        if (report.reported) f << "PROGRESS=" << report.progress << "\n";
+                        if (report.jobs_done >= 0) f << "JOBS_DONE=" << report.jobs_done << "\n";
+                        if (report.drained) f << "QUEUE_DRAINED=1\n";
+                }
+        }
+
+        // The report of a previous run of the wrapper
+        void load()
+        {
+                std::ifstream f(GUEST_PROGRESS_FN);
+                if (!f.is_open()) return;
+                std::ostringstream content;
+                content << f.rdbuf();
+                parse(content.str(), report);
+        }
+
+        // Apply a message of the guest. Returns true if the report changed.
+        bool apply(const std::string &message)
+        {
+                Trace::instant("guest message", message);
+                if (!parse(message, report)) {
+                        LOG_INFO("Guest message without progress: " << message);
+                        return false;
+                }
+                save();
+                std::ostringstream jobs;
+                if (report.jobs_done >= 0) jobs << ", " << report.jobs_done << " jobs done";
+                LOG_NOTICE("Guest progress " << report.progress * 100 << "%" << jobs.str()
+                           << (report.drained ? ", job queue drained" : ""));
+                return true;
+        }
+
+        // Read the new messages of the guest: those of the channel as soon
+        // as they are there, the floppy every GUEST_POLL_PERIOD seconds.
+        // Returns true if the report changed.
+        bool poll(const std::string &floppy_name)
+        {
+                bool changed = false;
+                if (channel && channel->available()) changed = apply(channel->receive());
+                if (floppy_name.empty() || dtime() - last_poll < GUEST_POLL_PERIOD) return changed;
+                last_poll = dtime();
+
+                std::ifstream exists(floppy_name.c_str());
+                if (!exists.is_open()) return changed;
+                exists.close();
+
+                // Long messages come in frames, one after the other
+                FloppyIO floppy(floppy_name.c_str(), F_NOINIT | F_NOCREATE);
+                std::string message;
+                if (floppy.frameAvailable()) {
+                        if (!floppy.receiveChunked(message, GUEST_FRAME_TIMEOUT)) {
+                                LOG_WARNING("Incomplete chunked message from the guest (" << message.size() << " bytes)");
+                                return changed;
+                        }
+                }
+                else if (floppy.available()) message = floppy.receive();
+                else return changed;
+                return apply(message) || changed;
+        }
+
+        // Tell the guest that the wrapper is alive and for how long the
+        // work unit has run, every GUEST_HEARTBEAT_PERIOD seconds
+        void heartbeat(double running_secs)
+        {
+                if (!channel || dtime() - last_heartbeat < GUEST_HEARTBEAT_PERIOD) return;
+                last_heartbeat = dtime();
+                std::ostringstream message;
+                message << "HEARTBEAT=" << (long)time(NULL) << "\nRUNNING_SECS=" << (long)running_secs << "\n";
+                channel->send(message.str());
+        }
+}
+
+#endif // GUEST_H
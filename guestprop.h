@@ -0,0 +1,299 @@
+// Guest properties as a channel between the hypervisor and the guest
+//
+// The floppy needs a write of the disk image for every message and has to
+// be looked at to find out whether the guest wrote something. For the
+// small, frequent messages (heartbeats, progress, commands) the wrapper can
+// use VirtualBox guest properties instead (--guest-channel guestproperty):
+// every KEY=VALUE line is one property, the wrapper sets
+// /CernVM/Host/KEY and the guest sets /CernVM/Guest/KEY with the Guest
+// Additions, e.g.
+//
+//     VBoxControl guestproperty set /CernVM/Guest/PROGRESS 0.42
+//     VBoxControl guestproperty wait "/CernVM/Host/*"
+//
+// A thread waits for the guest properties to change ("guestproperty wait")
+// and queues the changed ones as a message, so they arrive with the latency
+// of an event rather than of a poll. The floppy stays for the bulk data.
+//
+// --guest-channel file:DIR is a stand-in without VirtualBox: the properties
+// are the files DIR/Host/KEY and DIR/Guest/KEY, looked at every
+// FILEPROP_POLL_PERIOD seconds, to exercise the wrapper and the guest
+// scripts on any host.
+
+#ifndef GUESTPROP_H
+#define GUESTPROP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "channel.h"
+#include "threads.h"
+#include "hypervisor.h"
+
+#define GUESTPROP_HOST "/CernVM/Host/"
+#define GUESTPROP_GUEST "/CernVM/Guest/"
+// Milliseconds of one "guestproperty wait"
+#define GUESTPROP_WAIT_MS 10000
+// Seconds before waiting again when VBoxManage fails at once (VM not running...)
+#define GUESTPROP_RETRY_PERIOD 5.0
+#define FILEPROP_POLL_PERIOD 0.2
+
+// Properties of the guest turned into messages, and messages of the
+// wrapper turned into properties. Subclasses only store the properties.
+class PropertyChannel : public Channel {
+public:
+        PropertyChannel() : running(false) {}
+
+        // Every KEY=VALUE line of the message becomes a property
+        void send(const std::string &strData)
+        {
+                std::istringstream lines(strData);
+                std::string line;
+                while (std::getline(lines, line)) {
+                        size_t eq = line.find('=');
+                        if (eq == std::string::npos || eq == 0) continue;
+                        if (!set(line.substr(0, eq), line.substr(eq + 1))) {
+                                LOG_WARNING("Impossible to set the property " << line.substr(0, eq) << " for the guest");
+                        }
+                }
+        }
+
+        // The guest properties that changed since the last call, as KEY=VALUE lines
+        std::string receive()
+        {
+                Threads::Lock lock(mutex);
+                std::string message = pending;
+                pending.clear();
+                return message;
+        }
+
+        bool available()
+        {
+                Threads::Lock lock(mutex);
+                return !pending.empty();
+        }
+
+        // Read the current properties of the guest and follow them from a thread
+        bool start()
+        {
+                refresh();
+                Threads::Handle handle;
+                if (!Threads::spawn(handle, waiter, this)) return false;
+                running = true;
+                return true;
+        }
+
+        bool running;
+
+protected:
+        // Set the property KEY of the wrapper
+        virtual bool set(const std::string &key, const std::string &value) = 0;
+        // All the properties of the guest, by KEY
+        virtual bool enumerate(std::map<std::string, std::string> &values) = 0;
+        // Block until a property of the guest may have changed, or for a while
+        virtual void wait() = 0;
+
+private:
+        Threads::Mutex mutex;
+        std::string pending;
+        std::map<std::string, std::string> known;
+
+        // Queue the properties that are new or changed. Waking up does not
+        // tell which ones: a burst of several is read in one go.
+        void refresh()
+        {
+                std::map<std::string, std::string> values;
+                if (!enumerate(values)) return;
+                std::string changed;
+                for (std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+                        std::map<std::string, std::string>::iterator old = known.find(it->first);
+                        if (old != known.end() && old->second == it->second) continue;
+                        changed += it->first + "=" + it->second + "\n";
+                }
+                known.swap(values);
+                if (changed.empty()) return;
+                Threads::Lock lock(mutex);
+                pending += changed;
+        }
+
+        static void waiter(void *arg)
+        {
+                PropertyChannel *channel = (PropertyChannel *)arg;
+                for (;;) {
+                        channel->wait();
+                        channel->refresh();
+                }
+        }
+};
+
+// VirtualBox guest properties of the VM
+class GuestPropertyChannel : public PropertyChannel {
+public:
+        // set() runs on the main thread with its backend, the waiter
+        // thread runs its own VBoxManage processes
+        GuestPropertyChannel(const std::string &vm, Hypervisor &backend)
+                : vm_name(vm), hypervisor(backend) {}
+
+protected:
+        bool set(const std::string &key, const std::string &value)
+        {
+                return (hypervisor.run("guestproperty set " + vm_name + " \"" GUESTPROP_HOST + quote(key) + "\" \"" +
+                                       quote(value) + "\" --flags TRANSIENT", NULL, 0) == 0);
+        }
+
+        // "Name: /CernVM/Guest/KEY, value: VALUE, timestamp: ..., flags: ..." (VirtualBox 6)
+        // or "/CernVM/Guest/KEY = 'VALUE' @ ..." (VirtualBox 7), one per line
+        bool enumerate(std::map<std::string, std::string> &values)
+        {
+                std::vector<char> buffer(HYPERVISOR_BUFSIZE * 4);
+                if (Backend::cli.command("guestproperty enumerate " + vm_name + " --patterns \"" GUESTPROP_GUEST "*\"",
+                                         &buffer[0], (int)buffer.size()) != 0) return false;
+                std::istringstream lines(&buffer[0]);
+                std::string line;
+                size_t prefix = strlen(GUESTPROP_GUEST);
+                while (std::getline(lines, line)) {
+                        size_t name = line.find(GUESTPROP_GUEST);
+                        if (name == std::string::npos) continue;
+                        std::string key, value;
+                        size_t end = line.find(", value: ", name);
+                        if (end != std::string::npos) {
+                                key = line.substr(name + prefix, end - name - prefix);
+                                size_t begin = end + 9;
+                                end = line.find(", timestamp: ", begin);
+                                value = line.substr(begin, (end == std::string::npos) ? std::string::npos : end - begin);
+                        }
+                        else {
+                                end = line.find(" = '", name);
+                                if (end == std::string::npos) continue;
+                                key = line.substr(name + prefix, end - name - prefix);
+                                size_t begin = end + 4;
+                                end = line.rfind('\'');
+                                if (end == std::string::npos || end < begin) continue;
+                                value = line.substr(begin, end - begin);
+                        }
+                        if (!key.empty()) values[key] = value;
+                }
+                return true;
+        }
+
+        void wait()
+        {
+                std::ostringstream timeout;
+                timeout << GUESTPROP_WAIT_MS;
+                double begin = dtime();
+                int code = Backend::cli.command("guestproperty wait " + vm_name + " \"" GUESTPROP_GUEST "*\" --timeout " +
+                                                timeout.str(), NULL, 0);
+                // Timeouts exit with an error too, only a quick failure is one
+                if (code != 0 && dtime() - begin < 1.0) boinc_sleep(GUESTPROP_RETRY_PERIOD);
+        }
+
+private:
+        std::string vm_name;
+        Hypervisor &hypervisor;
+
+        // The argument goes through a shell: keep it within its double quotes
+        static std::string quote(const std::string &s)
+        {
+                std::string out;
+                for (size_t i = 0; i < s.size(); i++) {
+                        char c = s[i];
+                        out += (c == '"' || c == '\\' || c == '$' || c == '`') ? '_' : c;
+                }
+                return out;
+        }
+};
+
+// Properties as files, a stand-in for the guest properties
+class FilePropertyChannel : public PropertyChannel {
+public:
+        FilePropertyChannel(const std::string &path) : dir(path)
+        {
+                #ifdef _WIN32
+                _mkdir(dir.c_str());
+                _mkdir((dir + "/Host").c_str());
+                _mkdir((dir + "/Guest").c_str());
+                #else
+                mkdir(dir.c_str(), 0700);
+                mkdir((dir + "/Host").c_str(), 0700);
+                mkdir((dir + "/Guest").c_str(), 0700);
+                #endif
+        }
+
+protected:
+        // Written aside then renamed, the guest never reads half a value
+        bool set(const std::string &key, const std::string &value)
+        {
+                std::string path = dir + "/Host/" + key;
+                std::string tmp = path + ".tmp";
+                {
+                        std::ofstream f(tmp.c_str(), std::ios::binary);
+                        if (!f.is_open()) return false;
+                        f << value;
+                        if (!f.good()) return false;
+                }
+                #ifdef _WIN32
+                ::remove(path.c_str());
+                #endif
+                return (rename(tmp.c_str(), path.c_str()) == 0);
+        }
+
+        bool enumerate(std::map<std::string, std::string> &values)
+        {
+                std::string guest = dir + "/Guest";
+                std::vector<std::string> keys;
+                #ifdef _WIN32
+                WIN32_FIND_DATA data;
+                HANDLE h = FindFirstFile((guest + "\\*").c_str(), &data);
+                if (h == INVALID_HANDLE_VALUE) return false;
+                do {
+                        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) keys.push_back(data.cFileName);
+                } while (FindNextFile(h, &data));
+                FindClose(h);
+                #else
+                DIR *d = opendir(guest.c_str());
+                if (!d) return false;
+                struct dirent *entry;
+                while ((entry = readdir(d)) != NULL) {
+                        if (entry->d_name[0] != '.') keys.push_back(entry->d_name);
+                }
+                closedir(d);
+                #endif
+                for (size_t i = 0; i < keys.size(); i++) {
+                        // Values being written by the guest
+                        if (keys[i].size() > 4 && keys[i].compare(keys[i].size() - 4, 4, ".tmp") == 0) continue;
+                        std::ifstream f((guest + "/" + keys[i]).c_str(), std::ios::binary);
+                        if (!f.is_open()) continue;
+                        std::ostringstream value;
+                        value << f.rdbuf();
+                        std::string v = value.str();
+                        // As "echo VALUE > KEY" leaves it
+                        while (!v.empty() && (v[v.size() - 1] == '\n' || v[v.size() - 1] == '\r')) v.erase(v.size() - 1);
+                        values[keys[i]] = v;
+                }
+                return true;
+        }
+
+        void wait()
+        {
+                boinc_sleep(FILEPROP_POLL_PERIOD);
+        }
+
+private:
+        std::string dir;
+};
+
+#endif // GUESTPROP_H
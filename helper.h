@@ -1,27 +1,171 @@
 #include <string>
+#include <vector>
 #include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "snapshot.h"
+#include "image.h"
+#include "crc32c.h"
 
 #define PROGRESS_FN "ProgressFile"
+// Seconds between two writes of the running seconds to PROGRESS_FN
+#define PROGRESS_SAVE_PERIOD 300.0
+#define UNZIP_BUFSIZE (256*1024)
+#define UNZIP_CHECKPOINT (64*1024*1024)
 
 using namespace std;
 
 namespace Helper
 {
-        int unzip(const char *infilename, const char *outfilename)
+        // Positions and sizes of files as 64 bits, long is 32 bits on Windows
+        int seek(FILE *f, long long offset, int whence)
+        {
+                #ifdef _WIN32
+                return _fseeki64(f, offset, whence);
+                #else
+                return fseeko(f, (off_t)offset, whence);
+                #endif
+        }
+
+        long long tell(FILE *f)
+        {
+                #ifdef _WIN32
+                return _ftelli64(f);
+                #else
+                return (long long)ftello(f);
+                #endif
+        }
+
+        // Returns false if the file cannot be read
+        bool file_size(const std::string &path, long long &size)
+        {
+                #ifdef _WIN32
+                struct _stati64 st;
+                if (_stati64(path.c_str(), &st)) return false;
+                #else
+                struct stat st;
+                if (stat(path.c_str(), &st)) return false;
+                #endif
+                size = (long long)st.st_size;
+                return true;
+        }
+
+        // Decompress the image infilename (gzip, zstd or xz) into outfilename.
+        // When offset is not 0 the first offset bytes of outfilename were
+        // written by an interrupted run, and decompression goes on after them.
+        // Every UNZIP_CHECKPOINT bytes the output is flushed to disk and
+        // checkpoint() is called with the number of bytes written and their
+        // CRC32C, so that a later run can resume from there.
+        // crc holds the CRC32C of the first offset bytes, and gets the one of
+        // the whole output.
+        int unzip(const char *infilename, const char *outfilename, long long offset = 0, 
+                  void (*checkpoint)(long long, unsigned int) = NULL, unsigned int *crc = NULL)
         {
-                gzFile infile = gzopen(infilename, "rb");
-                FILE *outfile = fopen(outfilename, "wb");
-                if (!infile || !outfile) return -1;
+                unsigned int sum = (crc && offset > 0) ? *crc : 0;
+                ImageFormat format;
+                Image::Decoder *decoder = Image::open(infilename, format);
+                if (!decoder) return -1;
+                LOG_NOTICE("Decompressing " << infilename << " (" << Image::format_name(format) << ")");
+
+                FILE *outfile = NULL;
+                if (offset > 0) {
+                        outfile = fopen(outfilename, "r+b");
+                        // The part already written must still be there
+                        if (outfile && (seek(outfile, 0, SEEK_END) || (tell(outfile) < offset) ||
+                                        seek(outfile, offset, SEEK_SET) || !decoder->skip(offset))) {
+                                LOG_WARNING("Impossible to resume the decompression at " << offset << " bytes, starting again");
+                                fclose(outfile);
+                                outfile = NULL;
+                                delete decoder;
+                                decoder = Image::open(infilename, format);
+                                if (!decoder) return -1;
+                        }
+                }
+                if (!outfile) {
+                        offset = 0;
+                        sum = 0;
+                        outfile = fopen(outfilename, "wb");
+                }
+                if (!outfile) {
+                        delete decoder;
+                        return -1;
+                }
             
-                char buffer[128];
-                int num_read = 0;
+                std::vector<char> buffer(UNZIP_BUFSIZE);
+                long num_read = 0;
+                long long written = offset, next_checkpoint = offset + UNZIP_CHECKPOINT;
             
-                while ((num_read = gzread(infile, buffer, sizeof(buffer))) > 0) {
-                        fwrite(buffer, 1, num_read, outfile);
+                while ((num_read = decoder->read(&buffer[0], buffer.size())) > 0) {
+                        if (fwrite(&buffer[0], 1, num_read, outfile) != (size_t)num_read) {
+                                num_read = -1;
+                                break;
+                        }
+                        written += num_read;
+                        sum = Crc32c::update(sum, &buffer[0], num_read);
+                        if (checkpoint && written >= next_checkpoint) {
+                                fflush(outfile);
+                                #ifdef _WIN32
+                                _commit(_fileno(outfile));
+                                #else
+                                fsync(fileno(outfile));
+                                #endif
+                                checkpoint(written, sum);
+                                next_checkpoint = written + UNZIP_CHECKPOINT;
+                        }
                 }
             
-                gzclose(infile);
-                fclose(outfile);
+                delete decoder;
+                if (fclose(outfile)) num_read = -1;
+                if (crc) *crc = sum;
+                return (num_read < 0) ? -1 : 0;
+        }
+
+        // Resolve the compressed image shipped with the work unit. Projects may
+        // ship it in several formats, the first one this build can decode wins.
+        // Returns 0 on success.
+        int resolve_image(string &resolved)
+        {
+                const char *names[] = {"cernvm.vmdk.zst", "cernvm.vmdk.xz", "cernvm.vmdk.gz"};
+                for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                        if (boinc_resolve_filename_s(names[i], resolved)) continue;
+                        std::ifstream f(resolved.c_str());
+                        if (!f.is_open()) continue;
+                        ImageFormat format = Image::detect(resolved.c_str());
+                        if (!Image::supported(format)) {
+                                LOG_NOTICE("Skipping " << names[i] << ": " << Image::format_name(format) << " is not supported by this build");
+                                continue;
+                        }
+                        LOG_NOTICE("Using " << names[i] << " (" << Image::format_name(format) << ")");
+                        return 0;
+                }
+                return -1;
+        }
+
+        // Create path if needed, for files shared by the wrappers of this
+        // user. Returns false if it is not a directory that only this user
+        // can use: another local user who made it first, or a symbolic link
+        // in its place, could otherwise feed the wrappers or have them write
+        // elsewhere.
+        bool private_dir(const string &path)
+        {
+                #ifdef _WIN32
+                _mkdir(path.c_str());
+                struct _stat st;
+                return (_stat(path.c_str(), &st) == 0) && (st.st_mode & _S_IFDIR);
+                #else
+                mkdir(path.c_str(), 0700);
+                struct stat st;
+                if (lstat(path.c_str(), &st)) return false;
+                return S_ISDIR(st.st_mode) && (st.st_uid == geteuid()) && !(st.st_mode & (S_IRWXG | S_IRWXO));
+                #endif
         }
 
         #ifdef _WIN32
@@ -36,7 +180,7 @@ namespace Helper
         bool SettingWindowsPath()
         {
                 // DEBUG information:
-                cerr << "Setting VirtualBox PATH in Windows..." << endl;
+                LOG_MSG("Setting VirtualBox PATH in Windows...");
 
                 // First, we try to check if the VirtualBox path exists
                 string old_path = getenv("path");
@@ -44,7 +188,7 @@ namespace Helper
                 vbox_path += "\\Oracle\\VirtualBox";
 
                 if (GetFileAttributes(vbox_path.c_str()) != INVALID_FILE_ATTRIBUTES) {
-                        cerr << "NOTICE: Success!!! VirtualBox is installed" << endl;
+                        LOG_NOTICE("Success!!! VirtualBox is installed");
                         //cerr << "NOTICE: Success!!! Installation PATH of VirtualBox is: " << vbox_path << endl;
                         string new_path = "path=";
                         new_path += vbox_path;
@@ -55,9 +199,9 @@ namespace Helper
                         return (true);
                 }
                 else {
-                        cerr << "ERROR: failing detecting the folder, trying with registry..." << endl;
+                        LOG_ERROR("failing detecting the folder, trying with registry...");
                         // Second get the HKEY_LOCAL_MACHINE\SOFTWARE\Oracle\VirtualBox
-                        cerr << "INFO: Trying to get the installation PATH of VirtualBox from the Windows Registry..." << endl;
+                        LOG_NOTICE("Trying to get the installation PATH of VirtualBox from the Windows Registry...");
                         HKEY keyHandle;
                         DWORD dwBufLen;
                         LPTSTR  szPath = NULL;
@@ -70,28 +214,28 @@ namespace Helper
                                         
                                         // Now get the data
                                         if (RegQueryValueEx (keyHandle, _T("InstallDir"), NULL, NULL, (LPBYTE)szPath, &dwBufLen) == ERROR_SUCCESS) {
-                                                cerr << "NOTICE: Success!!! Installation PATH of VirtualBox is: " << szPath << endl;
-                                                cerr << "NOTICE: Old PATH: " << old_path << endl;
+                                                LOG_NOTICE("Success!!! Installation PATH of VirtualBox is: " << szPath);
+                                                LOG_NOTICE("Old PATH: " << old_path);
                                                 
                                                 string new_path = "path=";
                                                 new_path += szPath;
                                                 new_path += ";";
                                                 new_path += old_path;
                                                 putenv(const_cast<char*>(new_path.c_str()));
-                                                cerr << "INFO: New PATH: " << getenv("path") << endl;
+                                                LOG_NOTICE("New PATH: " << getenv("path"));
                                                 if (szPath) free(szPath);
                                                 return(true);
                                         }
     	                			
                                 }
                                 else {
-                                             cerr << "ERROR: Retrieving the HKEY_LOCAL_MACHINE\\SOFTWARE\\Oracle\\VirtualBox\\InstallDir value was impossible" << endl;
+                                             LOG_ERROR("Retrieving the HKEY_LOCAL_MACHINE\\SOFTWARE\\Oracle\\VirtualBox\\InstallDir value was impossible");
                                 }
                                 if (keyHandle) RegCloseKey(keyHandle);	
                                 return (false);
                         }
                         else {
-                                cerr << "ERROR: Opening Windows Registry" << endl;
+                                LOG_ERROR("Opening Windows Registry");
                                 return (false);
                         }
                 }
@@ -100,8 +244,14 @@ namespace Helper
 
         #endif
 
+        // Running seconds of the work unit, -1 until PROGRESS_FN is read
+        double progress_secs = -1;
+        double progress_saved = 0;
+
         void write_progress(double secs)
         {
+                progress_secs = secs;
+                progress_saved = dtime();
                 std::ofstream f(PROGRESS_FN);
                 if (f.is_open()) {
                         f <<  secs;
@@ -126,25 +276,39 @@ namespace Helper
                 }
         }
         
+        // Add secs to the running seconds. They are kept in memory and only
+        // written every PROGRESS_SAVE_PERIOD seconds, and by save_progress().
         double update_progress(double secs, int debug_level = 3) 
         {
-                double old_secs;
-            
-                old_secs = read_progress();
-                if (old_secs != -1) {
-                        write_progress(old_secs +  secs);
-                        return(old_secs + secs);
-                }
-                else {
-                        cerr << "ERROR: Reading old_secs from ProgressFile failed" << endl;
-                        boinc_finish(1);
-                        return(-1);
+                if (progress_secs < 0) {
+                        double old_secs = read_progress();
+                        if (old_secs == -1) {
+                                LOG_ERROR("Reading old_secs from ProgressFile failed");
+                                Log::finish(1);
+                                return(-1);
+                        }
+                        progress_secs = old_secs;
+                        progress_saved = dtime();
                 }
+                progress_secs += secs;
+                if (dtime() - progress_saved >= PROGRESS_SAVE_PERIOD) write_progress(progress_secs);
+                return(progress_secs);
+        }
+
+        // Write the running seconds now, before the wrapper exits
+        void save_progress()
+        {
+                if (progress_secs >= 0) write_progress(progress_secs);
         }
 
         #ifdef APP_GRAPHICS
+        // BOINC timer callback. It only copies the snapshot published by the main loop,
+        // so no init_data.xml parsing is done here.
         void update_shmem() 
         {
+                static unsigned int init_generation = 0;
+                Snapshot::Data snapshot;
+
                 if (!Share::data) return;
                 // always do this; otherwise a graphics app will immediately
                 // assume we're not alive
@@ -160,10 +324,21 @@ namespace Helper
                 } else {
                         return;
                 }
-                Share::data->fraction_done = boinc_get_fraction_done();
-                Share::data->cpu_time = boinc_worker_thread_cpu_time();;
-                boinc_get_status(&Share::data->status);
-                boinc_get_init_data(Share::data->init_data);
+                if (!Snapshot::read(snapshot)) return;
+                Share::data->fraction_done = snapshot.fraction_done;
+                Share::data->cpu_time = snapshot.cpu_time;
+                Share::data->status = snapshot.status;
+                if (snapshot.init_generation != init_generation) {
+                        APP_INIT_DATA &init_data = Share::data->init_data;
+                        Snapshot::copy_string(init_data.user_name, snapshot.user_name, sizeof(init_data.user_name));
+                        Snapshot::copy_string(init_data.team_name, snapshot.team_name, sizeof(init_data.team_name));
+                        Snapshot::copy_string(init_data.wu_name, snapshot.wu_name, sizeof(init_data.wu_name));
+                        init_data.userid = snapshot.userid;
+                        init_data.hostid = snapshot.hostid;
+                        init_data.user_total_credit = snapshot.user_total_credit;
+                        init_data.host_total_credit = snapshot.host_total_credit;
+                        init_generation = snapshot.init_generation;
+                }
         }
         #endif
 }
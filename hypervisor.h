@@ -0,0 +1,908 @@
+// Hypervisor backends for the CernVM wrapper
+//
+// Every VBoxManage command of the wrapper goes through vbm_popen(), which
+// hands it to the selected backend:
+//
+//  - cli:     runs VBoxManage in a new process for every command (default)
+//  - session: keeps one session with vboxwebsrv, the web service of
+//             VirtualBox, for the state of the VM and pause, resume,
+//             savestate and poweroff, so the main loop starts no VBoxManage
+//             process. The other commands, and all of them while vboxwebsrv
+//             cannot be reached, go through the cli backend.
+//  - mock:    keeps the VMs and their states in memory. It runs no
+//             hypervisor at all, to exercise the wrapper on any host.
+//
+// On top of command(), Hypervisor offers the operations the VM needs
+// (create, start, state, control, remove...). The defaults build them from
+// VBoxManage commands, a backend can override them.
+
+#ifndef HYPERVISOR_H
+#define HYPERVISOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+
+#include "threads.h"
+#include "trace.h"
+#include "net.h"
+
+#define HYPERVISOR_BUFSIZE 4096
+#define SESSION_DEFAULT_ENDPOINT "127.0.0.1:18083"
+#define SESSION_MAX_OUTPUT (1024*1024)
+// Seconds to connect to vboxwebsrv, and to send or receive on the connection
+#define SESSION_TIMEOUT 10
+// Seconds the fallback backend is used after vboxwebsrv could not be reached
+#define SESSION_RETRY_PERIOD 60.0
+// Milliseconds of every wait for an operation (saving the state...), and
+// seconds before it is left to the fallback backend
+#define SESSION_PROGRESS_POLL 1000
+#define SESSION_PROGRESS_TIMEOUT 600.0
+
+// Run a VBoxManage command in a new process.
+// When buffer is NULL, this function will not return the input of new process.
+// Otherwise, it will not redirect the input of new process to buffer.
+// Returns the exit code of the command, or -1 if it could not be run.
+int vbm_exec(string arg_list, char * buffer, int nSize, string command) {
+#ifdef _WIN32
+        STARTUPINFO si;
+        SECURITY_ATTRIBUTES sa;
+        SECURITY_DESCRIPTOR sd; //security information for pipes
+        PROCESS_INFORMATION pi;
+        HANDLE newstdout,read_stdout; //pipe handles
+        unsigned long exit=0;
+        if (buffer!=0) {
+            //initialize security descriptor (Windows NT)
+            if (Helper::IsWinNT()) {
+                    InitializeSecurityDescriptor(&sd,SECURITY_DESCRIPTOR_REVISION);
+                    SetSecurityDescriptorDacl(&sd, true, NULL, false);
+                    sa.lpSecurityDescriptor = &sd;
+            }
+            else sa.lpSecurityDescriptor = NULL;
+            sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+            sa.bInheritHandle = true; //allow inheritable handles
+
+            //create stdout pipe
+            if (!CreatePipe(&read_stdout,&newstdout,&sa,0)) {
+                    LOG_ERROR("CreatePipe failed!!");
+                    CloseHandle(newstdout);
+                    CloseHandle(read_stdout);
+                    return -1;
+            }
+        }
+
+        GetStartupInfo(&si);
+        si.dwFlags = STARTF_USESHOWWINDOW;
+        si.wShowWindow = SW_HIDE;
+
+        if (buffer != NULL) {
+                si.dwFlags = STARTF_USESTDHANDLES|si.dwFlags;
+                si.hStdOutput = newstdout;
+                si.hStdError = newstdout;   //set the new handles for the child process
+                si.hStdInput = NULL;
+        }
+    
+        command += arg_list;
+
+        if (!CreateProcess( NULL, (LPTSTR)command.c_str(), NULL, NULL, TRUE,
+                                    CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+                LOG_ERROR("CreateProcess failed!");
+                if (buffer!=NULL) {
+                        CloseHandle(newstdout);
+                        CloseHandle(read_stdout);
+                }
+                return -1;
+        }
+    
+        // Wait until process exits.
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        GetExitCodeProcess(pi.hProcess, &exit);
+    
+        // Close process and thread handles.
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+    
+        if (buffer!=NULL) {
+                memset(buffer, 0, nSize);
+                DWORD bread;
+                BOOL bSuccess = false;
+    
+                for (;;)
+                {
+                    ReadFile(read_stdout, buffer, nSize-1, &bread, NULL);
+                    if (!bSuccess || bread == 0) break;
+                }
+                // buffer[bread]=0;
+                CloseHandle(newstdout);
+                CloseHandle(read_stdout);
+        }
+    
+        return (int)exit;
+// GNU/Linux and Mac OS X code
+#else     
+        FILE *fp;
+        char temp[256];
+        string strTemp = "";
+        command += arg_list;
+        if (buffer == NULL) {
+                int status = system(command.c_str());
+                if (status == -1) return -1;
+                return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+        }
+    
+        // VBoxManage writes its errors to stderr, catch them as on Windows
+        command += " 2>&1";
+        fp = popen(command.c_str(), "r");
+        if (fp == NULL) {
+                LOG_ERROR("vbm_exec failed");
+                return -1;
+        }
+
+        memset(buffer, 0, nSize);
+        while (fgets(temp,256,fp) != NULL) {
+            strTemp += temp;
+        }
+
+        int status = pclose(fp);
+        strncpy(buffer, strTemp.c_str(), nSize-1);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+#endif
+}
+
+
+class Hypervisor {
+public:
+        virtual ~Hypervisor() {}
+
+        virtual const char *name() = 0;
+
+        // Run one VBoxManage command, e.g. "showvminfo BOINC_VM --machinereadable".
+        // When buffer is not NULL it gets the output of the command.
+        // Returns the exit code, or -1 if the command could not be run.
+        virtual int command(const std::string &arg_list, char *buffer, int nSize) = 0;
+
+        // command() inside a trace span named after the VBoxManage subcommand
+        int run(const std::string &arg_list, char *buffer, int nSize)
+        {
+                size_t cmd_begin = arg_list.find_first_not_of(" ");
+                size_t cmd_end = arg_list.find(' ', cmd_begin);
+                Trace::Span span("VBoxManage " + ((cmd_begin == std::string::npos) ? std::string("") :
+                                                   arg_list.substr(cmd_begin, cmd_end - cmd_begin)), "command");
+                span.arg("args", arg_list);
+                span.arg("backend", name());
+
+                int code = command(arg_list, buffer, nSize);
+                span.arg("exit_code", (double)code);
+                return code;
+        }
+
+        int run(const std::string &arg_list, std::string &output)
+        {
+                char buffer[HYPERVISOR_BUFSIZE];
+                buffer[0] = 0;
+                int code = run(arg_list, buffer, sizeof(buffer));
+                output = (code == -1) ? "" : buffer;
+                return code;
+        }
+
+        virtual bool create(const std::string &vm, const std::string &ostype)
+        {
+                return (run("createvm --name " + vm + " --ostype " + ostype + " --register", NULL, 0) == 0);
+        }
+
+        // output gets the messages of VBoxManage, to classify the failures
+        virtual bool start(const std::string &vm, bool headless, std::string &output)
+        {
+                int code = run("startvm " + vm + (headless ? " --type headless" : ""), output);
+                return (code == 0) && (output.find("error:") == std::string::npos);
+        }
+
+        // Current state of the VM (running, paused, saved, poweroff...)
+        virtual bool state(const std::string &vm, std::string &state, std::string &output)
+        {
+                if (run("showvminfo " + vm + " --machinereadable", output) == -1) return false;
+                size_t begin = output.find("VMState=\"");
+                if (begin == std::string::npos) return false;
+                begin += 9;
+                size_t end = output.find('"', begin);
+                if (end == std::string::npos) return false;
+                state = output.substr(begin, end - begin);
+                return true;
+        }
+
+        virtual bool control(const std::string &vm, const std::string &action, std::string &output)
+        {
+                return (run("controlvm " + vm + " " + action, output) == 0);
+        }
+
+        bool pause(const std::string &vm, std::string &output)
+        {
+                return control(vm, "pause", output);
+        }
+
+        bool resume(const std::string &vm, std::string &output)
+        {
+                return control(vm, "resume", output);
+        }
+
+        bool savestate(const std::string &vm, std::string &output)
+        {
+                return control(vm, "savestate", output);
+        }
+
+        virtual bool remove(const std::string &vm)
+        {
+                return (run("unregistervm " + vm + " --delete", NULL, 0) == 0);
+        }
+
+        // Performance metrics of the VM, "metrics setup" has to be run first
+        virtual bool metrics(const std::string &vm, std::string &output)
+        {
+                return (run("metrics query " + vm, output) == 0);
+        }
+};
+
+// VBoxManage in a new process for every command
+class CliHypervisor : public Hypervisor {
+public:
+        CliHypervisor() : program("VBoxManage -q ") {}
+
+        const char *name()
+        {
+                return "cli";
+        }
+
+        int command(const std::string &arg_list, char *buffer, int nSize)
+        {
+                return vbm_exec(arg_list, buffer, nSize, program);
+        }
+
+        std::string program;
+};
+
+// The VMs of a persistent session with vboxwebsrv, the web service of
+// VirtualBox. One logon and one HTTP connection are kept for the whole run,
+// and the operations of the main loop (state, pause, resume, savestate,
+// poweroff) are SOAP calls on it: no process is started for them. The rest
+// (creating the VM, storage, metrics...) runs once per work unit and goes
+// to the fallback backend, as does everything while vboxwebsrv cannot be
+// reached. The connection has timeouts, so a hung vboxwebsrv only holds
+// the main loop for SESSION_TIMEOUT seconds before the fallback takes over.
+// The object is shared by the threads of --gc, calls are serialized.
+class SessionHypervisor : public Hypervisor {
+public:
+        SessionHypervisor(const std::string &endpoint, Hypervisor &fallback_backend)
+                : fallback(fallback_backend)
+        {
+                if (!Net::parse_endpoint(endpoint, host, port)) {
+                        LOG_WARNING("Invalid session endpoint " << endpoint << ", using " << SESSION_DEFAULT_ENDPOINT);
+                        Net::parse_endpoint(SESSION_DEFAULT_ENDPOINT, host, port);
+                }
+                s = NET_INVALID;
+                retry_at = 0;
+                connected_once = false;
+                falling_back = false;
+                #ifndef _WIN32
+                // A vboxwebsrv that goes away while a request is sent must not kill the wrapper
+                signal(SIGPIPE, SIG_IGN);
+                #endif
+        }
+
+        ~SessionHypervisor()
+        {
+                Threads::Lock lock(mutex);
+                if (!vbox.empty()) {
+                        std::string result;
+                        call("IWebsessionManager_logoff", param("refIVirtualBox", vbox), result);
+                }
+                disconnect();
+        }
+
+        const char *name()
+        {
+                return "session";
+        }
+
+        // "user\npassword" of the logon, for a vboxwebsrv that authenticates
+        // its clients (websrvauthlibrary other than null)
+        bool read_credentials(const std::string &path)
+        {
+                std::ifstream f(path.c_str());
+                if (!f.is_open()) return false;
+                std::getline(f, username);
+                std::getline(f, password);
+                return true;
+        }
+
+        int command(const std::string &arg_list, char *buffer, int nSize)
+        {
+                return fallback.command(arg_list, buffer, nSize);
+        }
+
+        bool state(const std::string &vm, std::string &state, std::string &output)
+        {
+                {
+                        Threads::Lock lock(mutex);
+                        int result = machine_state(vm, state, output);
+                        if (result != SESSION_UNAVAILABLE) return (result == SESSION_OK);
+                }
+                return fallback.state(vm, state, output);
+        }
+
+        bool control(const std::string &vm, const std::string &action, std::string &output)
+        {
+                if (action == "pause" || action == "resume" || action == "savestate" || action == "poweroff" ||
+                    action == "acpipowerbutton") {
+                        Threads::Lock lock(mutex);
+                        int result = console_action(vm, action, output);
+                        if (result != SESSION_UNAVAILABLE) return (result == SESSION_OK);
+                }
+                return fallback.control(vm, action, output);
+        }
+
+private:
+        enum Result {
+                SESSION_OK,
+                SESSION_FAULT,          // the call failed, output has the error
+                SESSION_UNAVAILABLE     // no session, the fallback is used
+        };
+
+        std::string host;
+        int port;
+        socket_t s;
+        double retry_at;                // vboxwebsrv is not tried again before
+        bool connected_once;
+        bool falling_back;
+        Hypervisor &fallback;
+        Threads::Mutex mutex;
+        std::string username;
+        std::string password;
+
+        // Managed object references of the session
+        std::string vbox;                               // IVirtualBox
+        std::string session;                            // ISession
+        std::map<std::string, std::string> machines;    // name -> IMachine
+
+        static std::string escape(const std::string &text)
+        {
+                std::string out;
+                for (size_t i = 0; i < text.size(); i++) {
+                        switch (text[i]) {
+                        case '&': out += "&amp;"; break;
+                        case '<': out += "&lt;"; break;
+                        case '>': out += "&gt;"; break;
+                        case '"': out += "&quot;"; break;
+                        default:  out += text[i];
+                        }
+                }
+                return out;
+        }
+
+        static std::string unescape(const std::string &text)
+        {
+                std::string out;
+                for (size_t i = 0; i < text.size(); i++) {
+                        if (text[i] == '&') {
+                                if (!text.compare(i, 5, "&amp;"))  { out += '&'; i += 4; continue; }
+                                if (!text.compare(i, 4, "&lt;"))   { out += '<'; i += 3; continue; }
+                                if (!text.compare(i, 4, "&gt;"))   { out += '>'; i += 3; continue; }
+                                if (!text.compare(i, 6, "&quot;")) { out += '"'; i += 5; continue; }
+                                if (!text.compare(i, 6, "&apos;")) { out += '\''; i += 5; continue; }
+                        }
+                        out += text[i];
+                }
+                return out;
+        }
+
+        static std::string param(const std::string &name, const std::string &value)
+        {
+                return "<" + name + ">" + escape(value) + "</" + name + ">";
+        }
+
+        // Text of the first <tag> element of xml
+        static bool element(const std::string &xml, const std::string &tag, std::string &text)
+        {
+                size_t begin = xml.find("<" + tag + ">");
+                if (begin == std::string::npos) return false;
+                begin += tag.size() + 2;
+                size_t end = xml.find("</" + tag + ">", begin);
+                if (end == std::string::npos) return false;
+                text = unescape(xml.substr(begin, end - begin));
+                return true;
+        }
+
+        // MachineState of the API, as showvminfo --machinereadable reports it
+        static std::string state_name(const std::string &state)
+        {
+                if (state == "PoweredOff") return "poweroff";
+                if (state == "Stuck") return "gurumeditation";
+                if (state == "AbortedSaved") return "aborted-saved";
+                std::string name;
+                for (size_t i = 0; i < state.size(); i++) name += (char)tolower((unsigned char)state[i]);
+                return name;
+        }
+
+        bool connect()
+        {
+                if (s != NET_INVALID) return true;
+                s = Net::connect_to(host, port, SESSION_TIMEOUT);
+                if (s == NET_INVALID) return false;
+                if (!connected_once) {
+                        LOG_NOTICE("Connected to vboxwebsrv at " << host << ":" << port);
+                        connected_once = true;
+                }
+                return true;
+        }
+
+        void disconnect()
+        {
+                if (s != NET_INVALID) net_close(s);
+                s = NET_INVALID;
+        }
+
+        // One HTTP exchange on the connection. Returns false if it broke.
+        bool post(const std::string &body, std::string &reply)
+        {
+                std::ostringstream request;
+                request << "POST / HTTP/1.1\r\n"
+                        << "Host: " << host << ":" << port << "\r\n"
+                        << "Content-Type: text/xml; charset=utf-8\r\n"
+                        << "SOAPAction: \"\"\r\n"
+                        << "Content-Length: " << body.size() << "\r\n\r\n";
+                if (!Net::send_all(s, request.str()) || !Net::send_all(s, body)) return false;
+
+                // HTTP/1.1 200 OK, or 500 with a SOAP fault
+                std::string line;
+                if (!Net::recv_line(s, line) || line.compare(0, 5, "HTTP/")) return false;
+                long length = -1;
+                bool chunked = false, close = false;
+                for (;;) {
+                        if (!Net::recv_line(s, line)) return false;
+                        if (line.empty()) break;
+                        std::string header = line.substr(0, line.find(':'));
+                        for (size_t i = 0; i < header.size(); i++) header[i] = (char)tolower((unsigned char)header[i]);
+                        std::string value = (line.find(':') == std::string::npos) ? "" : line.substr(line.find(':') + 1);
+                        if (header == "content-length") length = atol(value.c_str());
+                        else if (header == "transfer-encoding" && value.find("chunked") != std::string::npos) chunked = true;
+                        else if (header == "connection" && value.find("close") != std::string::npos) close = true;
+                }
+
+                reply.clear();
+                if (chunked) {
+                        for (;;) {
+                                if (!Net::recv_line(s, line)) return false;
+                                long size = strtol(line.c_str(), NULL, 16);
+                                if (size < 0 || reply.size() + size > SESSION_MAX_OUTPUT) return false;
+                                if (size == 0) {
+                                        // Trailers, up to the empty line
+                                        while (Net::recv_line(s, line) && !line.empty()) {}
+                                        break;
+                                }
+                                std::string chunk(size, ' ');
+                                if (!Net::recv_exact(s, &chunk[0], size) || !Net::recv_line(s, line)) return false;
+                                reply += chunk;
+                        }
+                }
+                else {
+                        if (length < 0 || length > SESSION_MAX_OUTPUT) return false;
+                        reply.assign(length, ' ');
+                        if (length && !Net::recv_exact(s, &reply[0], length)) return false;
+                }
+                if (close) disconnect();
+                return true;
+        }
+
+        // Call a method of the web service. result gets the returnval, or the
+        // fault string when the call failed.
+        Result call(const std::string &method, const std::string &params, std::string &result)
+        {
+                std::string body =
+                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                        "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                        "xmlns:vbox=\"http://www.virtualbox.org/\"><SOAP-ENV:Body>"
+                        "<vbox:" + method + ">" + params + "</vbox:" + method + ">"
+                        "</SOAP-ENV:Body></SOAP-ENV:Envelope>";
+                std::string reply;
+                bool sent = false;
+                if (dtime() < retry_at) return SESSION_UNAVAILABLE;
+                // A kept connection closed by the server is opened again once,
+                // one that timed out is not
+                for (int attempt = 0; attempt < 2 && !sent; attempt++) {
+                        bool reused = (s != NET_INVALID);
+                        double begin = dtime();
+                        if (!connect()) break;
+                        sent = post(body, reply);
+                        if (!sent) disconnect();
+                        if (!reused || dtime() - begin >= SESSION_TIMEOUT) break;
+                }
+                if (!sent) {
+                        retry_at = dtime() + SESSION_RETRY_PERIOD;
+                        return SESSION_UNAVAILABLE;
+                }
+
+                result.clear();
+                if (element(reply, "faultstring", result)) return SESSION_FAULT;
+                element(reply, "returnval", result);
+                return SESSION_OK;
+        }
+
+        // Log on and get the session object, once
+        bool logon()
+        {
+                if (!vbox.empty()) return true;
+                std::string ref, fault;
+                Result result = call("IWebsessionManager_logon", param("username", username) + param("password", password), ref);
+                if (result == SESSION_OK && !ref.empty()) {
+                        std::string session_ref;
+                        result = call("IWebsessionManager_getSessionObject", param("refIVirtualBox", ref), session_ref);
+                        if (result == SESSION_OK && !session_ref.empty()) {
+                                vbox = ref;
+                                session = session_ref;
+                                machines.clear();
+                                if (falling_back) {
+                                        LOG_NOTICE("Session with vboxwebsrv at " << host << ":" << port << " established again");
+                                        falling_back = false;
+                                }
+                                return true;
+                        }
+                        fault = session_ref;
+                }
+                else fault = ref;
+
+                if (!falling_back) {
+                        LOG_WARNING("No session with vboxwebsrv at " << host << ":" << port << ", running VBoxManage instead");
+                        if (result == SESSION_FAULT && !fault.empty()) LOG_WARNING(fault);
+                        falling_back = true;
+                }
+                return false;
+        }
+
+        // The references die with the web session (vboxwebsrv restarted, or
+        // the session timed out): log on again
+        bool expired(Result result, const std::string &fault)
+        {
+                if (result == SESSION_UNAVAILABLE ||
+                    (result == SESSION_FAULT && fault.find("Invalid managed object reference") != std::string::npos)) {
+                        vbox.clear();
+                        session.clear();
+                        machines.clear();
+                        return true;
+                }
+                return false;
+        }
+
+        // IMachine of vm, or the fault in machine
+        Result find_machine(const std::string &vm, std::string &machine)
+        {
+                std::map<std::string, std::string>::iterator it = machines.find(vm);
+                if (it != machines.end()) {
+                        machine = it->second;
+                        return SESSION_OK;
+                }
+                Result result = call("IVirtualBox_findMachine", param("_this", vbox) + param("nameOrId", vm), machine);
+                if (result == SESSION_OK) machines[vm] = machine;
+                return result;
+        }
+
+        Result machine_state(const std::string &vm, std::string &state, std::string &output)
+        {
+                for (int attempt = 0; attempt < 2; attempt++) {
+                        if (!logon()) return SESSION_UNAVAILABLE;
+                        std::string machine, value;
+                        Result result = find_machine(vm, machine);
+                        if (result == SESSION_OK) result = call("IMachine_getState", param("_this", machine), value);
+                        else value = machine;
+                        if (expired(result, value)) continue;
+                        if (result == SESSION_FAULT) {
+                                // e.g. unregistered since it was looked up
+                                machines.erase(vm);
+                                output = "VBoxManage: error: " + value + "\n";
+                                return SESSION_FAULT;
+                        }
+                        state = state_name(value);
+                        output = "VMState=\"" + state + "\"\n";
+                        return SESSION_OK;
+                }
+                return SESSION_UNAVAILABLE;
+        }
+
+        // Wait for an IProgress and release it. The waits are short, so that
+        // a hung vboxwebsrv is noticed through the timeout of the connection.
+        // An operation still running after SESSION_PROGRESS_TIMEOUT seconds
+        // is left to the fallback backend.
+        Result wait_progress(const std::string &progress, std::string &output)
+        {
+                std::string value;
+                std::ostringstream poll;
+                poll << SESSION_PROGRESS_POLL;
+                double deadline = dtime() + SESSION_PROGRESS_TIMEOUT;
+                Result result;
+                for (;;) {
+                        result = call("IProgress_waitForCompletion", param("_this", progress) + param("timeout", poll.str()), value);
+                        if (result == SESSION_OK) result = call("IProgress_getCompleted", param("_this", progress), value);
+                        if (result != SESSION_OK || value == "true") break;
+                        if (dtime() > deadline) {
+                                LOG_WARNING("vboxwebsrv has not completed the operation after " << SESSION_PROGRESS_TIMEOUT << " seconds");
+                                result = SESSION_UNAVAILABLE;
+                                break;
+                        }
+                }
+                if (result == SESSION_OK) result = call("IProgress_getResultCode", param("_this", progress), value);
+                if (result == SESSION_OK && atol(value.c_str()) != 0) {
+                        output = "VBoxManage: error: operation failed with result code " + value + "\n";
+                        result = SESSION_FAULT;
+                }
+                else if (result == SESSION_FAULT) output = "VBoxManage: error: " + value + "\n";
+                std::string ignored;
+                call("IManagedObjectRef_release", param("_this", progress), ignored);
+                return result;
+        }
+
+        // What controlvm <vm> <action> does, on a shared lock of the machine
+        Result console_action(const std::string &vm, const std::string &action, std::string &output)
+        {
+                for (int attempt = 0; attempt < 2; attempt++) {
+                        if (!logon()) return SESSION_UNAVAILABLE;
+                        std::string machine, value, console;
+                        Result result = find_machine(vm, machine);
+                        if (result == SESSION_OK) {
+                                result = call("IMachine_lockMachine", param("_this", machine) + param("session", session) +
+                                              param("lockType", "Shared"), value);
+                        }
+                        else value = machine;
+                        if (expired(result, value)) continue;
+                        if (result == SESSION_FAULT) {
+                                // Not running, or unregistered since it was looked up
+                                if (value.find("Could not find") != std::string::npos) machines.erase(vm);
+                                output = "VBoxManage: error: " + value + "\n";
+                                return SESSION_FAULT;
+                        }
+
+                        result = call("ISession_getConsole", param("_this", session), console);
+                        if (result == SESSION_OK) {
+                                if (action == "pause") result = call("IConsole_pause", param("_this", console), value);
+                                else if (action == "resume") result = call("IConsole_resume", param("_this", console), value);
+                                else if (action == "acpipowerbutton") result = call("IConsole_powerButton", param("_this", console), value);
+                                else if (action == "poweroff") {
+                                        result = call("IConsole_powerDown", param("_this", console), value);
+                                        if (result == SESSION_OK) result = wait_progress(value, output);
+                                }
+                                else {
+                                        // IConsole::saveState until VirtualBox 6.1, IMachine::saveState
+                                        // of the mutable machine of the session since 7.0
+                                        result = call("IConsole_saveState", param("_this", console), value);
+                                        if (result == SESSION_FAULT) {
+                                                std::string console_fault = value, mutable_machine;
+                                                result = call("ISession_getMachine", param("_this", session), mutable_machine);
+                                                if (result == SESSION_OK) {
+                                                        result = call("IMachine_saveState", param("_this", mutable_machine), value);
+                                                        std::string ignored;
+                                                        call("IManagedObjectRef_release", param("_this", mutable_machine), ignored);
+                                                }
+                                                if (result == SESSION_FAULT) value = console_fault + "\n" + value;
+                                        }
+                                        if (result == SESSION_OK) result = wait_progress(value, output);
+                                }
+                                std::string ignored;
+                                call("IManagedObjectRef_release", param("_this", console), ignored);
+                        }
+                        if (result == SESSION_FAULT && output.empty()) output = "VBoxManage: error: " + value + "\n";
+                        std::string ignored;
+                        call("ISession_unlockMachine", param("_this", session), ignored);
+                        // Timed out or lost half way: the fallback finishes it
+                        return result;
+                }
+                return SESSION_UNAVAILABLE;
+        }
+};
+
+// VMs kept in memory, no hypervisor is run
+class MockHypervisor : public Hypervisor {
+public:
+        MockHypervisor() : no_vtx(false) {}
+
+        // Host without VT-x/AMD-V: VMs with two or more cores fail to start
+        bool no_vtx;
+
+        // Every command received, to check what the wrapper runs
+        std::vector<std::string> commands;
+
+        const char *name()
+        {
+                return "mock";
+        }
+
+        int command(const std::string &arg_list, char *buffer, int nSize)
+        {
+                std::string output;
+                commands.push_back(arg_list);
+                int code = interpret(split(arg_list), output);
+                if (buffer != NULL && nSize > 0) {
+                        memset(buffer, 0, nSize);
+                        strncpy(buffer, output.c_str(), nSize - 1);
+                }
+                return code;
+        }
+
+private:
+        std::map<std::string, std::string> vms;        // name -> state
+        std::map<std::string, int> cpus;               // name -> cores
+
+        // Arguments, honouring double quotes
+        static std::vector<std::string> split(const std::string &arg_list)
+        {
+                std::vector<std::string> args;
+                std::string arg;
+                bool quoted = false, in_arg = false;
+                for (size_t i = 0; i < arg_list.size(); i++) {
+                        char c = arg_list[i];
+                        if (c == '"') {
+                                quoted = !quoted;
+                                in_arg = true;
+                        }
+                        else if (!quoted && (c == ' ' || c == '\t' || c == '\n')) {
+                                if (in_arg) args.push_back(arg);
+                                arg.clear();
+                                in_arg = false;
+                        }
+                        else {
+                                arg += c;
+                                in_arg = true;
+                        }
+                }
+                if (in_arg) args.push_back(arg);
+                return args;
+        }
+
+        static std::string option(const std::vector<std::string> &args, const std::string &name)
+        {
+                for (size_t i = 0; i + 1 < args.size(); i++) {
+                        if (args[i] == name) return args[i + 1];
+                }
+                return "";
+        }
+
+        int not_found(const std::string &vm, std::string &output)
+        {
+                output = "VBoxManage: error: Could not find a registered machine named '" + vm + "'\n"
+                         "VBoxManage: error: Details: code VBOX_E_OBJECT_NOT_FOUND (0x80bb0001)\n";
+                return 1;
+        }
+
+        int invalid_state(const std::string &vm, std::string &output)
+        {
+                output = "VBoxManage: error: Machine '" + vm + "' is not in a valid state for this operation (" + vms[vm] + ")\n"
+                         "VBoxManage: error: Details: code VBOX_E_INVALID_VM_STATE (0x80bb0002)\n";
+                return 1;
+        }
+
+        int interpret(const std::vector<std::string> &args, std::string &output)
+        {
+                if (args.empty()) return 1;
+                const std::string &cmd = args[0];
+
+                if (cmd == "--version") {
+                        output = "4.1.0_mock\n";
+                        return 0;
+                }
+                if (cmd == "createvm") {
+                        std::string vm = option(args, "--name");
+                        if (vm.empty()) return 1;
+                        if (vms.count(vm)) {
+                                output = "VBoxManage: error: Machine settings file '" + vm + ".vbox' already exists\n";
+                                return 1;
+                        }
+                        vms[vm] = "poweroff";
+                        cpus[vm] = 1;
+                        output = "Virtual machine '" + vm + "' is created and registered.\n";
+                        return 0;
+                }
+                if (cmd == "list") {
+                        if (args.size() > 1 && (args[1] == "vms" || args[1] == "runningvms")) {
+                                std::map<std::string, std::string>::iterator it;
+                                for (it = vms.begin(); it != vms.end(); ++it) {
+                                        if (args[1] == "vms" || it->second == "running") {
+                                                output += "\"" + it->first + "\" {00000000-0000-0000-0000-000000000000}\n";
+                                        }
+                                }
+                        }
+                        return 0;
+                }
+                if (cmd == "closemedium" || cmd == "metrics") return 0;
+
+                // The rest of the commands name the VM next
+                if (args.size() < 2) return 1;
+                const std::string &vm = args[1];
+                if (!vms.count(vm)) return not_found(vm, output);
+                std::string &state = vms[vm];
+
+                if (cmd == "showvminfo") {
+                        std::ostringstream info;
+                        info << "name=\"" << vm << "\"\nostype=\"Linux26\"\ncpus=" << cpus[vm]
+                             << "\nVMState=\"" << state << "\"\n";
+                        output = info.str();
+                        return 0;
+                }
+                if (cmd == "startvm") {
+                        if (state == "running" || state == "paused") return invalid_state(vm, output);
+                        if (no_vtx && cpus[vm] > 1) {
+                                output = "Waiting for VM \"" + vm + "\" to power on...\n"
+                                         "VBoxManage: error: VT-x is not available (VERR_VMX_NO_VMX)\n"
+                                         "VBoxManage: error: Details: code NS_ERROR_FAILURE (0x80004005), component ConsoleWrap, interface IConsole\n";
+                                return 1;
+                        }
+                        state = "running";
+                        output = "Waiting for VM \"" + vm + "\" to power on...\nVM \"" + vm + "\" has been successfully started.\n";
+                        return 0;
+                }
+                if (cmd == "controlvm") {
+                        std::string action = (args.size() > 2) ? args[2] : "";
+                        if (state != "running" && state != "paused") return invalid_state(vm, output);
+                        if (action == "pause") {
+                                if (state != "running") return invalid_state(vm, output);
+                                state = "paused";
+                        }
+                        else if (action == "resume") {
+                                if (state != "paused") return invalid_state(vm, output);
+                                state = "running";
+                        }
+                        else if (action == "savestate") state = "saved";
+                        else if (action == "poweroff" || action == "acpipowerbutton") state = "poweroff";
+                        return 0;
+                }
+                if (cmd == "discardstate") {
+                        if (state != "saved") return invalid_state(vm, output);
+                        state = "poweroff";
+                        return 0;
+                }
+                if (cmd == "unregistervm") {
+                        if (state == "running" || state == "paused") return invalid_state(vm, output);
+                        vms.erase(vm);
+                        cpus.erase(vm);
+                        return 0;
+                }
+                if (cmd == "modifyvm") {
+                        std::string n = option(args, "--cpus");
+                        if (!n.empty()) cpus[vm] = atoi(n.c_str());
+                        return 0;
+                }
+                // storagectl, storageattach, setextradata, bandwidthctl...
+                return 0;
+        }
+};
+
+namespace Backend
+{
+        CliHypervisor cli;
+        MockHypervisor mock;
+        SessionHypervisor *session = NULL;
+
+        Hypervisor *find(const std::string &name)
+        {
+                if (name == "cli") return &cli;
+                if (name == "mock") return &mock;
+                return NULL;
+        }
+
+        // Select the backend for the rest of the run. Returns NULL for an unknown name.
+        Hypervisor *select(const std::string &name, const std::string &endpoint)
+        {
+                if (name == "session") {
+                        if (!session) session = new SessionHypervisor(endpoint.empty() ? SESSION_DEFAULT_ENDPOINT : endpoint, cli);
+                        return session;
+                }
+                return find(name);
+        }
+}
+
+// Backend of vbm_popen
+Hypervisor *hypervisor = &Backend::cli;
+
+#endif // HYPERVISOR_H
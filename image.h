@@ -0,0 +1,346 @@
+// Decoders for the compressed VM image
+//
+// The format of the image is detected from its first bytes, not from its
+// name:
+//
+//  - gzip (1f 8b), always available through zlib
+//  - zstd (28 b5 2f fd), also multi-frame and seekable images, whose seek
+//    table is a skippable frame. Needs -DHAVE_ZSTD and -lzstd.
+//  - xz   (fd 37 7a 58 5a 00), decoded with several threads when liblzma
+//    is recent enough. Needs -DHAVE_LZMA and -llzma.
+//
+// Anything else is handed to zlib, which also reads uncompressed files.
+//
+// The manifest gives the CRC32C and the size of the decompressed disk, one
+// value per line:
+//
+//     crc32c 1a2b3c4d
+//     size 10737418240
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "zlib.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#define IMAGE_INBUF_SIZE (256*1024)
+// Checksum of the decompressed disk, shipped with the work unit
+#define IMAGE_MANIFEST_FN "cernvm.vmdk.manifest"
+// Largest zstd window accepted, images built with zstd --long=27
+#define IMAGE_ZSTD_WINDOW_LOG_MAX 27
+
+enum ImageFormat {
+        IMAGE_GZIP,
+        IMAGE_ZSTD,
+        IMAGE_XZ,
+        IMAGE_UNKNOWN
+};
+
+namespace Image
+{
+        const char *format_name(ImageFormat format)
+        {
+                switch (format) {
+                case IMAGE_GZIP: return "gzip";
+                case IMAGE_ZSTD: return "zstd";
+                case IMAGE_XZ: return "xz";
+                default: return "unknown";
+                }
+        }
+
+        ImageFormat detect(const char *filename)
+        {
+                unsigned char magic[6];
+                FILE *f = fopen(filename, "rb");
+                if (!f) return IMAGE_UNKNOWN;
+                size_t n = fread(magic, 1, sizeof(magic), f);
+                fclose(f);
+
+                if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return IMAGE_GZIP;
+                if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return IMAGE_ZSTD;
+                // A skippable frame (0x184D2A50 to 0x184D2A5F) may come first
+                if (n >= 4 && (magic[0] & 0xf0) == 0x50 && magic[1] == 0x2a && magic[2] == 0x4d && magic[3] == 0x18) return IMAGE_ZSTD;
+                if (n >= 6 && !memcmp(magic, "\xfd" "7zXZ\0", 6)) return IMAGE_XZ;
+                return IMAGE_UNKNOWN;
+        }
+
+        bool supported(ImageFormat format)
+        {
+                #ifndef HAVE_ZSTD
+                if (format == IMAGE_ZSTD) return false;
+                #endif
+                #ifndef HAVE_LZMA
+                if (format == IMAGE_XZ) return false;
+                #endif
+                return true;
+        }
+
+        struct Manifest {
+                bool has_crc;
+                unsigned int crc32c;
+                bool has_size;
+                double size;
+        };
+
+        // Returns false if there is no manifest or it has no checksum
+        bool read_manifest(const char *filename, Manifest &manifest)
+        {
+                manifest.has_crc = manifest.has_size = false;
+                manifest.crc32c = 0;
+                manifest.size = 0;
+
+                std::ifstream f(filename);
+                std::string key, value;
+                while (f >> key >> value) {
+                        if (key == "crc32c") {
+                                manifest.crc32c = (unsigned int)strtoul(value.c_str(), NULL, 16);
+                                manifest.has_crc = true;
+                        }
+                        else if (key == "size") {
+                                manifest.size = strtod(value.c_str(), NULL);
+                                manifest.has_size = true;
+                        }
+                }
+                return manifest.has_crc;
+        }
+
+        // Stream of the decompressed image
+        class Decoder {
+        public:
+                virtual ~Decoder() {}
+                virtual bool open(const char *filename) = 0;
+                // Bytes read, 0 at the end, -1 on error
+                virtual long read(char *buffer, size_t size) = 0;
+
+                // Skip the first offset bytes of the decompressed image
+                virtual bool skip(long long offset)
+                {
+                        std::vector<char> scratch(IMAGE_INBUF_SIZE);
+                        while (offset > 0) {
+                                long n = read(&scratch[0], (offset < (long long)scratch.size()) ? (size_t)offset : scratch.size());
+                                if (n <= 0) return false;
+                                offset -= n;
+                        }
+                        return true;
+                }
+        };
+
+        class GzipDecoder : public Decoder {
+        public:
+                GzipDecoder() : file(NULL) {}
+
+                ~GzipDecoder()
+                {
+                        if (file) gzclose(file);
+                }
+
+                bool open(const char *filename)
+                {
+                        file = gzopen(filename, "rb");
+                        #if ZLIB_VERNUM >= 0x1240
+                        if (file) gzbuffer(file, IMAGE_INBUF_SIZE);
+                        #endif
+                        return (file != NULL);
+                }
+
+                long read(char *buffer, size_t size)
+                {
+                        return gzread(file, buffer, (unsigned)size);
+                }
+
+                bool skip(long long offset)
+                {
+                        // gzseek takes a z_off_t, 32 bits on Windows
+                        if ((long long)(z_off_t)offset != offset) return Decoder::skip(offset);
+                        return (gzseek(file, (z_off_t)offset, SEEK_SET) == (z_off_t)offset);
+                }
+
+        private:
+                gzFile file;
+        };
+
+        #ifdef HAVE_ZSTD
+        class ZstdDecoder : public Decoder {
+        public:
+                ZstdDecoder() : file(NULL), stream(NULL), in(IMAGE_INBUF_SIZE), pending(0), failed(false)
+                {
+                        input.src = &in[0];
+                        input.size = input.pos = 0;
+                }
+
+                ~ZstdDecoder()
+                {
+                        if (stream) ZSTD_freeDStream(stream);
+                        if (file) fclose(file);
+                }
+
+                bool open(const char *filename)
+                {
+                        file = fopen(filename, "rb");
+                        if (!file) return false;
+                        stream = ZSTD_createDStream();
+                        if (!stream) return false;
+                        ZSTD_initDStream(stream);
+                        ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax, IMAGE_ZSTD_WINDOW_LOG_MAX);
+                        return true;
+                }
+
+                // Frames follow each other in the stream, skippable frames (the seek
+                // table of seekable images) are skipped by the decoder
+                long read(char *buffer, size_t size)
+                {
+                        if (failed) return -1;
+                        ZSTD_outBuffer output = { buffer, size, 0 };
+                        while (output.pos == 0) {
+                                if (input.pos == input.size) {
+                                        input.size = fread(&in[0], 1, in.size(), file);
+                                        input.pos = 0;
+                                        if (input.size == 0) {
+                                                if (ferror(file)) return -1;
+                                                if (pending) {
+                                                        LOG_ERROR("zstd: the image is truncated");
+                                                        failed = true;
+                                                        return -1;
+                                                }
+                                                return 0;
+                                        }
+                                }
+                                size_t ret = ZSTD_decompressStream(stream, &output, &input);
+                                if (ZSTD_isError(ret)) {
+                                        LOG_ERROR("zstd: " << ZSTD_getErrorName(ret));
+                                        failed = true;
+                                        return -1;
+                                }
+                                // 0 when a frame is complete
+                                pending = ret;
+                        }
+                        return (long)output.pos;
+                }
+
+        private:
+                FILE *file;
+                ZSTD_DStream *stream;
+                std::vector<char> in;
+                ZSTD_inBuffer input;
+                size_t pending;
+                bool failed;
+        };
+        #endif
+
+        #ifdef HAVE_LZMA
+        class XzDecoder : public Decoder {
+        public:
+                XzDecoder() : file(NULL), in(IMAGE_INBUF_SIZE), finished(false), failed(false)
+                {
+                        lzma_stream init = LZMA_STREAM_INIT;
+                        stream = init;
+                }
+
+                ~XzDecoder()
+                {
+                        lzma_end(&stream);
+                        if (file) fclose(file);
+                }
+
+                bool open(const char *filename)
+                {
+                        file = fopen(filename, "rb");
+                        if (!file) return false;
+
+                        lzma_ret ret;
+                        #if LZMA_VERSION >= 50040002
+                        // Blocks are decoded in parallel, for images compressed with xz -T
+                        lzma_mt mt;
+                        memset(&mt, 0, sizeof(mt));
+                        mt.flags = LZMA_CONCATENATED;
+                        mt.threads = lzma_cputhreads();
+                        if (mt.threads == 0) mt.threads = 1;
+                        mt.memlimit_threading = lzma_physmem() / 4;
+                        mt.memlimit_stop = UINT64_MAX;
+                        ret = lzma_stream_decoder_mt(&stream, &mt);
+                        #else
+                        ret = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+                        #endif
+                        return (ret == LZMA_OK);
+                }
+
+                long read(char *buffer, size_t size)
+                {
+                        if (failed) return -1;
+                        if (finished) return 0;
+                        stream.next_out = (uint8_t *)buffer;
+                        stream.avail_out = size;
+                        while (stream.avail_out == size) {
+                                lzma_action action = LZMA_RUN;
+                                if (stream.avail_in == 0) {
+                                        stream.next_in = (const uint8_t *)&in[0];
+                                        stream.avail_in = fread(&in[0], 1, in.size(), file);
+                                        if (ferror(file)) {
+                                                failed = true;
+                                                return -1;
+                                        }
+                                        if (stream.avail_in == 0) action = LZMA_FINISH;
+                                }
+                                lzma_ret ret = lzma_code(&stream, action);
+                                if (ret == LZMA_STREAM_END) {
+                                        finished = true;
+                                        break;
+                                }
+                                if (ret != LZMA_OK) {
+                                        LOG_ERROR("xz: decoder error " << ret);
+                                        failed = true;
+                                        return -1;
+                                }
+                        }
+                        return (long)(size - stream.avail_out);
+                }
+
+        private:
+                FILE *file;
+                lzma_stream stream;
+                std::vector<char> in;
+                bool finished;
+                bool failed;
+        };
+        #endif
+
+        // Decoder for the format of filename. Returns NULL if the format is
+        // not supported by this build or the file cannot be opened.
+        Decoder *open(const char *filename, ImageFormat &format)
+        {
+                format = detect(filename);
+                if (!supported(format)) {
+                        LOG_ERROR(filename << " is a " << format_name(format) << " image, but this wrapper was built without "
+                                  << format_name(format) << " support");
+                        return NULL;
+                }
+
+                Decoder *decoder = NULL;
+                #ifdef HAVE_ZSTD
+                if (format == IMAGE_ZSTD) decoder = new ZstdDecoder();
+                #endif
+                #ifdef HAVE_LZMA
+                if (format == IMAGE_XZ) decoder = new XzDecoder();
+                #endif
+                if (!decoder) decoder = new GzipDecoder();
+                if (!decoder->open(filename)) {
+                        delete decoder;
+                        return NULL;
+                }
+                return decoder;
+        }
+}
+
+#endif // IMAGE_H
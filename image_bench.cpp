@@ -0,0 +1,67 @@
+// image_bench.cpp: compares the compressed formats of the VM image
+//
+// Usage: image_bench cernvm.vmdk.gz cernvm.vmdk.zst cernvm.vmdk.xz ...
+//
+// For every image it prints the detected format, the compressed size, the
+// decompressed size, the ratio and the decode speed. The decompressed data
+// is discarded, so the numbers do not depend on the write speed of the disk.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "boinc_api.h"
+#include "util.h"
+
+#include "log.h"
+#include "image.h"
+
+#define BENCH_BUFSIZE (256*1024)
+
+int main(int argc, char **argv)
+{
+        if (argc < 2) {
+                fprintf(stderr, "Usage: %s IMAGE...\n", argv[0]);
+                return 1;
+        }
+
+        printf("%-32s %-8s %14s %14s %7s %10s\n", "image", "format", "compressed", "decompressed", "ratio", "MB/s");
+        int failures = 0;
+        for (int i = 1; i < argc; i++) {
+                struct stat st;
+                if (stat(argv[i], &st)) {
+                        fprintf(stderr, "%s: cannot stat\n", argv[i]);
+                        failures++;
+                        continue;
+                }
+
+                ImageFormat format;
+                double t0 = dtime();
+                Image::Decoder *decoder = Image::open(argv[i], format);
+                if (!decoder) {
+                        failures++;
+                        continue;
+                }
+                std::vector<char> buffer(BENCH_BUFSIZE);
+                double total = 0;
+                long n;
+                while ((n = decoder->read(&buffer[0], buffer.size())) > 0) total += n;
+                double secs = dtime() - t0;
+                delete decoder;
+                if (n < 0) {
+                        fprintf(stderr, "%s: decoding failed\n", argv[i]);
+                        failures++;
+                        continue;
+                }
+
+                printf("%-32s %-8s %14.0f %14.0f %7.2f %10.1f\n", argv[i], Image::format_name(format),
+                       (double)st.st_size, total, st.st_size ? total / st.st_size : 0,
+                       secs > 0 ? total / (1024*1024) / secs : 0);
+        }
+        return failures ? 1 : 0;
+}
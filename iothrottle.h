@@ -0,0 +1,287 @@
+// Disk bandwidth of the VM, driven by the I/O pressure of the host
+//
+// With <vm_io_throttle>1</vm_io_throttle> in the project preferences (or
+// --io-throttle) the disk of the VM is attached to the bandwidth group of
+// its storage profile, and the limit of the group follows the host:
+//
+//  - under pressure (I/O PSI some avg10 above IOTHROTTLE_PSI_HIGH, or the
+//    device of the slot busy more than IOTHROTTLE_BUSY_HIGH % of the time
+//    while tasks already wait for I/O) the limit is halved, starting from
+//    half of what the device was doing, down to IOTHROTTLE_FLOOR_MB
+//  - when the host has been idle for IOTHROTTLE_IDLE_CHECKS checks in a
+//    row the limit doubles again, up to the ceiling: <vm_disk_bandwidth>,
+//    or IOTHROTTLE_CEILING_MB when it is not set
+//
+// So a CVMFS cache fill runs at full speed on an idle host and gives way
+// when the desktop needs the disk. Every change is logged, and the pressure
+// and the limit go to the trace and the snapshot. It needs the pressure
+// stall information of Linux 4.20 and later, elsewhere nothing changes.
+
+#ifndef IOTHROTTLE_H
+#define IOTHROTTLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "hypervisor.h"
+#include "storage.h"
+#include "snapshot.h"
+#include "trace.h"
+
+// Seconds between two looks at the host I/O
+#define IOTHROTTLE_PERIOD 10.0
+// Limit of the bandwidth group when the preferences do not set one, and
+// smallest limit the VM is throttled to, in MB/s
+#define IOTHROTTLE_CEILING_MB 1024
+#define IOTHROTTLE_FLOOR_MB 8
+// I/O PSI (some avg10, in %) above which the host is under pressure, and
+// below which it is idle
+#define IOTHROTTLE_PSI_HIGH 20.0
+#define IOTHROTTLE_PSI_LOW 2.0
+// Utilization of the device (% of the time busy) above which it is
+// saturated, and below which it is idle
+#define IOTHROTTLE_BUSY_HIGH 90.0
+#define IOTHROTTLE_BUSY_LOW 50.0
+// Idle checks in a row before the limit is raised
+#define IOTHROTTLE_IDLE_CHECKS 6
+// Failed changes before the controller gives up (no bandwidth group)
+#define IOTHROTTLE_MAX_FAILURES 3
+
+namespace IoThrottle
+{
+        struct HostIo {
+                double pressure;        // some avg10 of /proc/pressure/io
+                double full_pressure;   // full avg10
+                bool   has_device;      // the device of the slot is in /proc/diskstats
+                double busy;            // % of the time the device was busy
+                double mb_per_sec;      // read and written by the device
+        };
+
+        // Root of the proc file system, e.g. a copy of it for testing
+        std::string proc_dir = "/proc";
+
+        // Counters of the device at the previous look
+        struct DeviceCounters {
+                double sectors;
+                double io_ticks;        // ms spent doing I/O
+                double when;
+                bool   valid;
+
+                DeviceCounters() : sectors(0), io_ticks(0), when(0), valid(false) {}
+        };
+
+        // Bandwidth limit as bandwidthctl takes it, in MB/s: megabytes
+        // without a suffix, K/M/G for bytes and k/m/g for bits
+        double limit_mb(const std::string &limit)
+        {
+                if (limit.empty()) return 0;
+                double value = atof(limit.c_str());
+                switch (limit[limit.size() - 1]) {
+                case 'K': return value / 1024;
+                case 'G': return value * 1024;
+                case 'k': return value / 1024 / 8;
+                case 'm': return value / 8;
+                case 'g': return value * 1024 / 8;
+                default:  return value;
+                }
+        }
+
+        #if !defined(_WIN32) && !defined(__APPLE__)
+        // Sectors read and written and the I/O time of the device holding
+        // path. Partitions have their own line in /proc/diskstats:
+        //    8       1 sda1 reads merged sectors ms writes merged sectors ms in_flight io_ticks ...
+        bool read_device(const std::string &path, double &sectors, double &io_ticks)
+        {
+                struct stat st;
+                if (stat(path.c_str(), &st)) return false;
+                unsigned int want_major = major(st.st_dev), want_minor = minor(st.st_dev);
+
+                FILE *f = fopen((proc_dir + "/diskstats").c_str(), "r");
+                if (!f) return false;
+                char line[512];
+                bool found = false;
+                while (fgets(line, sizeof(line), f)) {
+                        unsigned int dev_major, dev_minor;
+                        char name[64];
+                        double reads, reads_merged, sectors_read, ms_read, writes, writes_merged, sectors_written, ms_write,
+                               in_flight, ticks;
+                        if (sscanf(line, "%u %u %63s %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", &dev_major, &dev_minor, name,
+                                   &reads, &reads_merged, &sectors_read, &ms_read, &writes, &writes_merged, &sectors_written,
+                                   &ms_write, &in_flight, &ticks) != 13) continue;
+                        if (dev_major != want_major || dev_minor != want_minor) continue;
+                        sectors = sectors_read + sectors_written;
+                        io_ticks = ticks;
+                        found = true;
+                        break;
+                }
+                fclose(f);
+                return found;
+        }
+        #endif
+
+        bool read_host(HostIo &host, DeviceCounters &previous)
+        {
+                host.pressure = host.full_pressure = 0;
+                host.has_device = false;
+                host.busy = host.mb_per_sec = 0;
+                #if defined(_WIN32) || defined(__APPLE__)
+                return false;
+                #else
+                // some avg10=1.53 avg60=0.87 avg300=0.22 total=123456
+                // full avg10=0.42 avg60=0.20 avg300=0.05 total=45678
+                FILE *f = fopen((proc_dir + "/pressure/io").c_str(), "r");
+                if (!f) return false;
+                int n = fscanf(f, "some avg10=%lf avg60=%*f avg300=%*f total=%*f full avg10=%lf",
+                               &host.pressure, &host.full_pressure);
+                fclose(f);
+                if (n < 1) return false;
+
+                // Utilization and throughput of the device since the previous look
+                double sectors, io_ticks, now = dtime();
+                if (read_device(".", sectors, io_ticks)) {
+                        if (previous.valid && now > previous.when) {
+                                double secs = now - previous.when;
+                                host.has_device = true;
+                                host.busy = (io_ticks - previous.io_ticks) / (secs * 10);
+                                if (host.busy > 100) host.busy = 100;
+                                host.mb_per_sec = (sectors - previous.sectors) * 512 / (1024.0*1024) / secs;
+                        }
+                        previous.sectors = sectors;
+                        previous.io_ticks = io_ticks;
+                        previous.when = now;
+                        previous.valid = true;
+                }
+                return true;
+                #endif
+        }
+
+        class Controller {
+        public:
+                bool wanted;            // asked for in the preferences or on the command line
+                double ceiling_mb;
+
+                Controller() : wanted(false), ceiling_mb(IOTHROTTLE_CEILING_MB), current_mb(0), idle_checks(0),
+                               failures(0), enabled(false) {}
+
+                void parse_preferences(const char *prefs)
+                {
+                        int flag;
+                        if (prefs && parse_int(prefs, "<vm_io_throttle>", flag)) wanted = (flag != 0);
+                }
+
+                // Before the VM is created: the disk needs a bandwidth group to
+                // be throttled, its limit is the ceiling
+                void configure(StorageProfile &storage)
+                {
+                        if (!wanted) return;
+                        if (storage.bandwidth.empty()) {
+                                std::ostringstream limit;
+                                limit << IOTHROTTLE_CEILING_MB << "M";
+                                storage.bandwidth = limit.str();
+                        }
+                        ceiling_mb = limit_mb(storage.bandwidth);
+                }
+
+                // Start following the host for a running VM
+                void attach(const std::string &vm)
+                {
+                        vm_name = vm;
+                        HostIo host;
+                        enabled = wanted && (ceiling_mb > IOTHROTTLE_FLOOR_MB) && read_host(host, counters);
+                        current_mb = ceiling_mb;
+                        idle_checks = 0;
+                        failures = 0;
+                        if (enabled) {
+                                Snapshot::current.disk_limit_mb = current_mb;
+                                LOG_NOTICE("Disk throttle: the VM gets up to " << ceiling_mb << " MB/s, down to "
+                                           << IOTHROTTLE_FLOOR_MB << " MB/s under I/O pressure");
+                        }
+                }
+
+                // Called from the main loop every IOTHROTTLE_PERIOD seconds while the VM runs
+                void update()
+                {
+                        if (!enabled) return;
+
+                        HostIo host;
+                        if (!read_host(host, counters)) return;
+                        Snapshot::current.io_pressure = host.pressure;
+                        Trace::counter("io pressure", host.pressure);
+
+                        bool pressure = (host.pressure > IOTHROTTLE_PSI_HIGH) ||
+                                        (host.has_device && host.busy > IOTHROTTLE_BUSY_HIGH && host.pressure > IOTHROTTLE_PSI_LOW);
+                        bool idle = (host.pressure < IOTHROTTLE_PSI_LOW) && (!host.has_device || host.busy < IOTHROTTLE_BUSY_LOW);
+
+                        if (pressure) {
+                                idle_checks = 0;
+                                // From full speed, start from half of what the device does
+                                double target = current_mb / 2;
+                                if (current_mb >= ceiling_mb && host.has_device && host.mb_per_sec > 0 &&
+                                    host.mb_per_sec / 2 < target) target = host.mb_per_sec / 2;
+                                if (target < IOTHROTTLE_FLOOR_MB) target = IOTHROTTLE_FLOOR_MB;
+                                if (target < current_mb) adjust(target, host, "host under I/O pressure");
+                                return;
+                        }
+
+                        if (!idle || current_mb >= ceiling_mb) {
+                                idle_checks = 0;
+                                return;
+                        }
+
+                        if (++idle_checks < IOTHROTTLE_IDLE_CHECKS) return;
+                        double target = current_mb * 2;
+                        if (target > ceiling_mb) target = ceiling_mb;
+                        adjust(target, host, "host is idle");
+                        idle_checks = 0;
+                }
+
+                double limit() const { return current_mb; }
+
+        private:
+                string vm_name;
+                double current_mb;
+                int idle_checks;
+                int failures;
+                bool enabled;
+                DeviceCounters counters;
+
+                void adjust(double target, const HostIo &host, const char *reason)
+                {
+                        Trace::Span span("IoThrottle::adjust");
+                        span.arg("from", current_mb);
+                        span.arg("to", target);
+                        std::ostringstream arg_list;
+                        arg_list << "bandwidthctl " << vm_name << " set " STORAGE_BANDWIDTH_GROUP " --limit " << (int)target << "M";
+                        string output;
+                        if (hypervisor->run(arg_list.str(), output) != 0) {
+                                LOG_WARNING("Impossible to set the disk bandwidth of the VM to " << (int)target << " MB/s");
+                                if (!output.empty()) LOG_WARNING(output);
+                                if (++failures >= IOTHROTTLE_MAX_FAILURES) {
+                                        LOG_WARNING("Disk throttle disabled, the disk of the VM has no bandwidth group");
+                                        enabled = false;
+                                }
+                                return;
+                        }
+                        failures = 0;
+
+                        std::ostringstream device;
+                        if (host.has_device) device << ", device " << (int)host.busy << "% busy at " << host.mb_per_sec << " MB/s";
+                        LOG_NOTICE("Disk bandwidth of the VM " << (int)current_mb << " -> " << (int)target << " MB/s ("
+                                   << reason << ": I/O PSI " << host.pressure << "%" << device.str() << ")");
+                        current_mb = target;
+                        Snapshot::current.disk_limit_mb = target;
+                        Trace::counter("disk limit MB", target);
+                }
+        };
+}
+
+#endif // IOTHROTTLE_H
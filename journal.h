@@ -0,0 +1,215 @@
+// Lifecycle journal of the VM
+//
+// Every step of building the VM is appended to VMJournal as one line:
+//
+//     <phase>\t<key>=<value>\t<key>=<value>...
+//
+// and flushed to disk before the wrapper goes on. When the wrapper is
+// restarted before the VM was completely created (client restart, reboot),
+// replay() rebuilds what was already done, so the creation resumes from the
+// interrupted step instead of starting over: decompression goes on from
+// its last checkpoint, a VM that was already configured is kept, and the
+// floppy or the disk are attached again only if needed. A line is only
+// trusted once its newline has been written, so a torn last record is
+// ignored.
+//
+// Phases: begin, unzip (checkpoint), unzipped, verified, corrupt,
+// configured, floppy, attached, created, removed.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <fstream>
+#include <iterator>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "threads.h"
+
+#define JOURNAL_FN "VMJournal"
+
+namespace Journal
+{
+        typedef std::map<std::string, std::string> Fields;
+
+        // What the replay found
+        struct State {
+                bool begun;
+                bool unzipped;
+                bool configured;
+                bool attached;
+                bool created;
+                std::string vm_name;
+                std::string image;
+                long long image_size;
+                std::string floppy_name;
+                std::string storage;    // bus of the disk controller
+                long long unzip_offset; // bytes of the disk already decompressed
+                unsigned int unzip_crc; // and their CRC32C
+                bool verified;          // the disk matched the manifest
+
+                State()
+                {
+                        begun = unzipped = configured = attached = created = verified = false;
+                        image_size = unzip_offset = 0;
+                        unzip_crc = 0;
+                }
+        };
+
+        FILE *file = NULL;
+        Threads::Mutex mutex;   // the creation steps run in two threads
+
+        void close()
+        {
+                if (file) fclose(file);
+                file = NULL;
+        }
+
+        // Start a new journal
+        void reset()
+        {
+                Threads::Lock lock(mutex);
+                if (file) fclose(file);
+                file = fopen(JOURNAL_FN, "w");
+                if (!file) LOG_WARNING("Impossible to create " << JOURNAL_FN << ", the VM creation will not be resumable");
+        }
+
+        void record(const std::string &phase, const Fields &fields)
+        {
+                Threads::Lock lock(mutex);
+                if (!file) file = fopen(JOURNAL_FN, "a");
+                if (!file) return;
+
+                std::string line = phase;
+                for (Fields::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+                        line += "\t" + it->first + "=" + it->second;
+                }
+                line += "\n";
+                fputs(line.c_str(), file);
+                fflush(file);
+                #ifdef _WIN32
+                _commit(_fileno(file));
+                #else
+                fsync(fileno(file));
+                #endif
+        }
+
+        void record(const std::string &phase)
+        {
+                record(phase, Fields());
+        }
+
+        void record(const std::string &phase, const std::string &key, const std::string &value)
+        {
+                Fields fields;
+                fields[key] = value;
+                record(phase, fields);
+        }
+
+        // Sizes and offsets are 64 bits, long is 32 bits on Windows
+        long long parse_size(const std::string &text)
+        {
+                #ifdef _WIN32
+                return _strtoi64(text.c_str(), NULL, 10);
+                #else
+                return strtoll(text.c_str(), NULL, 10);
+                #endif
+        }
+
+        std::string hex(unsigned int value)
+        {
+                char buffer[16];
+                sprintf(buffer, "%08x", value);
+                return buffer;
+        }
+
+        // Read the journal. Returns false if there is none.
+        bool replay(State &state)
+        {
+                std::ifstream f(JOURNAL_FN, std::ios::in | std::ios::binary);
+                if (!f.is_open()) return false;
+
+                std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+                size_t begin = 0, end;
+                while ((end = content.find('\n', begin)) != std::string::npos) {
+                        std::string line = content.substr(begin, end - begin);
+                        begin = end + 1;
+
+                        Fields fields;
+                        size_t tab = line.find('\t');
+                        std::string phase = line.substr(0, tab);
+                        while (tab != std::string::npos) {
+                                size_t next = line.find('\t', tab + 1);
+                                std::string field = line.substr(tab + 1, (next == std::string::npos) ? std::string::npos : next - tab - 1);
+                                size_t eq = field.find('=');
+                                if (eq != std::string::npos) fields[field.substr(0, eq)] = field.substr(eq + 1);
+                                tab = next;
+                        }
+
+                        if (phase == "begin") {
+                                state = State();
+                                state.begun = true;
+                                state.vm_name = fields["vm"];
+                                state.image = fields["image"];
+                                state.image_size = parse_size(fields["size"]);
+                        }
+                        else if (phase == "unzip") {
+                                state.unzip_offset = parse_size(fields["offset"]);
+                                state.unzip_crc = (unsigned int)strtoul(fields["crc32c"].c_str(), NULL, 16);
+                        }
+                        else if (phase == "unzipped") {
+                                state.unzipped = true;
+                                state.unzip_crc = (unsigned int)strtoul(fields["crc32c"].c_str(), NULL, 16);
+                        }
+                        else if (phase == "verified") state.verified = true;
+                        else if (phase == "corrupt") {
+                                // The disk is decompressed again from the start
+                                state.unzipped = state.verified = false;
+                                state.unzip_offset = 0;
+                                state.unzip_crc = 0;
+                        }
+                        else if (phase == "configured") {
+                                state.configured = true;
+                                state.storage = fields["storage"];
+                        }
+                        else if (phase == "floppy") state.floppy_name = fields["name"];
+                        else if (phase == "attached") state.attached = true;
+                        else if (phase == "created") state.created = true;
+                        else if (phase == "removed") {
+                                // The VM has to be configured again. unregistervm --delete
+                                // also deleted the disk if it was attached.
+                                if (state.attached) {
+                                        state.unzipped = state.verified = false;
+                                        state.unzip_offset = 0;
+                                        state.unzip_crc = 0;
+                                }
+                                state.configured = state.attached = state.created = false;
+                                state.floppy_name.clear();
+                        }
+                }
+                return state.begun;
+        }
+
+        std::string describe(const State &state)
+        {
+                std::string steps;
+                if (state.unzipped) steps += " unzipped";
+                else if (state.unzip_offset) steps += " partially-unzipped";
+                if (state.verified) steps += " verified";
+                if (state.configured) steps += " configured";
+                if (!state.floppy_name.empty()) steps += " floppy";
+                if (state.attached) steps += " attached";
+                if (state.created) steps += " created";
+                return steps.empty() ? " nothing" : steps;
+        }
+}
+
+#endif // JOURNAL_H
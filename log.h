@@ -0,0 +1,274 @@
+// Logging for the CernVM wrapper
+//
+// Messages are written with the LOG_* macros, e.g.
+//
+//     LOG_NOTICE("VM state discarded!");
+//     LOG_ERROR("Get status from VM failed " << n << " times!");
+//
+// Levels above LOG_MAX_LEVEL are compiled out, and levels above the --debug
+// level are skipped before the message is formatted. NOTICE and INFO
+// messages go through a lock-free ring buffer that a background thread
+// drains into stderr, so the main loop never waits for the disk. ERROR and
+// WARNING messages are written at once, as the wrapper often exits right
+// after them. The writer drops a message repeated back to back and prints
+// how many times it was repeated. It also limits the rate of messages, and
+// rotates stderr.txt when it grows too large, as the client uploads it.
+//
+// The queue is drained at exit, but boinc_finish and boinc_temporary_exit
+// end in _exit on Mac OS X and TerminateProcess on Windows, where the atexit
+// handlers do not run: the wrapper exits through Log::finish and
+// Log::temporary_exit, which drain it first.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <sstream>
+
+#include "threads.h"
+
+#define LOG_LEVEL_ERROR   1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_NOTICE  3
+#define LOG_LEVEL_INFO    4
+
+// Build with -DLOG_MAX_LEVEL=3 to compile the INFO messages out
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG(lvl, prefix, msg) \
+        do { \
+                if (((lvl) <= LOG_MAX_LEVEL) && ((lvl) <= Log::level)) { \
+                        std::ostringstream log_stream_; \
+                        log_stream_ << prefix << msg; \
+                        Log::write((lvl), log_stream_.str()); \
+                } \
+        } while (0)
+
+#define LOG_ERROR(msg)   LOG(LOG_LEVEL_ERROR, "ERROR: ", msg)
+#define LOG_WARNING(msg) LOG(LOG_LEVEL_WARNING, "WARNING: ", msg)
+#define LOG_NOTICE(msg)  LOG(LOG_LEVEL_NOTICE, "NOTICE: ", msg)
+#define LOG_INFO(msg)    LOG(LOG_LEVEL_INFO, "INFO: ", msg)
+// Messages without a prefix (banners, progress of the start up)
+#define LOG_MSG(msg)     LOG(LOG_LEVEL_ERROR, "", msg)
+
+#define LOG_RING_SIZE 256               // power of two
+#define LOG_LINE_SIZE 512
+#define LOG_DRAIN_PERIOD 0.2            // seconds
+#define LOG_RATE 20.0                   // sustained messages per second
+#define LOG_BURST 200.0                 // messages allowed in a burst
+#define LOG_MAX_BYTES (2*1024*1024)     // rotate stderr.txt after this many bytes
+#define LOG_STDERR_FN "stderr.txt"
+#define LOG_STDERR_OLD_FN "stderr.old"
+
+namespace Log
+{
+        int level = LOG_LEVEL_NOTICE;
+
+        // Bounded multi-producer ring. Each slot carries a sequence number that
+        // tells producers and the consumer whose turn it is.
+        struct Slot {
+                volatile long sequence;
+                char text[LOG_LINE_SIZE];
+        };
+
+        Slot ring[LOG_RING_SIZE];
+        volatile long head = 0;
+        long tail = 0;
+        volatile long dropped = 0;
+
+        Threads::Mutex output_mutex;    // serializes the writers of stderr
+        bool async = false;
+
+        // Writer state, protected by output_mutex
+        std::string last_message;
+        long   repeated = 0;
+        double tokens = LOG_BURST;
+        time_t last_refill = 0;
+        long   rate_limited = 0;
+        long   bytes = 0;
+
+        void init_ring()
+        {
+                for (long i = 0; i < LOG_RING_SIZE; i++) ring[i].sequence = i;
+        }
+
+        void output(const std::string &line)
+        {
+                fputs(line.c_str(), stderr);
+                fputc('\n', stderr);
+                bytes += line.size() + 1;
+        }
+
+        // Keep the slot log bounded: stderr.txt is moved to stderr.old and a new one is started
+        void rotate()
+        {
+                FILE *f = fopen(LOG_STDERR_FN, "r");
+                if (!f) {
+                        // Not running in a slot with a redirected stderr
+                        bytes = 0;
+                        return;
+                }
+                fclose(f);
+                fflush(stderr);
+                remove(LOG_STDERR_OLD_FN);
+                rename(LOG_STDERR_FN, LOG_STDERR_OLD_FN);
+                if (freopen(LOG_STDERR_FN, "a", stderr)) {
+                        fprintf(stderr, "NOTICE: Log rotated, previous messages are in %s\n", LOG_STDERR_OLD_FN);
+                }
+                bytes = 0;
+        }
+
+        // Deduplication, rate limiting and rotation. Called with output_mutex held.
+        void emit(int lvl, const std::string &line)
+        {
+                if (line == last_message) {
+                        repeated++;
+                        return;
+                }
+                if (repeated) {
+                        std::ostringstream tmp;
+                        tmp << "NOTICE: Last message repeated " << repeated << " times";
+                        output(tmp.str());
+                        repeated = 0;
+                }
+                last_message = line;
+
+                // Errors and warnings are never rate limited
+                time_t now = time(NULL);
+                if (now != last_refill) {
+                        tokens += LOG_RATE * difftime(now, last_refill);
+                        if (tokens > LOG_BURST) tokens = LOG_BURST;
+                        last_refill = now;
+                }
+                if (lvl >= LOG_LEVEL_NOTICE) {
+                        if (tokens < 1.0) {
+                                rate_limited++;
+                                return;
+                        }
+                        tokens -= 1.0;
+                }
+                if (rate_limited) {
+                        std::ostringstream tmp;
+                        tmp << "NOTICE: " << rate_limited << " log messages suppressed by the rate limit";
+                        output(tmp.str());
+                        rate_limited = 0;
+                }
+
+                output(line);
+                if (bytes > LOG_MAX_BYTES) rotate();
+        }
+
+        // Write every message queued in the ring. Called with output_mutex held.
+        void drain_locked()
+        {
+                for (;;) {
+                        Slot &slot = ring[tail & (LOG_RING_SIZE - 1)];
+                        if (slot.sequence != tail + 1) break;
+                        Threads::barrier();
+                        // The level is the first character of the text
+                        emit(slot.text[0] - '0', std::string(slot.text + 1));
+                        Threads::barrier();
+                        slot.sequence = tail + LOG_RING_SIZE;
+                        tail++;
+                }
+                if (dropped) {
+                        long n = dropped, current;
+                        std::ostringstream tmp;
+                        tmp << "WARNING: " << n << " log messages dropped, the log buffer was full";
+                        output(tmp.str());
+                        do {
+                                current = dropped;
+                        } while (!Threads::compare_and_swap(&dropped, current, current - n));
+                }
+                fflush(stderr);
+        }
+
+        void drain()
+        {
+                Threads::Lock lock(output_mutex);
+                drain_locked();
+        }
+
+        // Lock-free: never blocks the caller, drops the message if the ring is full
+        bool enqueue(int lvl, const std::string &line)
+        {
+                for (;;) {
+                        long pos = head;
+                        Slot &slot = ring[pos & (LOG_RING_SIZE - 1)];
+                        long sequence = slot.sequence;
+                        if (sequence == pos) {
+                                if (!Threads::compare_and_swap(&head, pos, pos + 1)) continue;
+                                slot.text[0] = '0' + lvl;
+                                strncpy(slot.text + 1, line.c_str(), LOG_LINE_SIZE - 2);
+                                slot.text[LOG_LINE_SIZE - 1] = 0;
+                                Threads::barrier();
+                                slot.sequence = pos + 1;
+                                return true;
+                        }
+                        if (sequence < pos) {
+                                Threads::atomic_increment(&dropped);
+                                return false;
+                        }
+                }
+        }
+
+        void write(int lvl, const std::string &line)
+        {
+                if (async && (lvl >= LOG_LEVEL_NOTICE)) {
+                        enqueue(lvl, line);
+                        return;
+                }
+                // Keep the order: queued messages go first
+                Threads::Lock lock(output_mutex);
+                drain_locked();
+                emit(lvl, line);
+                fflush(stderr);
+        }
+
+        void writer(void *)
+        {
+                for (;;) {
+                        boinc_sleep(LOG_DRAIN_PERIOD);
+                        drain();
+                }
+        }
+
+        void flush_at_exit()
+        {
+                drain();
+        }
+
+        // Start the background writer. Until then, and if it cannot be
+        // started, every message is written synchronously.
+        void start()
+        {
+                Threads::Handle handle;
+                init_ring();
+                last_refill = time(NULL);
+                if (Threads::spawn(handle, writer, NULL)) {
+                        atexit(flush_at_exit);
+                        async = true;
+                }
+        }
+
+        // boinc_finish and boinc_temporary_exit, with the queued messages written first
+        void finish(int status)
+        {
+                drain();
+                boinc_finish(status);
+        }
+
+        void temporary_exit(int delay)
+        {
+                drain();
+                boinc_temporary_exit(delay);
+        }
+}
+
+#endif // LOG_H
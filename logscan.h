@@ -0,0 +1,259 @@
+// Incremental scanner for the VirtualBox VM log (VBox.log)
+//
+// The scanner follows the end of the log: it remembers the offset it has
+// read up to and only reads the bytes appended since the last call. Every
+// byte goes through one Aho-Corasick automaton built from the signature
+// table, so all the known signatures are matched in a single pass, also
+// when a line is split between two reads. Matches are returned as typed
+// events with the complete log line.
+
+#ifndef LOGSCAN_H
+#define LOGSCAN_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+enum LogEventType {
+        LOG_EVENT_NO_VTX,               // Hardware virtualization is not available
+        LOG_EVENT_VM_RUNNING,           // The VM has finished powering on
+        LOG_EVENT_GURU_MEDITATION,      // VirtualBox stopped the VM after a fatal error
+        LOG_EVENT_GUEST_PANIC,          // The guest crashed
+        LOG_EVENT_VBOX_ERROR            // Other VirtualBox errors worth reporting
+};
+
+struct LogEvent {
+        LogEventType type;
+        std::string signature;
+        std::string line;
+};
+
+#define LOGSCAN_SIGNATURES_FN "vbox_log_signatures.txt"
+#define LOGSCAN_MAX_LINE 1024
+#define LOGSCAN_CHUNK 16384
+
+class LogScanner {
+public:
+        LogScanner()
+        {
+                offset = 0;
+                inode = 0;
+                state = 0;
+                built = false;
+                add_defaults();
+        }
+
+        void set_file(const std::string &path)
+        {
+                filename = path;
+                rewind();
+        }
+
+        // Start again from the beginning of the file, e.g. when the VM is
+        // started and VirtualBox begins a new log
+        void rewind()
+        {
+                offset = 0;
+                inode = 0;
+                state = 0;
+                line.clear();
+                pending.clear();
+        }
+
+        void add_signature(const std::string &pattern, LogEventType type)
+        {
+                if (pattern.empty()) return;
+                patterns.push_back(pattern);
+                types.push_back(type);
+                built = false;
+        }
+
+        // Extra signatures, one per line: "<type> <pattern>", where type is one of
+        // no_vtx, vm_running, guru_meditation, guest_panic or error.
+        // Returns the number of signatures added.
+        int load_signatures(const char *path)
+        {
+                std::ifstream f(path);
+                std::string entry;
+                int n = 0;
+                while (std::getline(f, entry)) {
+                        if (entry.empty() || entry[0] == '#') continue;
+                        size_t sep = entry.find(' ');
+                        if (sep == std::string::npos) continue;
+                        std::string type = entry.substr(0, sep);
+                        std::string pattern = entry.substr(sep + 1);
+                        if (!pattern.empty() && pattern[pattern.size() - 1] == '\r') {
+                                pattern.erase(pattern.size() - 1);
+                        }
+                        if (type == "no_vtx") add_signature(pattern, LOG_EVENT_NO_VTX);
+                        else if (type == "vm_running") add_signature(pattern, LOG_EVENT_VM_RUNNING);
+                        else if (type == "guru_meditation") add_signature(pattern, LOG_EVENT_GURU_MEDITATION);
+                        else if (type == "guest_panic") add_signature(pattern, LOG_EVENT_GUEST_PANIC);
+                        else if (type == "error") add_signature(pattern, LOG_EVENT_VBOX_ERROR);
+                        else continue;
+                        n++;
+                }
+                return n;
+        }
+
+        // Whether text, e.g. the output of VBoxManage, contains a signature of the
+        // given type. The position in the log is not changed.
+        bool matches(const std::string &text, LogEventType type)
+        {
+                if (!built) build();
+                int s = 0;
+                for (size_t i = 0; i < text.size(); i++) {
+                        s = next[s][(unsigned char)text[i]];
+                        for (size_t j = 0; j < output[s].size(); j++) {
+                                if (types[output[s][j]] == type) return true;
+                        }
+                }
+                return false;
+        }
+
+        // Read what has been appended to the log since the last call and add the
+        // matches to events. Returns false if the log could not be read.
+        bool scan(std::vector<LogEvent> &events)
+        {
+                if (!built) build();
+
+                struct stat st;
+                if (stat(filename.c_str(), &st)) return false;
+                // VirtualBox rotates the log when the VM is started again
+                if ((inode && (unsigned long)st.st_ino != inode) || st.st_size < offset) rewind();
+                inode = (unsigned long)st.st_ino;
+                if (st.st_size == offset) return true;
+
+                FILE *f = fopen(filename.c_str(), "rb");
+                if (!f) return false;
+                if (fseek(f, offset, SEEK_SET)) {
+                        fclose(f);
+                        return false;
+                }
+
+                char buffer[LOGSCAN_CHUNK];
+                size_t n;
+                while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+                        for (size_t i = 0; i < n; i++) feed(buffer[i], events);
+                        offset += n;
+                }
+                fclose(f);
+                return true;
+        }
+
+private:
+        std::string filename;
+        long offset;
+        unsigned long inode;
+
+        std::vector<std::string> patterns;
+        std::vector<LogEventType> types;
+
+        // Automaton: dense transition table, and the patterns ending at each state
+        // (including the ones reached through failure links)
+        std::vector<std::vector<int> > next;
+        std::vector<std::vector<int> > output;
+        bool built;
+        int state;
+
+        // Current line and the patterns matched in it
+        std::string line;
+        std::vector<int> pending;
+
+        void add_defaults()
+        {
+                add_signature("VERR_VMX_MSR_LOCKED_OR_DISABLED", LOG_EVENT_NO_VTX);
+                add_signature("VERR_VMX_MSR_VMX_DISABLED", LOG_EVENT_NO_VTX);
+                add_signature("VERR_SVM_DISABLED", LOG_EVENT_NO_VTX);
+                add_signature("VERR_VMX_NO_VMX", LOG_EVENT_NO_VTX);
+                add_signature("VERR_SVM_NO_SVM", LOG_EVENT_NO_VTX);
+                add_signature("'POWERING_ON' to 'RUNNING'", LOG_EVENT_VM_RUNNING);
+                add_signature("Guru Meditation", LOG_EVENT_GURU_MEDITATION);
+                add_signature("VINF_EM_TRIPLE_FAULT", LOG_EVENT_GUEST_PANIC);
+                add_signature("Kernel panic", LOG_EVENT_GUEST_PANIC);
+                add_signature("VERR_NO_MEMORY", LOG_EVENT_VBOX_ERROR);
+                add_signature("VERR_FILE_NOT_FOUND", LOG_EVENT_VBOX_ERROR);
+        }
+
+        void build()
+        {
+                next.assign(1, std::vector<int>(256, -1));
+                output.assign(1, std::vector<int>());
+
+                // Trie of the patterns
+                for (size_t p = 0; p < patterns.size(); p++) {
+                        int s = 0;
+                        for (size_t i = 0; i < patterns[p].size(); i++) {
+                                unsigned char c = patterns[p][i];
+                                if (next[s][c] < 0) {
+                                        next[s][c] = next.size();
+                                        next.push_back(std::vector<int>(256, -1));
+                                        output.push_back(std::vector<int>());
+                                }
+                                s = next[s][c];
+                        }
+                        output[s].push_back(p);
+                }
+
+                // Breadth-first: failure links folded into the transition table
+                std::vector<int> fail(next.size(), 0);
+                std::queue<int> q;
+                for (int c = 0; c < 256; c++) {
+                        if (next[0][c] < 0) next[0][c] = 0;
+                        else q.push(next[0][c]);
+                }
+                while (!q.empty()) {
+                        int s = q.front();
+                        q.pop();
+                        const std::vector<int> &inherited = output[fail[s]];
+                        output[s].insert(output[s].end(), inherited.begin(), inherited.end());
+                        for (int c = 0; c < 256; c++) {
+                                int t = next[s][c];
+                                if (t < 0) {
+                                        next[s][c] = next[fail[s]][c];
+                                }
+                                else {
+                                        fail[t] = next[fail[s]][c];
+                                        q.push(t);
+                                }
+                        }
+                }
+                state = 0;
+                built = true;
+        }
+
+        void feed(char c, std::vector<LogEvent> &events)
+        {
+                if (c == '\n') {
+                        for (size_t i = 0; i < pending.size(); i++) {
+                                LogEvent event;
+                                event.type = types[pending[i]];
+                                event.signature = patterns[pending[i]];
+                                event.line = line;
+                                events.push_back(event);
+                        }
+                        pending.clear();
+                        line.clear();
+                        state = 0;
+                        return;
+                }
+                if (c != '\r' && line.size() < LOGSCAN_MAX_LINE) line += c;
+
+                state = next[state][(unsigned char)c];
+                const std::vector<int> &matched = output[state];
+                for (size_t i = 0; i < matched.size(); i++) {
+                        // Report each signature once per line
+                        bool seen = false;
+                        for (size_t j = 0; j < pending.size(); j++) {
+                                if (pending[j] == matched[i]) seen = true;
+                        }
+                        if (!seen) pending.push_back(matched[i]);
+                }
+        }
+};
+
+#endif // LOGSCAN_H
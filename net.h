@@ -0,0 +1,212 @@
+// Minimal portable TCP helpers for the CernVM wrapper
+
+#ifndef NET_H
+#define NET_H
+
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#define NET_INVALID INVALID_SOCKET
+#define net_close closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+#define NET_INVALID (-1)
+#define net_close close
+#endif
+
+namespace Net
+{
+        bool init()
+        {
+                #ifdef _WIN32
+                static bool done = false;
+                if (!done) {
+                        WSADATA wsa;
+                        if (WSAStartup(MAKEWORD(2, 2), &wsa)) return false;
+                        done = true;
+                }
+                #endif
+                return true;
+        }
+
+        // Split "host:port"
+        bool parse_endpoint(const std::string &endpoint, std::string &host, int &port)
+        {
+                size_t colon = endpoint.rfind(':');
+                if (colon == std::string::npos) return false;
+                host = endpoint.substr(0, colon);
+                port = atoi(endpoint.substr(colon + 1).c_str());
+                if (host.empty()) host = "127.0.0.1";
+                return (port > 0);
+        }
+
+        // Bound the time send() and recv() wait on s
+        void set_timeout(socket_t s, int seconds)
+        {
+                #ifdef _WIN32
+                DWORD ms = seconds * 1000;
+                setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&ms, sizeof(ms));
+                setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&ms, sizeof(ms));
+                #else
+                struct timeval tv;
+                tv.tv_sec = seconds;
+                tv.tv_usec = 0;
+                setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
+                setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof(tv));
+                #endif
+        }
+
+        void set_blocking(socket_t s, bool blocking)
+        {
+                #ifdef _WIN32
+                u_long nonblocking = blocking ? 0 : 1;
+                ioctlsocket(s, FIONBIO, &nonblocking);
+                #else
+                int flags = fcntl(s, F_GETFL, 0);
+                fcntl(s, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+                #endif
+        }
+
+        // connect() that gives up after timeout seconds
+        bool connect_within(socket_t s, const struct sockaddr *addr, int addrlen, int timeout)
+        {
+                set_blocking(s, false);
+                bool connected = (connect(s, addr, addrlen) == 0);
+                #ifdef _WIN32
+                bool pending = !connected && (WSAGetLastError() == WSAEWOULDBLOCK);
+                #else
+                bool pending = !connected && (errno == EINPROGRESS);
+                #endif
+                if (pending) {
+                        fd_set writable, failed;
+                        FD_ZERO(&writable);
+                        FD_ZERO(&failed);
+                        FD_SET(s, &writable);
+                        FD_SET(s, &failed);
+                        struct timeval tv;
+                        tv.tv_sec = timeout;
+                        tv.tv_usec = 0;
+                        if (select((int)s + 1, NULL, &writable, &failed, &tv) > 0 && FD_ISSET(s, &writable)) {
+                                int error = 0;
+                                socklen_t size = sizeof(error);
+                                getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&error, &size);
+                                connected = (error == 0);
+                        }
+                }
+                set_blocking(s, true);
+                return connected;
+        }
+
+        // Connect to host:port. With a timeout, connecting, sending and
+        // receiving give up after that many seconds.
+        socket_t connect_to(const std::string &host, int port, int timeout = 0)
+        {
+                if (!init()) return NET_INVALID;
+
+                struct addrinfo hints, *res = NULL;
+                char service[16];
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+                sprintf(service, "%d", port);
+                if (getaddrinfo(host.c_str(), service, &hints, &res) || !res) return NET_INVALID;
+
+                socket_t s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+                if (s != NET_INVALID) {
+                        bool connected = timeout ? connect_within(s, res->ai_addr, (int)res->ai_addrlen, timeout)
+                                                 : !connect(s, res->ai_addr, (int)res->ai_addrlen);
+                        if (!connected) {
+                                net_close(s);
+                                s = NET_INVALID;
+                        }
+                        else {
+                                // Small request/response messages
+                                int one = 1;
+                                setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+                                if (timeout) set_timeout(s, timeout);
+                        }
+                }
+                freeaddrinfo(res);
+                return s;
+        }
+
+        // Listen on 127.0.0.1:port. Returns NET_INVALID if the port is taken.
+        socket_t listen_local(int port)
+        {
+                if (!init()) return NET_INVALID;
+
+                socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+                if (s == NET_INVALID) return NET_INVALID;
+
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                addr.sin_port = htons((unsigned short)port);
+                if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 16)) {
+                        net_close(s);
+                        return NET_INVALID;
+                }
+                return s;
+        }
+
+        bool send_all(socket_t s, const char *data, size_t size)
+        {
+                while (size > 0) {
+                        int n = send(s, data, (int)size, 0);
+                        if (n <= 0) return false;
+                        data += n;
+                        size -= n;
+                }
+                return true;
+        }
+
+        bool send_all(socket_t s, const std::string &data)
+        {
+                return send_all(s, data.data(), data.size());
+        }
+
+        bool recv_exact(socket_t s, char *data, size_t size)
+        {
+                while (size > 0) {
+                        int n = recv(s, data, (int)size, 0);
+                        if (n <= 0) return false;
+                        data += n;
+                        size -= n;
+                }
+                return true;
+        }
+
+        // Read up to and excluding '\n'
+        bool recv_line(socket_t s, std::string &line, size_t max_size = 8192)
+        {
+                char c;
+                line.clear();
+                for (;;) {
+                        if (recv(s, &c, 1, 0) != 1) return false;
+                        if (c == '\n') break;
+                        if (c != '\r') line += c;
+                        if (line.size() > max_size) return false;
+                }
+                return true;
+        }
+}
+
+#endif // NET_H
@@ -0,0 +1,305 @@
+// Prefetch of the virtual disk before the VM boots
+//
+// The guest boots with random reads all over cernvm.vmdk, and on a
+// spinning disk whose page cache no longer holds the image they dominate
+// the boot time. Just before startvm the wrapper asks the kernel to read
+// the parts of the disk the boot needs (posix_fadvise WILLNEED on Linux,
+// F_RDADVISE on Mac OS X), so that they are read in large sequential
+// requests while VirtualBox starts:
+//
+//  - the extents of the boot profile of the image, if there is one
+//  - otherwise the first <vm_prefetch_mb> MB (PREFETCH_DEFAULT_MB)
+//
+// PREFETCH_RECORD_DELAY seconds after the start the pages of the disk
+// resident in the page cache (mmap + mincore) are added to the boot
+// profile, kept in a directory of the project so that the next work units
+// with the same image find it. Another local user must not be able to plant
+// a profile or make the wrapper write elsewhere, so the directory has to be
+// private (Helper::private_dir), and profiles are written to a new file
+// made with mkstemp then renamed. What was prefetched is resident
+// too, so the profile only grows with what the boots read, up to
+// PREFETCH_MAX_MB.
+//
+// Only boots are prefetched and recorded, not restores of a saved state.
+// A disk that was just decompressed is dropped from the page cache first:
+// it is on disk already, the boot then reads what it needs, and the profile
+// records that rather than the whole image.
+//
+// The page cache is only used by VirtualBox with the host I/O cache of the
+// controller, so nothing is done when <vm_hostiocache> is 0. Windows has
+// no equivalent, the disk is not prefetched there.
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "crc32c.h"
+#include "trace.h"
+
+#define PREFETCH_DEFAULT_MB 64
+// Largest profile that is recorded and prefetched
+#define PREFETCH_MAX_MB 512
+// Seconds after the start at which the boot profile is recorded
+#define PREFETCH_RECORD_DELAY 300.0
+// Granularity of the profile: resident pages are rounded to blocks of this
+// size, and adjacent blocks merged into extents
+#define PREFETCH_BLOCK (256*1024)
+// Part of the disk mapped at a time by record()
+#define PREFETCH_WINDOW (64*1024*1024)
+#define PREFETCH_PROFILE_DIRNAME "cernvm-boot-profiles"
+#define PREFETCH_PROFILE_PREFIX "cernvm-boot-"
+
+namespace Prefetch
+{
+        struct Extent {
+                double offset;
+                double length;
+        };
+
+        // MB of the head of the disk prefetched without a profile, 0 to disable
+        int default_mb = PREFETCH_DEFAULT_MB;
+        bool recorded = false;
+        std::string disk;
+        // Where the profiles are kept, no profile when empty
+        std::string profile_dir;
+
+        // <profile_dir>/cernvm-boot-<key>.profile, where the key identifies
+        // the image by its size and the CRC32C of its first 64 kB
+        std::string profile_path(const std::string &path)
+        {
+                #ifdef _WIN32
+                return "";
+                #else
+                if (profile_dir.empty()) return "";
+                if (!Helper::private_dir(profile_dir)) {
+                        LOG_WARNING("The boot profiles " << profile_dir << " are not in a directory of this user only, not used");
+                        profile_dir.clear();
+                        return "";
+                }
+                struct stat st;
+                if (stat(path.c_str(), &st)) return "";
+                FILE *f = fopen(path.c_str(), "rb");
+                if (!f) return "";
+                std::vector<unsigned char> head(64 * 1024);
+                size_t n = fread(&head[0], 1, head.size(), f);
+                fclose(f);
+                char key[64];
+                snprintf(key, sizeof(key), "%llx-%08x", (unsigned long long)st.st_size,
+                         (unsigned int)Crc32c::update(0, &head[0], n));
+                return profile_dir + "/" PREFETCH_PROFILE_PREFIX + key + ".profile";
+                #endif
+        }
+
+        // "offset length" in bytes, one extent per line
+        bool load(const std::string &path, std::vector<Extent> &extents)
+        {
+                std::ifstream f(path.c_str());
+                if (!f.is_open()) return false;
+                Extent e;
+                while (f >> e.offset >> e.length) {
+                        if (e.offset >= 0 && e.length > 0) extents.push_back(e);
+                }
+                return !extents.empty();
+        }
+
+        bool before(const Extent &a, const Extent &b)
+        {
+                return a.offset < b.offset;
+        }
+
+        // Sort the extents and merge the ones that overlap or touch
+        void coalesce(std::vector<Extent> &extents)
+        {
+                std::sort(extents.begin(), extents.end(), before);
+                std::vector<Extent> merged;
+                for (size_t i = 0; i < extents.size(); i++) {
+                        if (!merged.empty() && extents[i].offset <= merged.back().offset + merged.back().length) {
+                                Extent &last = merged.back();
+                                double end = extents[i].offset + extents[i].length;
+                                if (end > last.offset + last.length) last.length = end - last.offset;
+                        }
+                        else merged.push_back(extents[i]);
+                }
+                extents.swap(merged);
+        }
+
+        // Written to a new file then renamed, as another wrapper may be reading it
+        bool save(const std::string &path, const std::vector<Extent> &extents)
+        {
+                #ifdef _WIN32
+                return false;
+                #else
+                std::string tmp = path + ".XXXXXX";
+                int fd = mkstemp(&tmp[0]);
+                if (fd < 0) return false;
+                FILE *f = fdopen(fd, "w");
+                if (!f) {
+                        close(fd);
+                        unlink(tmp.c_str());
+                        return false;
+                }
+                bool written = true;
+                for (size_t i = 0; i < extents.size() && written; i++) {
+                        written = (fprintf(f, "%.15g %.15g\n", extents[i].offset, extents[i].length) > 0);
+                }
+                if (fclose(f) || !written || rename(tmp.c_str(), path.c_str())) {
+                        unlink(tmp.c_str());
+                        return false;
+                }
+                return true;
+                #endif
+        }
+
+        #ifndef _WIN32
+        // Ask the kernel to read an extent of fd in the background
+        bool advise(int fd, double offset, double length)
+        {
+                #ifdef __APPLE__
+                // ra_count is an int: in steps of 1 GB at most
+                while (length > 0) {
+                        struct radvisory ra;
+                        ra.ra_offset = (off_t)offset;
+                        ra.ra_count = (int)((length > 1073741824.0) ? 1073741824.0 : length);
+                        if (fcntl(fd, F_RDADVISE, &ra) == -1) return false;
+                        offset += ra.ra_count;
+                        length -= ra.ra_count;
+                }
+                return true;
+                #else
+                return (posix_fadvise(fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED) == 0);
+                #endif
+        }
+        #endif
+
+        // Prefetch the boot extents of the disk at path, before startvm. fresh
+        // is true when the disk was just decompressed.
+        void start(const std::string &path, bool fresh)
+        {
+                #ifndef _WIN32
+                if (default_mb <= 0) return;
+                disk = path;
+                Trace::Span span("Prefetch::start");
+                #ifndef __APPLE__
+                if (fresh) {
+                        int fd = open(path.c_str(), O_RDONLY);
+                        if (fd >= 0) {
+                                fdatasync(fd);
+                                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                                close(fd);
+                        }
+                }
+                #else
+                // No way to drop it, the profile would be the whole image
+                if (fresh) recorded = true;
+                #endif
+                std::vector<Extent> extents;
+                std::string profile = profile_path(path);
+                bool from_profile = !profile.empty() && load(profile, extents);
+                if (!from_profile) {
+                        Extent head = { 0, default_mb * 1024.0 * 1024 };
+                        extents.push_back(head);
+                }
+
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0) return;
+                double bytes = 0;
+                for (size_t i = 0; i < extents.size() && bytes < PREFETCH_MAX_MB * 1024.0 * 1024; i++) {
+                        if (!advise(fd, extents[i].offset, extents[i].length)) break;
+                        bytes += extents[i].length;
+                }
+                close(fd);
+                span.arg("extents", (double)extents.size());
+                span.arg("MB", bytes / (1024*1024));
+                LOG_NOTICE("Prefetching " << (int)(bytes / (1024*1024)) << " MB of the disk"
+                           << (from_profile ? " from its boot profile" : ", no boot profile yet"));
+                #endif
+        }
+
+        // Record the pages of the disk that are in the page cache as its boot profile
+        void record()
+        {
+                if (recorded || disk.empty() || default_mb <= 0) return;
+                recorded = true;
+                #ifndef _WIN32
+                Trace::Span span("Prefetch::record");
+                std::string profile = profile_path(disk);
+                if (profile.empty()) return;
+                int fd = open(disk.c_str(), O_RDONLY);
+                if (fd < 0) return;
+                struct stat st;
+                if (fstat(fd, &st)) {
+                        close(fd);
+                        return;
+                }
+
+                // What the previous boots read, and what this one did
+                std::vector<Extent> extents;
+                load(profile, extents);
+                long page = sysconf(_SC_PAGESIZE);
+                #ifdef __APPLE__
+                std::vector<char> resident(PREFETCH_WINDOW / page + 1);
+                #else
+                std::vector<unsigned char> resident(PREFETCH_WINDOW / page + 1);
+                #endif
+                for (off_t base = 0; base < st.st_size; base += PREFETCH_WINDOW) {
+                        size_t length = (st.st_size - base < PREFETCH_WINDOW) ? (size_t)(st.st_size - base) : PREFETCH_WINDOW;
+                        void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, base);
+                        if (map == MAP_FAILED) break;
+                        if (mincore(map, length, &resident[0]) == 0) {
+                                size_t pages = (length + page - 1) / page;
+                                double last_block = -1;
+                                for (size_t i = 0; i < pages; i++) {
+                                        if (!(resident[i] & 1)) continue;
+                                        double offset = (double)base + (double)i * page;
+                                        double block = offset - fmod(offset, PREFETCH_BLOCK);
+                                        if (block == last_block) continue;
+                                        Extent e = { block, PREFETCH_BLOCK };
+                                        extents.push_back(e);
+                                        last_block = block;
+                                }
+                        }
+                        munmap(map, length);
+                }
+                close(fd);
+                coalesce(extents);
+
+                // Up to PREFETCH_MAX_MB, from the start of the disk
+                double bytes = 0;
+                for (size_t i = 0; i < extents.size(); i++) {
+                        double left = PREFETCH_MAX_MB * 1024.0 * 1024 - bytes;
+                        if (left <= 0) {
+                                extents.resize(i);
+                                break;
+                        }
+                        if (extents[i].length > left) extents[i].length = left;
+                        bytes += extents[i].length;
+                }
+
+                span.arg("extents", (double)extents.size());
+                span.arg("MB", bytes / (1024*1024));
+                if (extents.empty()) return;
+                if (save(profile, extents)) {
+                        LOG_NOTICE("Boot profile of the disk: " << extents.size() << " extents, "
+                                   << (int)(bytes / (1024*1024)) << " MB");
+                }
+                #endif
+        }
+}
+
+#endif // PREFETCH_H
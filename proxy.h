@@ -0,0 +1,593 @@
+// Host-local caching HTTP proxy for the CVMFS and conditions traffic of the guests
+//
+// Every VM fetches the same CVMFS objects over the network on its own. With
+// the proxy (<vm_http_proxy>1</vm_http_proxy> or --proxy), all the VMs of the
+// host go through one cache instead: the guest gets
+//
+//     CVMFS_HTTP_PROXY=http://10.0.2.2:3128;DIRECT
+//
+// through the floppy, where 10.0.2.2 is the host as seen from the VirtualBox
+// NAT. The first wrapper of the host that finds the port free serves the
+// proxy from a thread, the others reuse it. If it goes away with its
+// wrapper, the guests fall back to DIRECT until another wrapper starts it
+// again.
+//
+// Only plain HTTP GET and HEAD are proxied. Complete 200 responses to GET
+// with a Cache-Control max-age are kept until they expire, in a directory
+// of the project shared by all its wrappers, that no other user may own or
+// open (Helper::private_dir), and bounded in size: the least recently used
+// objects are removed first. The hit rate is logged every
+// PROXY_REPORT_PERIOD seconds, and GET /cernvm-proxy/stats asked directly
+// to the proxy returns its counters, so wrappers that reuse a proxy can
+// report it too.
+//
+// --proxy-server runs only the proxy, in the foreground.
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <signal.h>
+#include <utime.h>
+#include <sys/time.h>
+#endif
+
+#include "threads.h"
+#include "net.h"
+#include "trace.h"
+
+#define PROXY_DEFAULT_PORT 3128
+// The host, as seen by the guest through the VirtualBox NAT
+#define PROXY_GUEST_HOST "10.0.2.2"
+#define PROXY_CACHE_DIRNAME "cernvm-proxy-cache"
+#define PROXY_DEFAULT_CACHE_MB 2048
+// Larger responses are relayed but not cached
+#define PROXY_MAX_OBJECT_MB 256
+#define PROXY_BUFSIZE (64*1024)
+#define PROXY_TIMEOUT 60                // seconds without data from the origin
+#define PROXY_REPORT_PERIOD 600.0
+#define PROXY_STATS_PATH "/cernvm-proxy/stats"
+
+namespace Proxy
+{
+        struct Stats {
+                double requests;
+                double hits;
+                double misses;
+                double bytes_hit;
+                double bytes_fetched;
+        };
+
+        int port = PROXY_DEFAULT_PORT;
+        std::string cache_dir;
+        double cache_limit = PROXY_DEFAULT_CACHE_MB * 1024.0 * 1024;
+        bool serving = false;           // this process serves the proxy
+        bool running = false;           // a proxy answers on the port
+
+        Threads::Mutex mutex;           // guards stats and cache_bytes
+        Stats stats;
+        double cache_bytes = 0;
+        double last_report = 0;
+
+        #ifdef _WIN32
+        const char SEPARATOR = '\\';
+        #else
+        const char SEPARATOR = '/';
+        #endif
+
+        // <temporary directory>/cernvm-proxy-cache, for a proxy run outside of
+        // a slot. The wrappers use the project directory.
+        std::string default_cache_dir()
+        {
+                #ifdef _WIN32
+                char tmp[MAX_PATH];
+                if (!GetTempPath(sizeof(tmp), tmp)) return PROXY_CACHE_DIRNAME;
+                return std::string(tmp) + PROXY_CACHE_DIRNAME;
+                #else
+                const char *tmp = getenv("TMPDIR");
+                return std::string((tmp && *tmp) ? tmp : "/tmp") + "/" + PROXY_CACHE_DIRNAME;
+                #endif
+        }
+
+        // The guest setting sent through the floppy
+        std::string guest_setting()
+        {
+                std::ostringstream setting;
+                setting << "CVMFS_HTTP_PROXY=http://" PROXY_GUEST_HOST ":" << port << ";DIRECT";
+                return setting.str();
+        }
+
+        // 64-bit FNV-1a of the URL, the name of its cache entry
+        std::string key(const std::string &url)
+        {
+                unsigned long long hash = 14695981039346656037ULL;
+                for (size_t i = 0; i < url.size(); i++) {
+                        hash ^= (unsigned char)url[i];
+                        hash *= 1099511628211ULL;
+                }
+                char name[17];
+                sprintf(name, "%016llx", hash);
+                return name;
+        }
+
+        std::string lower(std::string s)
+        {
+                for (size_t i = 0; i < s.size(); i++) s[i] = tolower(s[i]);
+                return s;
+        }
+
+        // Value of a header in a block of "Name: value" lines, lower case
+        bool header_value(const std::string &headers, const char *name, std::string &value)
+        {
+                std::string block = lower(headers);
+                std::string pattern = std::string("\n") + name + ":";
+                size_t pos = block.find(pattern);
+                if (pos == std::string::npos) return false;
+                pos += pattern.size();
+                size_t end = block.find_first_of("\r\n", pos);
+                value = block.substr(pos, end - pos);
+                size_t begin = value.find_first_not_of(" \t");
+                value = (begin == std::string::npos) ? "" : value.substr(begin);
+                return true;
+        }
+
+        // Seconds a response may be served from the cache, 0 if it may not be cached
+        long max_age(const std::string &headers)
+        {
+                std::string cache_control;
+                if (!header_value(headers, "cache-control", cache_control)) return 0;
+                if (cache_control.find("no-store") != std::string::npos ||
+                    cache_control.find("no-cache") != std::string::npos ||
+                    cache_control.find("private") != std::string::npos) return 0;
+                size_t pos = cache_control.find("max-age=");
+                if (pos == std::string::npos) return 0;
+                return atol(cache_control.c_str() + pos + 8);
+        }
+
+        struct Entry {
+                std::string path;
+                time_t used;
+                double size;
+                bool operator<(const Entry &other) const { return used < other.used; }
+        };
+
+        void list_cache(std::vector<Entry> &entries)
+        {
+                entries.clear();
+                #ifdef _WIN32
+                WIN32_FIND_DATA data;
+                HANDLE h = FindFirstFile((cache_dir + "\\*").c_str(), &data);
+                if (h == INVALID_HANDLE_VALUE) return;
+                do {
+                        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+                        Entry entry;
+                        entry.path = cache_dir + "\\" + data.cFileName;
+                        entry.size = (double)data.nFileSizeHigh * 4294967296.0 + data.nFileSizeLow;
+                        struct stat st;
+                        entry.used = stat(entry.path.c_str(), &st) ? 0 : st.st_mtime;
+                        entries.push_back(entry);
+                } while (FindNextFile(h, &data));
+                FindClose(h);
+                #else
+                DIR *dir = opendir(cache_dir.c_str());
+                if (!dir) return;
+                struct dirent *d;
+                while ((d = readdir(dir)) != NULL) {
+                        Entry entry;
+                        struct stat st;
+                        entry.path = cache_dir + "/" + d->d_name;
+                        if (stat(entry.path.c_str(), &st) || !S_ISREG(st.st_mode)) continue;
+                        entry.used = st.st_mtime;
+                        entry.size = (double)st.st_size;
+                        entries.push_back(entry);
+                }
+                closedir(dir);
+                #endif
+        }
+
+        // Remove the least recently used entries until the cache is back
+        // under 90% of its limit. Entries are shared with the other
+        // proxies that used the same directory before, so it is listed again.
+        void evict()
+        {
+                std::vector<Entry> entries;
+                list_cache(entries);
+                std::sort(entries.begin(), entries.end());
+                double total = 0;
+                for (size_t i = 0; i < entries.size(); i++) total += entries[i].size;
+                double removed = 0;
+                for (size_t i = 0; i < entries.size() && total > cache_limit * 0.9; i++) {
+                        if (std::remove(entries[i].path.c_str()) == 0) {
+                                total -= entries[i].size;
+                                removed += entries[i].size;
+                        }
+                }
+                Threads::Lock lock(mutex);
+                cache_bytes = total;
+                if (removed > 0) {
+                        LOG_INFO("HTTP proxy cache: removed " << removed / (1024*1024) << " MB of old objects");
+                }
+        }
+
+        void count(double Stats::*field, double value)
+        {
+                Threads::Lock lock(mutex);
+                stats.*field += value;
+        }
+
+        std::string format_stats(const Stats &s)
+        {
+                std::ostringstream text;
+                text.precision(15);
+                text << "requests " << s.requests << "\nhits " << s.hits << "\nmisses " << s.misses
+                     << "\nbytes_hit " << s.bytes_hit << "\nbytes_fetched " << s.bytes_fetched << "\n";
+                return text.str();
+        }
+
+        bool send_response(socket_t s, const char *status, const std::string &body)
+        {
+                std::ostringstream response;
+                response << "HTTP/1.0 " << status << "\r\nContent-Type: text/plain\r\nContent-Length: "
+                         << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+                return Net::send_all(s, response.str());
+        }
+
+        // Serve a fresh cache entry. The first line of an entry is
+        // "<expiry time> <url>", followed by the response as it was received.
+        bool serve_cached(socket_t s, const std::string &url, const std::string &path, bool head)
+        {
+                FILE *f = fopen(path.c_str(), "rb");
+                if (!f) return false;
+                char line[8192];
+                if (!fgets(line, sizeof(line), f)) {
+                        fclose(f);
+                        return false;
+                }
+                char *space = strchr(line, ' ');
+                std::string cached_url = space ? std::string(space + 1) : "";
+                if (!cached_url.empty() && cached_url[cached_url.size() - 1] == '\n') cached_url.erase(cached_url.size() - 1);
+                if (!space || cached_url != url || (time_t)atol(line) <= time(NULL)) {
+                        fclose(f);
+                        return false;
+                }
+
+                std::vector<char> buffer(PROXY_BUFSIZE);
+                double sent = 0;
+                size_t n;
+                bool in_headers = true;
+                while ((n = fread(&buffer[0], 1, buffer.size(), f)) > 0) {
+                        size_t length = n;
+                        if (head && in_headers) {
+                                // Only the headers for HEAD
+                                std::string chunk(&buffer[0], n);
+                                size_t end = chunk.find("\r\n\r\n");
+                                if (end != std::string::npos) {
+                                        length = end + 4;
+                                        in_headers = false;
+                                }
+                        }
+                        if (!Net::send_all(s, &buffer[0], length)) break;
+                        sent += length;
+                        if (head && !in_headers) break;
+                }
+                fclose(f);
+                // The modification time orders the entries for eviction
+                #ifdef _WIN32
+                _utime(path.c_str(), NULL);
+                #else
+                utime(path.c_str(), NULL);
+                #endif
+
+                Threads::Lock lock(mutex);
+                stats.hits++;
+                stats.bytes_hit += sent;
+                return true;
+        }
+
+        // Fetch the URL from the origin and relay the response, keeping a
+        // copy in the cache if it may be cached
+        void fetch(socket_t client, const std::string &method, const std::string &url,
+                   const std::string &host, int origin_port, const std::string &path,
+                   const std::string &request_headers, const std::string &entry)
+        {
+                socket_t origin = Net::connect_to(host, origin_port);
+                if (origin == NET_INVALID) {
+                        send_response(client, "502 Bad Gateway", "Cannot connect to " + host + "\n");
+                        return;
+                }
+                Net::set_timeout(origin, PROXY_TIMEOUT);
+
+                // HTTP/1.0 keeps the body of the response plain (no chunks)
+                std::string request = method + " " + path + " HTTP/1.0\r\n" + request_headers + "Connection: close\r\n\r\n";
+                if (!Net::send_all(origin, request)) {
+                        net_close(origin);
+                        send_response(client, "502 Bad Gateway", "Cannot send the request to " + host + "\n");
+                        return;
+                }
+
+                // Read the status line and the headers
+                std::vector<char> buffer(PROXY_BUFSIZE);
+                std::string head;
+                size_t header_end = std::string::npos;
+                while (header_end == std::string::npos) {
+                        int n = recv(origin, &buffer[0], (int)buffer.size(), 0);
+                        if (n <= 0) break;
+                        head.append(&buffer[0], n);
+                        header_end = head.find("\r\n\r\n");
+                        if (head.size() > 65536) break;
+                }
+                if (header_end == std::string::npos) {
+                        net_close(origin);
+                        send_response(client, "502 Bad Gateway", "Invalid response from " + host + "\n");
+                        return;
+                }
+
+                std::string headers = head.substr(0, header_end + 2);
+                std::string length_value;
+                double content_length = header_value(headers, "content-length", length_value) ? strtod(length_value.c_str(), NULL) : -1;
+                long age = max_age(headers);
+                bool cacheable = (method == "GET") && !entry.empty() && (headers.size() > 12 && headers.compare(9, 3, "200") == 0) && (age > 0) &&
+                                 (content_length >= 0) && (content_length <= PROXY_MAX_OBJECT_MB * 1024.0 * 1024);
+
+                FILE *copy = NULL;
+                std::ostringstream tmp;
+                tmp << entry << ".tmp" << Threads::current_id();
+                if (cacheable) {
+                        copy = fopen(tmp.str().c_str(), "wb");
+                        if (copy) fprintf(copy, "%ld %s\n", (long)(time(NULL) + age), url.c_str());
+                }
+
+                bool client_ok = Net::send_all(client, head);
+                if (copy) fwrite(head.data(), 1, head.size(), copy);
+                double body = head.size() - (header_end + 4);
+                double fetched = head.size();
+                int n;
+                while ((n = recv(origin, &buffer[0], (int)buffer.size(), 0)) > 0) {
+                        fetched += n;
+                        body += n;
+                        if (copy) fwrite(&buffer[0], 1, n, copy);
+                        if (client_ok) client_ok = Net::send_all(client, &buffer[0], n);
+                        // Without a copy there is no reason to go on for a client that left
+                        if (!client_ok && !copy) break;
+                }
+                net_close(origin);
+                count(&Stats::bytes_fetched, fetched);
+
+                if (copy) {
+                        bool complete = !ferror(copy) && (body == content_length);
+                        fclose(copy);
+                        if (complete) {
+                                std::remove(entry.c_str());
+                                complete = (std::rename(tmp.str().c_str(), entry.c_str()) == 0);
+                        }
+                        if (!complete) {
+                                std::remove(tmp.str().c_str());
+                                return;
+                        }
+                        bool full;
+                        {
+                                Threads::Lock lock(mutex);
+                                cache_bytes += fetched;
+                                full = (cache_bytes > cache_limit);
+                        }
+                        if (full) evict();
+                }
+        }
+
+        void serve_connection(void *arg)
+        {
+                socket_t s = *(socket_t *)arg;
+                delete (socket_t *)arg;
+                Net::set_timeout(s, PROXY_TIMEOUT);
+
+                // GET http://host[:port]/path HTTP/1.1
+                std::string line, method, url, version;
+                if (!Net::recv_line(s, line)) {
+                        net_close(s);
+                        return;
+                }
+                std::istringstream request_line(line);
+                request_line >> method >> url >> version;
+
+                // Headers passed on to the origin, without the hop-by-hop ones
+                std::string headers, all_headers = "\n";
+                while (Net::recv_line(s, line) && !line.empty()) {
+                        all_headers += line + "\n";
+                        std::string name = lower(line.substr(0, line.find(':')));
+                        if (name == "connection" || name == "keep-alive" || name == "te" ||
+                            name.compare(0, 6, "proxy-") == 0 || name == "upgrade") continue;
+                        headers += line + "\r\n";
+                }
+
+                if (url == PROXY_STATS_PATH) {
+                        Stats copy;
+                        {
+                                Threads::Lock lock(mutex);
+                                copy = stats;
+                        }
+                        send_response(s, "200 OK", format_stats(copy));
+                        net_close(s);
+                        return;
+                }
+
+                if ((method != "GET" && method != "HEAD") || url.compare(0, 7, "http://") != 0) {
+                        send_response(s, "501 Not Implemented", "Only http:// GET and HEAD are proxied\n");
+                        net_close(s);
+                        return;
+                }
+
+                size_t slash = url.find('/', 7);
+                std::string authority = url.substr(7, (slash == std::string::npos) ? std::string::npos : slash - 7);
+                std::string path = (slash == std::string::npos) ? "/" : url.substr(slash);
+                std::string host = authority;
+                int origin_port = 80;
+                size_t colon = authority.rfind(':');
+                if (colon != std::string::npos) {
+                        host = authority.substr(0, colon);
+                        origin_port = atoi(authority.c_str() + colon + 1);
+                }
+
+                count(&Stats::requests, 1);
+                // The guest asks for a fresh copy, e.g. CVMFS retrying a corrupt download
+                std::string pragma, cache_control, unused;
+                header_value(all_headers, "pragma", pragma);
+                header_value(all_headers, "cache-control", cache_control);
+                bool reload = (pragma.find("no-cache") != std::string::npos) || (cache_control.find("no-cache") != std::string::npos);
+                // Partial and authenticated responses are never cached
+                bool cacheable = !header_value(all_headers, "range", unused) && !header_value(all_headers, "authorization", unused);
+
+                std::string entry = cacheable ? cache_dir + SEPARATOR + key(url) : "";
+                if (!entry.empty() && !reload && serve_cached(s, url, entry, method == "HEAD")) {
+                        net_close(s);
+                        return;
+                }
+                count(&Stats::misses, 1);
+                fetch(s, method, url, host, origin_port, path, headers, entry);
+                net_close(s);
+        }
+
+        void accept_loop(void *arg)
+        {
+                socket_t listener = *(socket_t *)arg;
+                delete (socket_t *)arg;
+                for (;;) {
+                        socket_t s = accept(listener, NULL, NULL);
+                        if (s == NET_INVALID) continue;
+                        socket_t *client = new socket_t(s);
+                        Threads::Handle handle;
+                        if (!Threads::spawn(handle, serve_connection, client)) {
+                                net_close(s);
+                                delete client;
+                        }
+                }
+        }
+
+        // Serve the proxy from a thread, or reuse the proxy that already
+        // listens on the port. Returns false if there is no proxy at all.
+        bool start()
+        {
+                Trace::Span span("Proxy::start");
+                if (cache_dir.empty()) cache_dir = default_cache_dir();
+                // The objects of the cache are served to every VM of the host
+                if (!Helper::private_dir(cache_dir)) {
+                        LOG_WARNING("The proxy cache " << cache_dir << " is not a directory of this user only, "
+                                    "the guest will not use an HTTP proxy");
+                        return false;
+                }
+
+                socket_t listener = Net::listen_local(port);
+                if (listener == NET_INVALID) {
+                        socket_t probe = Net::connect_to("127.0.0.1", port);
+                        if (probe == NET_INVALID) {
+                                LOG_WARNING("Port " << port << " is taken but nothing answers, the guest will not use an HTTP proxy");
+                                return false;
+                        }
+                        net_close(probe);
+                        LOG_NOTICE("Reusing the HTTP proxy already running on port " << port);
+                        span.arg("reused", "true");
+                        running = true;
+                        last_report = dtime();
+                        return true;
+                }
+
+                #ifndef _WIN32
+                // A guest that goes away in the middle of a response must not kill the wrapper
+                signal(SIGPIPE, SIG_IGN);
+                #endif
+                evict();
+
+                Threads::Handle handle;
+                socket_t *arg = new socket_t(listener);
+                if (!Threads::spawn(handle, accept_loop, arg)) {
+                        delete arg;
+                        net_close(listener);
+                        LOG_WARNING("Impossible to create the HTTP proxy thread");
+                        return false;
+                }
+                LOG_NOTICE("HTTP proxy listening on port " << port << ", cache of " << cache_limit / (1024*1024)
+                           << " MB in " << cache_dir << " (" << cache_bytes / (1024*1024) << " MB used)");
+                span.arg("cache_mb", cache_bytes / (1024*1024));
+                serving = running = true;
+                last_report = dtime();
+                return true;
+        }
+
+        // Counters of the proxy of this process, or asked to the one that is reused
+        bool read_stats(Stats &s)
+        {
+                memset(&s, 0, sizeof(s));
+                if (serving) {
+                        Threads::Lock lock(mutex);
+                        s = stats;
+                        return true;
+                }
+
+                socket_t probe = Net::connect_to("127.0.0.1", port);
+                if (probe == NET_INVALID) return false;
+                Net::set_timeout(probe, 5);
+                std::string response, line;
+                bool ok = Net::send_all(probe, "GET " PROXY_STATS_PATH " HTTP/1.0\r\n\r\n");
+                while (ok && Net::recv_line(probe, line)) response += line + "\n";
+                net_close(probe);
+                size_t body = response.find("\n\n");
+                if (body == std::string::npos) return false;
+                std::istringstream values(response.substr(body + 2));
+                std::string name;
+                double value;
+                while (values >> name >> value) {
+                        if (name == "requests") s.requests = value;
+                        else if (name == "hits") s.hits = value;
+                        else if (name == "misses") s.misses = value;
+                        else if (name == "bytes_hit") s.bytes_hit = value;
+                        else if (name == "bytes_fetched") s.bytes_fetched = value;
+                }
+                return true;
+        }
+
+        // Log the hit rate every PROXY_REPORT_PERIOD seconds, from the main loop
+        void report(bool force = false)
+        {
+                if (!running || (!force && dtime() - last_report < PROXY_REPORT_PERIOD)) return;
+                last_report = dtime();
+                Stats s;
+                if (!read_stats(s) || s.requests == 0) return;
+                double hit_rate = 100.0 * s.hits / s.requests;
+                double byte_rate = (s.bytes_hit + s.bytes_fetched > 0) ? 100.0 * s.bytes_hit / (s.bytes_hit + s.bytes_fetched) : 0;
+                LOG_NOTICE("HTTP proxy: " << s.requests << " requests, " << (int)hit_rate << "% hits, "
+                           << (int)byte_rate << "% of " << (s.bytes_hit + s.bytes_fetched) / (1024*1024)
+                           << " MB served from the cache");
+                Trace::counter("proxy hit rate", hit_rate);
+        }
+
+        // --proxy-server: only run the proxy. Only returns on error.
+        int serve()
+        {
+                if (!start() || !serving) {
+                        LOG_ERROR("Impossible to listen on 127.0.0.1:" << port);
+                        return 1;
+                }
+                for (;;) {
+                        boinc_sleep(PROXY_REPORT_PERIOD);
+                        report(true);
+                }
+                return 0;
+        }
+}
+
+#endif // PROXY_H
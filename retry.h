@@ -0,0 +1,180 @@
+// Retry and backoff policy for hypervisor operations
+//
+// Every operation that may have to be retried (starting the VM, polling its
+// state, pause, resume, savestate...) uses a RetryState built from one of the
+// policies below. Delays grow exponentially and are randomized, so wrappers
+// running on the same host do not all hit VBoxSVC on the same beat when it
+// is contended. Each operation has its own deadline, and the retries of an
+// incident share one time budget: it is refilled as soon as an operation
+// succeeds, or when nothing was retried for RETRY_WINDOW seconds, so the
+// hiccups of a long run do not add up. Fatal errors give up immediately.
+
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <string>
+#include <time.h>
+
+enum RetryError {
+        RETRY_TRANSIENT,        // e.g. the VM or VBoxSVC is locked by another process
+        RETRY_FATAL             // e.g. no hardware virtualization, retrying will not help
+};
+
+struct RetryPolicy {
+        const char *name;
+        int    max_attempts;
+        double initial_delay;   // seconds before the first retry
+        double max_delay;       // upper bound for a single delay
+        double multiplier;      // growth of the delay after each failure
+        double jitter;          // randomization, as a fraction of the delay
+        double deadline;        // seconds since the first failure before giving up
+};
+
+//                                         name        attempts initial max  mult jitter deadline
+const RetryPolicy RETRY_START           = {"start",         5,  2.0,  30.0, 2.0, 0.5,  180.0};
+const RetryPolicy RETRY_POLL            = {"poll",          5,  1.0,  16.0, 2.0, 0.5,  120.0};
+const RetryPolicy RETRY_POWEROFF        = {"poweroff",      5,  1.0,  16.0, 2.0, 0.5,   60.0};
+const RetryPolicy RETRY_STATUS          = {"status",       10,  0.5,   8.0, 2.0, 0.5,   60.0};
+const RetryPolicy RETRY_CONTROL         = {"control",      10,  0.5,   8.0, 1.5, 0.5,   60.0};
+
+// Seconds the retries of an incident may sleep in total, and seconds
+// without a retry after which the incident is over
+#define RETRY_BUDGET 900.0
+#define RETRY_WINDOW 1800.0
+
+namespace Retry
+{
+        double spent = 0;
+        time_t last_retry = 0;
+        unsigned long seed = 0;
+
+        // Small xorshift generator, seeded per process so that wrappers started
+        // at the same time still get different delays
+        double random()
+        {
+                if (!seed) {
+                        #ifdef _WIN32
+                        seed = (unsigned long)time(NULL) ^ ((unsigned long)GetCurrentProcessId() << 16);
+                        #else
+                        seed = (unsigned long)time(NULL) ^ ((unsigned long)getpid() << 16);
+                        #endif
+                        if (!seed) seed = 1;
+                }
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                return (seed & 0xffffff) / (double)0x1000000;
+        }
+
+        // value +/- fraction * value
+        double jitter(double value, double fraction)
+        {
+                return value * (1.0 + fraction * (2.0 * random() - 1.0));
+        }
+
+        // Delay for boinc_temporary_exit, randomized so that restarted tasks
+        // on the same host spread out
+        int exit_delay(int secs)
+        {
+                return (int)jitter(secs, 0.2);
+        }
+
+        double budget_left()
+        {
+                if (last_retry && difftime(time(NULL), last_retry) > RETRY_WINDOW) spent = 0;
+                return RETRY_BUDGET - spent;
+        }
+
+        // An operation succeeded: the incident is over
+        void succeeded()
+        {
+                spent = 0;
+                last_retry = 0;
+        }
+
+        // Classify the output of a failed VBoxManage command. VM::start falls
+        // back to one core on the VT-x/AMD-V errors before it gets here, they
+        // are fatal for a single core VM.
+        RetryError classify(const std::string &output)
+        {
+                if ((output.find("VERR_VMX_NO_VMX") != std::string::npos) ||
+                    (output.find("VERR_SVM_DISABLED") != std::string::npos) ||
+                    (output.find("VERR_SVM_NO_SVM") != std::string::npos) ||
+                    (output.find("VERR_VMX_MSR_LOCKED_OR_DISABLED") != std::string::npos) ||
+                    (output.find("VBOX_E_OBJECT_NOT_FOUND") != std::string::npos) ||
+                    (output.find("Could not find a registered machine") != std::string::npos) ||
+                    (output.find("VBOX_E_FILE_ERROR") != std::string::npos)) {
+                        return RETRY_FATAL;
+                }
+                // Lock contention (VBOX_E_INVALID_OBJECT_STATE, "is already locked",
+                // E_ACCESSDENIED while VBoxSVC starts...) and anything unknown
+                return RETRY_TRANSIENT;
+        }
+}
+
+class RetryState {
+public:
+        RetryState(const RetryPolicy &p) : policy(p)
+        {
+                clear();
+        }
+
+        // The operation succeeded
+        void reset()
+        {
+                Retry::succeeded();
+                clear();
+        }
+
+        int attempts() const
+        {
+                return failures;
+        }
+
+        const char *name() const
+        {
+                return policy.name;
+        }
+
+        // Record a failure. Sleeps before the next attempt and returns true if
+        // the operation should be retried, or returns false at once if the
+        // error is fatal, the attempts or the deadline are exhausted, or the
+        // incident has used up the retry budget.
+        bool retry(RetryError error = RETRY_TRANSIENT)
+        {
+                time_t now = time(NULL);
+                failures++;
+                if (!first_failure) first_failure = now;
+
+                if (error == RETRY_FATAL) return false;
+                if (failures >= policy.max_attempts) return false;
+
+                double delay = Retry::jitter(next_delay, policy.jitter);
+                if (difftime(now, first_failure) + delay > policy.deadline) return false;
+                if (delay > Retry::budget_left()) return false;
+
+                boinc_sleep(delay);
+                Retry::spent += delay;
+                Retry::last_retry = time(NULL);
+
+                next_delay *= policy.multiplier;
+                if (next_delay > policy.max_delay) next_delay = policy.max_delay;
+                return true;
+        }
+
+private:
+        RetryPolicy policy;
+
+        void clear()
+        {
+                failures = 0;
+                first_failure = 0;
+                next_delay = policy.initial_delay;
+        }
+
+        int    failures;
+        time_t first_failure;
+        double next_delay;
+};
+
+#endif // RETRY_H
@@ -24,12 +24,30 @@
 //   (your app may not work this way; e.g. you might create work in batches)
 // - Creates work for the application "cernvm".
 // - Uses the -i, -inputfile or --inputfile to specify which VM has to be used.
+// - With -m, -manifest or --manifest FILE, creates the jobs listed in FILE
+//   instead, one per line:
+//
+//       NAME [PARAMETERS...]
+//
+//   Blank lines and lines starting with # are skipped, and the parameters
+//   go to the input file of the job. The manifest is read line by line, so
+//   it can hold millions of jobs, and can be appended to while the
+//   generator runs. The position reached is kept in FILE.cursor, written
+//   aside then renamed after every batch, so that a restarted generator
+//   goes on from there. A job created just before a crash, before its
+//   batch was recorded, is found by its name and not created twice. Any
+//   other job that already has the name of a line is an error: its input
+//   file is left alone.
 
 
 #include <unistd.h>
 #include <cstdlib>
+#include <cstdio>
+#include <cctype>
 #include <string>
 #include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "boinc_db.h"
 #include "error_numbers.h"
@@ -46,6 +64,10 @@
 #define CUSHION 100
     // maintain at least this many unsent results
 #define REPLICATION_FACTOR  2
+#define MANIFEST_LINE_MAX 4096
+    // longest line of a manifest
+#define MANIFEST_END 1
+    // next_manifest_job(): no complete line left, for now
 
 // globals
 //
@@ -54,26 +76,192 @@ DB_APP app;
 int start_time;
 int seqno;
 
+// manifest mode
+//
+char* manifest_path = NULL;
+FILE* manifest = NULL;
+off_t manifest_offset = 0;      // start of the next line to read
+long manifest_line = 0;         // lines read so far
+bool manifest_seek = true;      // the FILE is not at manifest_offset
+char cursor_path[1024];
+time_t cursor_time = 0;         // when the cursor was written by the previous run
+
+// Read the position reached in the manifest by a previous run
+//
+int read_cursor() {
+    long long offset;
+    long line;
+    struct stat st;
+    FILE* f = fopen(cursor_path, "r");
+    if (!f) return 0;
+    if (!fstat(fileno(f), &st)) cursor_time = st.st_mtime;
+    int n = fscanf(f, "%lld %ld", &offset, &line);
+    fclose(f);
+    if (n != 2 || offset < 0) {
+        log_messages.printf(MSG_CRITICAL, "%s is not a valid cursor\n", cursor_path);
+        return ERR_XML_PARSE;
+    }
+    manifest_offset = offset;
+    manifest_line = line;
+    return 0;
+}
+
+// Record the position reached. The cursor is written to a temporary file
+// and renamed, so that it is never found half written.
+//
+int write_cursor() {
+    char tmp[1100];
+    sprintf(tmp, "%s.tmp", cursor_path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) return ERR_FOPEN;
+    fprintf(f, "%lld %ld\n", (long long)manifest_offset, manifest_line);
+    if (fflush(f) || fsync(fileno(f))) {
+        fclose(f);
+        return ERR_FWRITE;
+    }
+    fclose(f);
+    if (rename(tmp, cursor_path)) return ERR_RENAME;
+    return 0;
+}
+
+int open_manifest() {
+    int retval;
+    if (strlen(manifest_path) > sizeof(cursor_path) - 8) return ERR_BUFFER_OVERFLOW;
+    sprintf(cursor_path, "%s.cursor", manifest_path);
+    retval = read_cursor();
+    if (retval) return retval;
+    manifest = fopen(manifest_path, "r");
+    if (!manifest) return ERR_FOPEN;
+    log_messages.printf(MSG_NORMAL,
+        "Reading jobs from %s, from line %ld\n", manifest_path, manifest_line + 1
+    );
+    return 0;
+}
+
+// Only characters that are safe in file names and SQL
+//
+bool valid_job_name(const char* name) {
+    if (!*name) return false;
+    for (const char* p = name; *p; p++) {
+        if (!isalnum(*p) && *p != '_' && *p != '-' && *p != '.') return false;
+    }
+    return true;
+}
+
+// Read the next job of the manifest. A last line without its newline may
+// still be being written: it is left for later.
+//
+int next_manifest_job(char* name, char* params) {
+    char buf[MANIFEST_LINE_MAX];
+
+    while (1) {
+        if (manifest_seek) {
+            // Look again at the end, where lines may have been appended
+            clearerr(manifest);
+            if (fseeko(manifest, manifest_offset, SEEK_SET)) return ERR_FILE_MISSING;
+            manifest_seek = false;
+        }
+        if (!fgets(buf, sizeof(buf), manifest)) {
+            manifest_seek = true;
+            return MANIFEST_END;
+        }
+        size_t len = strlen(buf);
+        if (len == 0 || buf[len-1] != '\n') {
+            manifest_seek = true;
+            if (feof(manifest)) return MANIFEST_END;
+            log_messages.printf(MSG_CRITICAL,
+                "%s: line %ld is longer than %d bytes\n",
+                manifest_path, manifest_line + 1, MANIFEST_LINE_MAX - 1
+            );
+            return ERR_BUFFER_OVERFLOW;
+        }
+        manifest_offset = ftello(manifest);
+        manifest_line++;
+        strip_whitespace(buf);
+        if (!buf[0] || buf[0] == '#') continue;
+
+        char* rest = buf + strcspn(buf, " \t");
+        if (*rest) *rest++ = 0;
+        rest += strspn(rest, " \t");
+        if (strlen(buf) > 200 || !valid_job_name(buf)) {
+            log_messages.printf(MSG_CRITICAL,
+                "%s: line %ld: invalid job name %s\n", manifest_path, manifest_line, buf
+            );
+            return ERR_BAD_FILENAME;
+        }
+        strcpy(name, buf);
+        strcpy(params, rest);
+        return 0;
+    }
+}
+
+// The input file of a job
+//
+std::string input_file_contents(const char* name, const char* params) {
+    std::string contents = std::string("This is the input file for job ") + name;
+    if (params) contents += std::string("\n") + params + "\n";
+    return contents;
+}
+
+// Whether the existing job old was made from this line by a run that
+// crashed before recording its batch: created by a previous run after it
+// last wrote the cursor, with the same input file
+//
+bool recovered_job(DB_WORKUNIT& old, const char* path, const char* name, const char* params) {
+    if (old.create_time < cursor_time || old.create_time >= start_time) return false;
+    std::string expected = input_file_contents(name, params);
+    std::string found(expected.size() + 1, 0);
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    size_t n = fread(&found[0], 1, found.size(), f);
+    fclose(f);
+    return n == expected.size() && !found.compare(0, n, expected);
+}
+
 // create one new job
 //
-int make_job(char* inputfile) {
+int make_job(char* inputfile, const char* job_name = NULL, const char* params = NULL) {
     DB_WORKUNIT wu;
     char name[256], path[256];
     const char* infiles[1];
     int retval;
 
-    // make a unique name (for the job and its input file)
+    // make a unique name (for the job and its input file),
+    // or use the one of the manifest
     //
-    sprintf(name, "uc_%d_%d", start_time, seqno++);
+    if (job_name) strcpy(name, job_name);
+    else sprintf(name, "uc_%d_%d", start_time, seqno++);
+
+    retval = config.download_path(name, path);
+    if (retval) return retval;
+
+    // A job of the manifest may exist already: never write over its input
+    // file, which may have been sent
+    //
+    if (job_name) {
+        DB_WORKUNIT old;
+        char clause[300];
+        sprintf(clause, "where name='%s'", name);
+        if (!old.lookup(clause)) {
+            if (recovered_job(old, path, name, params)) {
+                log_messages.printf(MSG_NORMAL,
+                    "Job %s was created before the last run stopped, skipping it\n", name
+                );
+                return 0;
+            }
+            log_messages.printf(MSG_CRITICAL,
+                "%s: line %ld: job %s already exists\n", manifest_path, manifest_line, name
+            );
+            return ERR_DB_NOT_UNIQUE;
+        }
+    }
 
     // Create the input file.
     // Put it at the right place in the download dir hierarchy
     //
-    retval = config.download_path(name, path);
-    if (retval) return retval;
     FILE* f = fopen(path, "w");
     if (!f) return ERR_FOPEN;
-    fprintf(f, "This is the input file for job %s", name);
+    fputs(input_file_contents(name, params).c_str(), f);
     fclose(f);
 
     // Fill in the job parameters
@@ -97,7 +285,7 @@ int make_job(char* inputfile) {
 
     // Register the job with BOINC
     //
-    return create_work(
+    retval = create_work(
         wu,
         wu_template,
         "templates/cernvm_result",
@@ -106,6 +294,24 @@ int make_job(char* inputfile) {
         1,
         config
     );
+    return retval;
+}
+
+// create the next job of the manifest
+//
+int make_manifest_job(char* inputfile) {
+    char name[MANIFEST_LINE_MAX], params[MANIFEST_LINE_MAX];
+    off_t offset = manifest_offset;
+    long line = manifest_line;
+    int retval = next_manifest_job(name, params);
+    if (!retval) retval = make_job(inputfile, name, params);
+    if (retval && retval != MANIFEST_END) {
+        // Keep the cursor on the job, for the next run
+        manifest_offset = offset;
+        manifest_line = line;
+        manifest_seek = true;
+    }
+    return retval;
 }
 
 void main_loop(char* inputfile) {
@@ -122,14 +328,35 @@ void main_loop(char* inputfile) {
             log_messages.printf(MSG_DEBUG,
                 "Making %d jobs\n", njobs
             );
+            int made = 0;
             for (int i=0; i<njobs; i++) {
-                retval = make_job(inputfile);
+                retval = manifest ? make_manifest_job(inputfile) : make_job(inputfile);
+                if (retval == MANIFEST_END) break;
                 if (retval) {
+                    if (manifest) write_cursor();
                     log_messages.printf(MSG_CRITICAL,
                         "can't make job: %d\n", retval
                     );
                     exit(retval);
                 }
+                made++;
+            }
+            if (manifest) {
+                retval = write_cursor();
+                if (retval) {
+                    log_messages.printf(MSG_CRITICAL,
+                        "can't write %s: %d\n", cursor_path, retval
+                    );
+                    exit(retval);
+                }
+                if (made < njobs) {
+                    // Wait for more lines to be appended
+                    log_messages.printf(MSG_DEBUG,
+                        "End of %s after line %ld\n", manifest_path, manifest_line
+                    );
+                    sleep(60);
+                    continue;
+                }
             }
             // Now sleep for a few seconds to let the transitioner
             // create instances for the jobs we just created.
@@ -153,6 +380,9 @@ void usage(char *name) {
         "Usage: %s [OPTION]...\n\n"
         "Options:\n"
         "  [ -d X ]                        Sets debug level to X.\n"
+        "  [ -i | --inputfile FILE ]       VM image of the jobs.\n"
+        "  [ -m | --manifest FILE ]        Creates the jobs listed in FILE, one per line:\n"
+        "                                  NAME [PARAMETERS...]\n"
         "  [ -h | -help | --help ]         Shows this help text.\n"
         "  [ -v | --version | --version ]  Shows version information.\n",
         name
@@ -182,6 +412,13 @@ int main(int argc, char** argv) {
 	    printf("Input file: %s\n", argv[i+1]);
 	    inputfile = argv[i+1];
 	    i = i + 1;
+        } else if(!strcmp(argv[i], "-m") || !strcmp(argv[i], "-manifest") || !strcmp(argv[i], "--manifest")) {
+            if(!argv[++i]) {
+                log_messages.printf(MSG_CRITICAL, "%s requires an argument\n\n", argv[--i]);
+                usage(argv[0]);
+                exit(1);
+            }
+            manifest_path = argv[i];
         } else {
             log_messages.printf(MSG_CRITICAL, "unknown command line argument: %s\n\n", argv[i]);
             usage(argv[0]);
@@ -216,6 +453,16 @@ int main(int argc, char** argv) {
     start_time = time(0);
     seqno = 0;
 
+    if (manifest_path) {
+        retval = open_manifest();
+        if (retval) {
+            log_messages.printf(MSG_CRITICAL,
+                "can't open manifest %s: %s\n", manifest_path, boincerror(retval)
+            );
+            exit(1);
+        }
+    }
+
     log_messages.printf(MSG_NORMAL, "Starting\n");
 
     main_loop(inputfile);
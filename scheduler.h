@@ -0,0 +1,102 @@
+// Cadences of the tasks of the main loop
+//
+// Each task of the main loop (BOINC status, state of the VM, progress,
+// host controllers...) has its own period and the time it is due next. The
+// loop runs the tasks that are due, in its own order, and then sleeps until
+// the next one is due instead of waking up for everything every second:
+//
+//     Scheduler tasks;
+//     int status_task = tasks.add(STATUS_PERIOD);
+//     while (1) {
+//             if (tasks.due(status_task)) ...
+//             tasks.wait();
+//     }
+//
+// An event can make a task due at once (trigger) or sooner than its period
+// (delay), e.g. polling the VM right after it was paused. A task the loop
+// does not run for a while, e.g. while BOINC has suspended the work unit,
+// is held: it is not due and does not wake the loop up until released. The
+// main loop has a handful of tasks, so they are kept in a vector and looked
+// through.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+
+class Scheduler {
+public:
+        // A task running every period seconds, the first time after first seconds.
+        // Returns its id for due(), trigger() and delay().
+        int add(double period, double first = 0)
+        {
+                Task task;
+                task.period = period;
+                task.next = dtime() + first;
+                task.held = false;
+                tasks.push_back(task);
+                return (int)tasks.size() - 1;
+        }
+
+        // Whether the task is due. If so, it is due again one period later.
+        bool due(int id)
+        {
+                Task &task = tasks[id];
+                double now = dtime();
+                if (task.held || now < task.next) return false;
+                task.next = now + task.period;
+                return true;
+        }
+
+        // Run the task on the next pass of the loop
+        void trigger(int id)
+        {
+                tasks[id].next = 0;
+        }
+
+        // Run the task within secs seconds, unless it is due sooner
+        void delay(int id, double secs)
+        {
+                double next = dtime() + secs;
+                if (next < tasks[id].next) tasks[id].next = next;
+        }
+
+        // Hold or release a task. A released task that was due meanwhile
+        // is due at once.
+        void hold(int id, bool held)
+        {
+                tasks[id].held = held;
+        }
+
+        // Seconds before the next task that is not held is due, 0 if one is
+        // due already
+        double idle() const
+        {
+                double next = 0;
+                bool found = false;
+                for (size_t i = 0; i < tasks.size(); i++) {
+                        if (tasks[i].held) continue;
+                        if (!found || tasks[i].next < next) next = tasks[i].next;
+                        found = true;
+                }
+                double secs = next - dtime();
+                return (secs > 0) ? secs : 0;
+        }
+
+        // Sleep until the next task is due
+        void wait()
+        {
+                double secs = idle();
+                if (secs > 0) boinc_sleep(secs);
+        }
+
+private:
+        struct Task {
+                double period;
+                double next;            // dtime() at which it is due
+                bool held;
+        };
+        std::vector<Task> tasks;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,142 @@
+// How long the state of the VM takes to save, for shutdowns with a deadline
+//
+// When the BOINC client asks the wrapper to quit it kills it after
+// SHUTDOWN_QUIT_DEADLINE seconds, and a VM killed while its state is being
+// written leaves a corrupt saved state: the work done so far is lost. Every
+// savestate is timed and the average (an EWMA) is kept in SAVESTATE_TIME,
+// so that the next shutdown knows up front whether a save fits in the time
+// left. If it does not, the VM is only paused: nothing is written, and the
+// next start resumes it where it was.
+//
+// Until a save has been timed, the time is estimated from the memory of the
+// VM at SHUTDOWN_DEFAULT_MB_PER_SEC.
+
+#ifndef SHUTDOWN_H
+#define SHUTDOWN_H
+
+#include <string>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#define SAVESTATE_TIME "SaveStateTime"
+// Seconds the client waits after a quit request before it kills the wrapper,
+// and the part of them kept for exiting after the VM is saved
+#define SHUTDOWN_QUIT_DEADLINE 60.0
+#define SHUTDOWN_MARGIN 5.0
+// Speed at which the memory of the VM is assumed to be saved, and the fixed
+// cost of a save, until one has been timed
+#define SHUTDOWN_DEFAULT_MB_PER_SEC 50.0
+#define SHUTDOWN_DEFAULT_OVERHEAD 3.0
+// Weight of the last save in the average
+#define SHUTDOWN_EWMA_WEIGHT 0.3
+// Seconds between two looks at a save in progress
+#define SHUTDOWN_MONITOR_PERIOD 0.5
+
+namespace Shutdown
+{
+        // Average seconds of a savestate, and how many were timed
+        double average_secs = 0;
+        int samples = 0;
+
+        void load()
+        {
+                std::ifstream f(SAVESTATE_TIME);
+                if (!f.is_open()) return;
+                if (!(f >> average_secs >> samples) || average_secs < 0) {
+                        average_secs = 0;
+                        samples = 0;
+                }
+        }
+
+        // Add the time of a savestate to the average
+        void record(double secs)
+        {
+                load();
+                if (samples == 0) average_secs = secs;
+                else average_secs = SHUTDOWN_EWMA_WEIGHT * secs + (1 - SHUTDOWN_EWMA_WEIGHT) * average_secs;
+                samples++;
+                std::ofstream f(SAVESTATE_TIME);
+                if (f.is_open()) f << average_secs << " " << samples << "\n";
+        }
+
+        // Seconds a savestate of a VM with memory_mb MB is expected to take
+        double estimate(int memory_mb)
+        {
+                load();
+                if (samples > 0) return average_secs;
+                return SHUTDOWN_DEFAULT_OVERHEAD + memory_mb / SHUTDOWN_DEFAULT_MB_PER_SEC;
+        }
+
+        // Bytes of the saved state files (*.sav) in folder, i.e. what a save
+        // in progress has written so far
+        double saved_bytes(const std::string &folder)
+        {
+                double bytes = 0;
+                if (folder.empty()) return 0;
+                #ifdef _WIN32
+                WIN32_FIND_DATA data;
+                HANDLE h = FindFirstFile((folder + "\\*.sav").c_str(), &data);
+                if (h == INVALID_HANDLE_VALUE) return 0;
+                do {
+                        bytes += (double)data.nFileSizeHigh * 4294967296.0 + data.nFileSizeLow;
+                } while (FindNextFile(h, &data));
+                FindClose(h);
+                #else
+                DIR *d = opendir(folder.c_str());
+                if (!d) return 0;
+                struct dirent *entry;
+                while ((entry = readdir(d)) != NULL) {
+                        std::string name = entry->d_name;
+                        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".sav") != 0) continue;
+                        struct stat st;
+                        if (stat((folder + "/" + name).c_str(), &st) == 0) bytes += st.st_size;
+                }
+                closedir(d);
+                #endif
+                return bytes;
+        }
+
+        // A save in progress, followed from a thread while the main thread
+        // waits for VBoxManage
+        struct Monitor {
+                std::string folder;     // where the .sav file is written
+                double expected_bytes;  // memory of the VM
+                double begin;
+                double deadline;
+                volatile long stop;
+        };
+
+        // Log how much of the state is written, and whether it will be done in time
+        void monitor(void *arg)
+        {
+                Monitor *m = static_cast<Monitor *>(arg);
+                double last_log = m->begin;
+                bool warned = false;
+                while (!m->stop) {
+                        boinc_sleep(SHUTDOWN_MONITOR_PERIOD);
+                        double now = dtime();
+                        double bytes = saved_bytes(m->folder);
+                        if (bytes <= 0 || now - m->begin < 1) continue;
+                        double rate = bytes / (now - m->begin);
+                        double end = now + (m->expected_bytes - bytes) / rate;
+                        if (!warned && end > m->deadline) {
+                                LOG_WARNING("Saving the state at " << (int)(rate / (1024*1024)) << " MB/s may not end before the client stops waiting");
+                                warned = true;
+                        }
+                        if (now - last_log >= 5) {
+                                LOG_NOTICE("Saving the state of the VM: " << (int)(bytes / (1024*1024)) << " MB written in "
+                                           << (int)(now - m->begin) << " s");
+                                last_log = now;
+                        }
+                }
+        }
+}
+
+#endif // SHUTDOWN_H
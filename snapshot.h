@@ -0,0 +1,104 @@
+// Snapshot of the wrapper state published for the graphics shared memory
+//
+// The main loop is the only writer: it fills Snapshot::current and calls
+// publish() once per poll. The BOINC timer thread reads the published copy
+// with read() and never blocks the main loop. Publication uses a sequence
+// lock: the sequence number is odd while a copy is in progress, so a reader
+// that sees it change retries instead of using torn data.
+//
+// The init data fields are cached when the wrapper starts and only refreshed
+// when the client asks us to reread init_data.xml.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string.h>
+#include <string>
+
+#include "threads.h"
+
+namespace Snapshot
+{
+        struct Data {
+                // VM
+                char vm_state[32];
+                int  n_cpus;
+
+                // Progress and telemetry
+                double fraction_done;
+                double running_secs;
+                double cpu_time;
+                int    poll_errors;
+                double io_pressure;     // I/O PSI of the host, %
+                double disk_limit_mb;   // disk bandwidth of the VM, MB/s
+
+                BOINC_STATUS status;
+
+                // Cached init data, init_generation changes on every refresh
+                unsigned int init_generation;
+                char   user_name[256];
+                char   team_name[256];
+                char   wu_name[256];
+                int    userid;
+                int    hostid;
+                double user_total_credit;
+                double host_total_credit;
+        };
+
+        // Owned by the main thread
+        Data current;
+
+        // Shared with the reader
+        volatile unsigned long sequence = 0;
+        Data published;
+
+        void copy_string(char *dst, const char *src, size_t size)
+        {
+                strncpy(dst, src, size - 1);
+                dst[size - 1] = 0;
+        }
+
+        void set_init_data(APP_INIT_DATA &init_data)
+        {
+                copy_string(current.user_name, init_data.user_name, sizeof(current.user_name));
+                copy_string(current.team_name, init_data.team_name, sizeof(current.team_name));
+                copy_string(current.wu_name, init_data.wu_name, sizeof(current.wu_name));
+                current.userid = init_data.userid;
+                current.hostid = init_data.hostid;
+                current.user_total_credit = init_data.user_total_credit;
+                current.host_total_credit = init_data.host_total_credit;
+                current.init_generation++;
+        }
+
+        void set_vm_state(const std::string &state)
+        {
+                copy_string(current.vm_state, state.c_str(), sizeof(current.vm_state));
+        }
+
+        // Called from the main thread only
+        void publish()
+        {
+                sequence++;
+                Threads::barrier();
+                memcpy(&published, &current, sizeof(Data));
+                Threads::barrier();
+                sequence++;
+        }
+
+        // Lock-free read of the last published snapshot.
+        // Returns false if the writer kept it busy, so the caller can try on its next tick.
+        bool read(Data &data)
+        {
+                for (int i = 0; i < 100; i++) {
+                        unsigned long before = sequence;
+                        if (before & 1) continue;
+                        Threads::barrier();
+                        memcpy(&data, &published, sizeof(Data));
+                        Threads::barrier();
+                        if (sequence == before) return true;
+                }
+                return false;
+        }
+}
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,109 @@
+// Storage profiles of the VM
+//
+// The profile decides how the virtual hard disk is attached:
+//
+//  - ide:         PIIX4 IDE controller, what the wrapper always used (default)
+//  - sata:        Intel AHCI controller
+//  - virtio-scsi: VirtIO SCSI controller, needs VirtualBox 6.1
+//
+// with the host I/O cache, the SSD (non-rotational) and discard flags, and
+// an optional bandwidth group limiting the disk I/O of the VM. The profile
+// comes from the project preferences:
+//
+//     <vm_storage>sata</vm_storage>
+//     <vm_hostiocache>0</vm_hostiocache>
+//     <vm_ssd>1</vm_ssd>
+//     <vm_discard>1</vm_discard>
+//     <vm_disk_bandwidth>50M</vm_disk_bandwidth>
+//
+// and --storage PROFILE overrides the bus on a given host.
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <string>
+
+#define STORAGE_BANDWIDTH_GROUP "disk"
+
+struct StorageProfile {
+        std::string bus;                // ide, sata or virtio-scsi
+        int  hostiocache;               // 1 on, 0 off, -1 VirtualBox default
+        bool ssd;
+        bool discard;
+        std::string bandwidth;          // e.g. "50M", empty for no limit
+
+        StorageProfile() : bus("ide"), hostiocache(-1), ssd(false), discard(false) {}
+
+        static bool valid_bus(const std::string &name)
+        {
+                return (name == "ide" || name == "sata" || name == "virtio-scsi");
+        }
+
+        // Digits with an optional k, m or g suffix, as bandwidthctl takes
+        static bool valid_bandwidth(const std::string &limit)
+        {
+                size_t digits = limit.find_first_not_of("0123456789");
+                if (digits == 0 || limit.empty()) return false;
+                if (digits == std::string::npos) return true;
+                return (digits == limit.size() - 1) && std::string("kKmMgG").find(limit[digits]) != std::string::npos;
+        }
+
+        // Name of the storage controller in the VM
+        std::string controller_name() const
+        {
+                if (bus == "sata") return "SATA Controller";
+                if (bus == "virtio-scsi") return "VirtIO Controller";
+                return "IDE Controller";
+        }
+
+        // storagectl arguments creating the controller
+        std::string controller_args() const
+        {
+                std::string args;
+                if (bus == "sata") args = " --add sata --controller IntelAhci --portcount 1";
+                else if (bus == "virtio-scsi") args = " --add virtio --controller VirtIO";
+                else args = " --add ide --controller PIIX4";
+                if (hostiocache >= 0) args += hostiocache ? " --hostiocache on" : " --hostiocache off";
+                return args;
+        }
+
+        // storageattach arguments for the disk
+        std::string attach_args() const
+        {
+                std::string args;
+                if (ssd) args += " --nonrotational on";
+                if (discard) args += " --discard on";
+                if (!bandwidth.empty()) args += " --bandwidthgroup " STORAGE_BANDWIDTH_GROUP;
+                return args;
+        }
+
+        std::string describe() const
+        {
+                std::string text = bus;
+                if (hostiocache >= 0) text += hostiocache ? ", host I/O cache" : ", no host I/O cache";
+                if (ssd) text += ", SSD";
+                if (discard) text += ", discard";
+                if (!bandwidth.empty()) text += ", " + bandwidth + "B/s";
+                return text;
+        }
+
+        void parse_preferences(const char *prefs)
+        {
+                char value[64];
+                int flag;
+                if (!prefs) return;
+                if (parse_str(prefs, "<vm_storage>", value, sizeof(value))) {
+                        if (valid_bus(value)) bus = value;
+                        else LOG_WARNING("Unknown storage profile " << value << ", using " << bus);
+                }
+                if (parse_int(prefs, "<vm_hostiocache>", flag)) hostiocache = flag ? 1 : 0;
+                if (parse_int(prefs, "<vm_ssd>", flag)) ssd = (flag != 0);
+                if (parse_int(prefs, "<vm_discard>", flag)) discard = (flag != 0);
+                if (parse_str(prefs, "<vm_disk_bandwidth>", value, sizeof(value))) {
+                        if (valid_bandwidth(value)) bandwidth = value;
+                        else LOG_WARNING("Invalid disk bandwidth limit " << value);
+                }
+        }
+};
+
+#endif // STORAGE_H
@@ -0,0 +1,176 @@
+// Minimal portable threading helpers for the CernVM wrapper.
+//
+// The wrapper has to build with old toolchains (gcc 4.0 on Mac OS X),
+// so this wraps pthreads and the Win32 API instead of relying on C++11.
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace Threads
+{
+        #ifdef _WIN32
+        typedef HANDLE Handle;
+        #else
+        typedef pthread_t Handle;
+        #endif
+
+        typedef void (*Function)(void *arg);
+
+        struct Start {
+                Function function;
+                void *arg;
+        };
+
+        #ifdef _WIN32
+        DWORD WINAPI trampoline(LPVOID param)
+        #else
+        void *trampoline(void *param)
+        #endif
+        {
+                Start *start = static_cast<Start *>(param);
+                Function function = start->function;
+                void *arg = start->arg;
+                delete start;
+                function(arg);
+                return 0;
+        }
+
+        // Run function(arg) in a new thread. Returns false if the thread
+        // could not be created, in which case the caller should run the
+        // work inline.
+        bool spawn(Handle &handle, Function function, void *arg)
+        {
+                Start *start = new Start;
+                start->function = function;
+                start->arg = arg;
+                #ifdef _WIN32
+                handle = CreateThread(NULL, 0, trampoline, start, 0, NULL);
+                if (handle == NULL) {
+                        delete start;
+                        return false;
+                }
+                #else
+                if (pthread_create(&handle, NULL, trampoline, start) != 0) {
+                        delete start;
+                        return false;
+                }
+                #endif
+                return true;
+        }
+
+        // Identifier of the calling thread, used to tell threads apart in traces
+        unsigned long current_id()
+        {
+                #ifdef _WIN32
+                return (unsigned long)GetCurrentThreadId();
+                #else
+                return (unsigned long)pthread_self();
+                #endif
+        }
+
+        // Full memory barrier
+        void barrier()
+        {
+                #ifdef _WIN32
+                MemoryBarrier();
+                #else
+                __sync_synchronize();
+                #endif
+        }
+
+        // Atomically replace *value by replacement if it is equal to expected
+        bool compare_and_swap(volatile long *value, long expected, long replacement)
+        {
+                #ifdef _WIN32
+                return (InterlockedCompareExchange(value, replacement, expected) == expected);
+                #else
+                return __sync_bool_compare_and_swap(value, expected, replacement);
+                #endif
+        }
+
+        long atomic_increment(volatile long *value)
+        {
+                #ifdef _WIN32
+                return InterlockedIncrement(value);
+                #else
+                return __sync_add_and_fetch(value, 1);
+                #endif
+        }
+
+        class Mutex {
+        public:
+                Mutex()
+                {
+                        #ifdef _WIN32
+                        InitializeCriticalSection(&cs);
+                        #else
+                        pthread_mutex_init(&mutex, NULL);
+                        #endif
+                }
+
+                ~Mutex()
+                {
+                        #ifdef _WIN32
+                        DeleteCriticalSection(&cs);
+                        #else
+                        pthread_mutex_destroy(&mutex);
+                        #endif
+                }
+
+                void lock()
+                {
+                        #ifdef _WIN32
+                        EnterCriticalSection(&cs);
+                        #else
+                        pthread_mutex_lock(&mutex);
+                        #endif
+                }
+
+                void unlock()
+                {
+                        #ifdef _WIN32
+                        LeaveCriticalSection(&cs);
+                        #else
+                        pthread_mutex_unlock(&mutex);
+                        #endif
+                }
+
+        private:
+                #ifdef _WIN32
+                CRITICAL_SECTION cs;
+                #else
+                pthread_mutex_t mutex;
+                #endif
+                Mutex(const Mutex &);
+                Mutex &operator=(const Mutex &);
+        };
+
+        // Scoped lock for a Mutex
+        class Lock {
+        public:
+                Lock(Mutex &m) : mutex(m) { mutex.lock(); }
+                ~Lock() { mutex.unlock(); }
+        private:
+                Mutex &mutex;
+                Lock(const Lock &);
+                Lock &operator=(const Lock &);
+        };
+
+        void join(Handle &handle)
+        {
+                #ifdef _WIN32
+                WaitForSingleObject(handle, INFINITE);
+                CloseHandle(handle);
+                #else
+                pthread_join(handle, NULL);
+                #endif
+        }
+}
+
+#endif // THREADS_H
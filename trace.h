@@ -0,0 +1,171 @@
+// Trace-event timeline of the wrapper lifecycle
+//
+// When enabled with --trace, the wrapper writes every phase as a span in the
+// Chrome trace-event JSON format to trace.json in the slot directory.
+// The file can be loaded in Perfetto (https://ui.perfetto.dev) or in
+// chrome://tracing. Timestamps are absolute, so the spans of a restarted
+// wrapper are appended to the same timeline.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <string>
+#include <sstream>
+
+#include "threads.h"
+
+#define TRACE_FN "trace.json"
+
+namespace Trace
+{
+        FILE *file = NULL;
+        Threads::Mutex mutex;
+
+        int process_id()
+        {
+                #ifdef _WIN32
+                return (int)GetCurrentProcessId();
+                #else
+                return (int)getpid();
+                #endif
+        }
+
+        bool enabled()
+        {
+                return (file != NULL);
+        }
+
+        string escape(const string &in)
+        {
+                string out;
+                for (size_t i = 0; i < in.size(); i++) {
+                        char c = in[i];
+                        if (c == '"' || c == '\\') {
+                                out += '\\';
+                                out += c;
+                        }
+                        else if (c == '\n') out += "\\n";
+                        else if (c == '\r') out += "\\r";
+                        else if (c == '\t') out += "\\t";
+                        else if ((unsigned char)c < 0x20) out += ' ';
+                        else out += c;
+                }
+                return out;
+        }
+
+        void write_event(const string &event)
+        {
+                if (!file) return;
+                Threads::Lock lock(mutex);
+                // The trailing "]" is optional in the trace-event format, so
+                // events can be appended to the file of a previous run
+                fputs(",\n", file);
+                fputs(event.c_str(), file);
+                fflush(file);
+        }
+
+        std::ostringstream &header(std::ostringstream &event, const char *name, const char *cat, char phase)
+        {
+                event.precision(16);
+                event << "{\"name\":\"" << escape(name) << "\",\"cat\":\"" << cat
+                      << "\",\"ph\":\"" << phase << "\",\"ts\":" << dtime() * 1e6
+                      << ",\"pid\":" << process_id() << ",\"tid\":" << Threads::current_id();
+                return event;
+        }
+
+        bool open(const char *filename = TRACE_FN)
+        {
+                bool append = false;
+                FILE *f = fopen(filename, "rb");
+                if (f) {
+                        fseek(f, 0, SEEK_END);
+                        append = (ftell(f) > 0);
+                        fclose(f);
+                }
+
+                file = fopen(filename, "ab");
+                if (!file) return false;
+                if (!append) {
+                        // Start the array with the process name, every other event is
+                        // then prefixed with a comma
+                        fprintf(file, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"cernvm-wrapper\"}}", process_id());
+                        fflush(file);
+                }
+                else {
+                        std::ostringstream event;
+                        event << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << process_id()
+                              << ",\"args\":{\"name\":\"cernvm-wrapper\"}}";
+                        write_event(event.str());
+                }
+                return true;
+        }
+
+        // Instant event, e.g. a VM state change
+        void instant(const char *name, const string &detail = "")
+        {
+                if (!file) return;
+                std::ostringstream event;
+                header(event, name, "event", 'i') << ",\"s\":\"t\"";
+                if (!detail.empty()) event << ",\"args\":{\"detail\":\"" << escape(detail) << "\"}";
+                event << "}";
+                write_event(event.str());
+        }
+
+        // Counter track, e.g. a throttle decision
+        void counter(const char *name, double value)
+        {
+                if (!file) return;
+                std::ostringstream event;
+                header(event, name, "counter", 'C') << ",\"args\":{\"value\":" << value << "}}";
+                write_event(event.str());
+        }
+
+        // Scoped span: written as a begin event when created and as an end
+        // event, carrying the arguments, when it goes out of scope.
+        // Spans opened while another one is open on the same thread nest.
+        class Span {
+        public:
+                Span(const string &name, const char *category = "wrapper")
+                        : name(name), category(category)
+                {
+                        if (!file) return;
+                        std::ostringstream event;
+                        header(event, name.c_str(), category, 'B') << "}";
+                        write_event(event.str());
+                }
+
+                ~Span()
+                {
+                        if (!file) return;
+                        std::ostringstream event;
+                        header(event, name.c_str(), category, 'E');
+                        if (!args.empty()) event << ",\"args\":{" << args << "}";
+                        event << "}";
+                        write_event(event.str());
+                }
+
+                void arg(const char *key, const string &value)
+                {
+                        if (!file) return;
+                        if (!args.empty()) args += ",";
+                        args += "\"" + string(key) + "\":\"" + escape(value) + "\"";
+                }
+
+                void arg(const char *key, double value)
+                {
+                        if (!file) return;
+                        std::ostringstream tmp;
+                        tmp << value;
+                        if (!args.empty()) args += ",";
+                        args += "\"" + string(key) + "\":" + tmp.str();
+                }
+
+        private:
+                string name;
+                const char *category;
+                string args;
+        };
+}
+
+#endif // TRACE_H
@@ -34,16 +34,37 @@ Share::SharedData* Share::data;
 #endif
 
 #include "helper.h"
+#include "threads.h"
+#include "trace.h"
+#include "logscan.h"
+#include "retry.h"
+#include "hypervisor.h"
+#include "journal.h"
+#include "storage.h"
+#include "balloon.h"
+#include "iothrottle.h"
+#include "proxy.h"
+#include "guest.h"
+#include "guestprop.h"
+#include "cputime.h"
+#include "scheduler.h"
+#include "shutdown.h"
+#include "prefetch.h"
 #include "floppyIO.h"
 
 #define VM_NAME "VMName"
-#define CPU_TIME "CpuTime"
 #define TRICK_PERIOD 45.0*60
 #define CHECK_PERIOD 2.0*60
 #define POLL_PERIOD 1.0
+// Cadences of the main loop: BOINC status (suspend, quit...) and state of the VM
+#define STATUS_PERIOD 0.1
+#define VM_POLL_PERIOD 30.0
 #define MESSAGE "CPUTIME"
 #define YEAR_SECS 365*24*60*60
 #define BUFSIZE 4096
+// Seconds to follow VBox.log after startvm, and how often
+#define LOGSCAN_START_TIMEOUT 30.0
+#define LOGSCAN_PERIOD 0.25
 
 using std::string;
 
@@ -52,6 +73,8 @@ struct VM {
         string disk_name;
         string disk_path;
         string name_path;
+        // Floppy image shared with the guest
+        string floppy_name;
 
         // BOINC user name and password (in this case authenticator)
         string boinc_userid;
@@ -73,133 +96,62 @@ struct VM {
         
         VM();
         void create();
+        bool create_config();
+        bool attach_floppy();
+        void attach_disk();
+        void save_name();
         bool exists();
         void throttle();
         void start(bool vrde, bool headless);
         void pause();
         void savestate();
+        void shutdown(double deadline);
+        bool save_monitored(double deadline);
         void resume();
         void remove();
         void release(); 
         void poll();
         bool is_status(string status);
-};
+        bool control(string action, string expected_state);
+        string vbox_log_path();
+        bool no_vtx(const string &output);
+        void disable_multicore(string start_cmd);
+        bool check_log();
+        void handle_log_event(const LogEvent &event);
 
-//void write_cputime(double);
+        // How the virtual hard disk is attached
+        StorageProfile storage;
 
-APP_INIT_DATA aid;
+        // Gives memory back to the host when it needs it
+        Balloon::Controller balloon;
 
-// Run VBoxManage commands to interact with the virtual machine.
-// When buffer is NULL, this function will not return the input of new process.
-// Otherwise, it will not redirect the input of new process to buffer
-bool vbm_popen(string arg_list, char * buffer=NULL, int nSize=1024, 
-                                            string command="VBoxManage -q ") {
-#ifdef _WIN32
-        STARTUPINFO si;
-        SECURITY_ATTRIBUTES sa;
-        SECURITY_DESCRIPTOR sd; //security information for pipes
-        PROCESS_INFORMATION pi;
-        HANDLE newstdout,read_stdout; //pipe handles
-        unsigned long exit=0;
-        if (buffer!=0) {
-            //initialize security descriptor (Windows NT)
-            if (Helper::IsWinNT()) {
-                    InitializeSecurityDescriptor(&sd,SECURITY_DESCRIPTOR_REVISION);
-                    SetSecurityDescriptorDacl(&sd, true, NULL, false);
-                    sa.lpSecurityDescriptor = &sd;
-            }
-            else sa.lpSecurityDescriptor = NULL;
-            sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-            sa.bInheritHandle = true; //allow inheritable handles
-
-            //create stdout pipe
-            if (!CreatePipe(&read_stdout,&newstdout,&sa,0)) {
-                    cerr << "ERROR: CreatePipe failed!!" << endl;
-                    CloseHandle(newstdout);
-                    CloseHandle(read_stdout);
-                    return false;
-            }
-        }
+        // Lowers the disk bandwidth when the host needs its disk
+        IoThrottle::Controller io_throttle;
 
-        GetStartupInfo(&si);
-        si.dwFlags = STARTF_USESHOWWINDOW;
-        si.wShowWindow = SW_HIDE;
+        // Follows VBox.log for the whole life of the VM
+        LogScanner log_scanner;
 
-        if (buffer != NULL) {
-                si.dwFlags = STARTF_USESTDHANDLES|si.dwFlags;
-                si.hStdOutput = newstdout;
-                si.hStdError = newstdout;   //set the new handles for the child process
-                si.hStdInput = NULL;
-        }
-    
-        command += arg_list;
-
-        if (!CreateProcess( NULL, (LPTSTR)command.c_str(), NULL, NULL, TRUE,
-                                    CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
-                cerr << "ERROR: CreateProcess failed!" << endl;
-                if (buffer!=NULL) {
-                        CloseHandle(newstdout);
-                        CloseHandle(read_stdout);
-                }
-                return false;
-        }
-    
-        // Wait until process exits.
-        WaitForSingleObject(pi.hProcess, INFINITE);
-    
-        // Close process and thread handles.
-        CloseHandle(pi.hThread);
-        CloseHandle(pi.hProcess);
-    
-        if (buffer!=NULL) {
-                memset(buffer, 0, nSize);
-                DWORD bread;
-                BOOL bSuccess = false;
-    
-                for (;;)
-                {
-                    ReadFile(read_stdout, buffer, nSize-1, &bread, NULL);
-                    if (!bSuccess || bread == 0) break;
-                }
-                // buffer[bread]=0;
-                CloseHandle(newstdout);
-                CloseHandle(read_stdout);
-        }
-    
-        if (exit == 0) 
-            return true;
-        else
-            return false;
-// GNU/Linux and Mac OS X code
-#else     
-        FILE *fp;
-        char temp[256];
-        string strTemp = "";
-        command += arg_list;
-        if (buffer == NULL) {
-                if(!system(command.c_str()))
-                        return true;
-                else return false;
-        }
-    
-        fp = popen(command.c_str(), "r");
-        if (fp == NULL) {
-                cerr << "ERROR: vbm_popen failed" << endl;
-                return false;
-        }
+        RetryState start_retry;
+        RetryState poll_retry;
+        RetryState poweroff_retry;
+};
 
-        memset(buffer, 0, nSize);
-        while (fgets(temp,256,fp) != NULL) {
-            strTemp += temp;
-        }
+//void write_cputime(double);
 
-        pclose(fp);
-        strncpy(buffer, strTemp.c_str(), nSize-1);
-        return true;
-#endif
+APP_INIT_DATA aid;
+
+// Run VBoxManage commands to interact with the virtual machine through the
+// selected hypervisor backend.
+// When buffer is NULL, this function will not return the input of new process
+// and only succeeds if the command does. Otherwise the output is copied to
+// buffer, and it only fails if the command could not be run at all.
+bool vbm_popen(string arg_list, char * buffer=NULL, int nSize=1024) {
+        int exit_code = hypervisor->run(arg_list, buffer, nSize);
+        if (buffer == NULL) return (exit_code == 0);
+        return (exit_code != -1);
 }
 
-VM::VM() {
+VM::VM() : start_retry(RETRY_START), poll_retry(RETRY_POLL), poweroff_retry(RETRY_POWEROFF) {
         char buffer[256];
     
         virtual_machine_name = "";
@@ -225,27 +177,39 @@ VM::VM() {
 
 void VM::create() 
 {
-        time_t rawtime;
+        if (!create_config()) {
+                LOG_NOTICE("Removing registered VM because to clean the system");
+                remove();
+                Log::finish(1);
+        }
+        attach_disk();
+}
+
+// Register the VM and configure everything that does not depend on the
+// virtual hard disk, so it can run while the disk is being decompressed.
+// Returns false if the VM could not be configured: it runs on the startup
+// thread, so the caller removes the VM and ends the work unit.
+bool VM::create_config()
+{
+        Trace::Span span("VM::create_config");
         string arg_list;
 
         //createvm
         arg_list = "createvm --name " + virtual_machine_name + " --ostype Linux26 --register";
-        if (!vbm_popen(arg_list)) {
-                cerr << "ERROR: Create VM method -> createvm failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: Removing registered VM because to clean the system" << endl; 
-                }
-                remove();
-                boinc_finish(1);
+        if (!hypervisor->create(virtual_machine_name, "Linux26")) {
+                LOG_ERROR("Create VM method -> createvm failed! Aborting");
+                LOG_ERROR(arg_list);
+                return false;
         }
     
         //modifyvm
         arg_list.clear();
         std::stringstream tmp;
         tmp << n_cpus;
+        std::stringstream memory;
+        memory << balloon.ceiling_mb;
         arg_list = "modifyvm " + virtual_machine_name + \
-                " --cpus " + tmp.str() + " --memory 256 --acpi on --ioapic on \
+                " --cpus " + tmp.str() + " --memory " + memory.str() + " --acpi on --ioapic on \
                   --boot1 disk --boot2 none --boot3 none --boot4 none \
                   --nic1 nat \
                   --natdnsproxy1 on";
@@ -253,37 +217,47 @@ void VM::create()
         vbm_popen(arg_list);
 
         // Enable port-forwarding for t4t-webapp
-        if (debug_level >= 4) {
-                cerr << "INFO: Enabling Port Forwarding in the Virtual Machine" << endl;
-        }
+        LOG_INFO("Enabling Port Forwarding in the Virtual Machine");
         arg_list.clear();
         arg_list = " modifyvm " + virtual_machine_name + \
                    " --natpf1  \"graphicsvm,tcp,127.0.0.1,7859,,80\"";
         vbm_popen(arg_list);
     
         // Create the controller for the virtual hard disk
+        LOG_NOTICE("Storage profile: " << storage.describe());
         arg_list.clear();
         arg_list = "storagectl " + virtual_machine_name + \
-                   " --name \"IDE Controller\" --add ide --controller PIIX4";
-        vbm_popen(arg_list);
-    
-        // Attach Virtual hard disk to the VM and create a new random UUID every time a VM is created.
-        arg_list.clear();
-        arg_list = "storageattach " + virtual_machine_name + \
-                   " --storagectl \"IDE Controller\" \
-                     --port 0 --device 0 --type hdd --medium " \
-                   + disk_path + " --setuuid \"\" ";
-
+                   " --name \"" + storage.controller_name() + "\"" + storage.controller_args();
         if (!vbm_popen(arg_list)) {
-                cerr << "ERROR: Create storageattach failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                remove();
-                boinc_finish(1);
+                LOG_ERROR("Creating the " << storage.controller_name() << " failed! Aborting");
+                LOG_ERROR(arg_list);
+                return false;
         }
 
+        // Limit the disk I/O of the VM
+        if (!storage.bandwidth.empty()) {
+                arg_list = "bandwidthctl " + virtual_machine_name + " add " STORAGE_BANDWIDTH_GROUP \
+                           " --type disk --limit " + storage.bandwidth;
+                if (!vbm_popen(arg_list)) {
+                        LOG_WARNING("Impossible to limit the disk bandwidth to " << storage.bandwidth);
+                        storage.bandwidth.clear();
+                }
+        }
+
+        if (!attach_floppy()) return false;
+        Journal::record("configured", "storage", storage.bus);
+        return true;
+}
+
+// Create a new floppy image, attach it to the VM and send the BOINC
+// credentials to the guest through it. Returns false if it could not be attached.
+bool VM::attach_floppy()
+{
+        Trace::Span span("VM::attach_floppy");
+        string arg_list;
+
         // Create the controller for the virtual floppy image
         unsigned long int slug = time(NULL);
-        string floppy_name;  
         std::stringstream out;
         out << "floppy_" <<  slug << ".img";
         floppy_name = out.str();
@@ -293,10 +267,12 @@ void VM::create()
         myfile << floppy_name << endl;
         myfile.close();
         // Create the Floppy image
+        span.arg("floppy", floppy_name);
         FloppyIO floppy(floppy_name.c_str());
         arg_list.clear();
         arg_list = "storagectl " + virtual_machine_name + \
                    " --name \"Floppy Controller\" --add floppy";
+        // Fails harmlessly when the floppy is attached again
         vbm_popen(arg_list);
 
         // Attach the virtual foppy image
@@ -306,10 +282,9 @@ void VM::create()
                      --port 0 --device 0 --medium " + floppy_name.c_str();
 
         if (!vbm_popen(arg_list)) {
-                cerr << "ERROR: Adding the Floppy image failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                remove();
-                boinc_finish(1);
+                LOG_ERROR("Adding the Floppy image failed! Aborting");
+                LOG_ERROR(arg_list);
+                return false;
         }
 
         floppy.send("BOINC_USERNAME=" + boinc_username + 
@@ -317,9 +292,38 @@ void VM::create()
                     "\nBOINC_USERID=" + boinc_userid +
                     "\nBOINC_HOSTID=" + boinc_hostid +
                     "\nBOINC_HOST_TOTAL_CREDIT=" + boinc_host_total_credit + 
-                    "\nBOINC_AUTHENTICATOR=" + boinc_authenticator);
+                    "\nBOINC_AUTHENTICATOR=" + boinc_authenticator +
+                    (Proxy::running ? "\n" + Proxy::guest_setting() : ""));
+        Journal::record("floppy", "name", floppy_name);
+        return true;
+}
 
-        // Create VM
+// Attach the virtual hard disk and mark the VM as created
+void VM::attach_disk()
+{
+        Trace::Span span("VM::attach_disk");
+        string arg_list;
+
+        // Attach Virtual hard disk to the VM and create a new random UUID every time a VM is created.
+        arg_list = "storageattach " + virtual_machine_name + \
+                   " --storagectl \"" + storage.controller_name() + "\" \
+                     --port 0 --device 0 --type hdd --medium " \
+                   + disk_path + " --setuuid \"\" " + storage.attach_args();
+
+        if (!vbm_popen(arg_list)) {
+                LOG_ERROR("Create storageattach failed! Aborting");
+                LOG_ERROR(arg_list);
+                remove();
+                Log::finish(1);
+        }
+        Journal::record("attached");
+
+        save_name();
+}
+
+// Write the VMName file: from now on the VM exists for the wrapper
+void VM::save_name()
+{
         std::ofstream f(name_path.c_str());
         if (f.is_open()) {
                 if (f.good()) {
@@ -328,9 +332,10 @@ void VM::create()
                 f.close();
         }
         else {
-                cerr << "ERROR: Saving VM name failed! Details -> ofstream failed! Aborting" << endl;
-                boinc_finish(1);
+                LOG_ERROR("Saving VM name failed! Details -> ofstream failed! Aborting");
+                Log::finish(1);
         }
+        Journal::record("created");
 }
 
 bool VM::exists()
@@ -347,33 +352,30 @@ bool VM::exists()
 
 void VM::throttle()
 {
+        Trace::Span span("VM::throttle");
         // Check the BOINC CPU preferences for running the VM accordingly
         string arg_list;
         boinc_get_init_data(aid);
 
-        cerr << "INFO: Number of cores: " << n_cpus << endl;
+        LOG_NOTICE("Number of cores: " << n_cpus);
 
         if (aid.project_preferences) {
                 if (!aid.project_preferences) return;
                 double max_vm_cpu_pct = 100.0;
                 if (parse_double(aid.project_preferences, "<max_vm_cpu_pct>", 
                                                                     max_vm_cpu_pct)) {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: Maximum usage of CPU: " << max_vm_cpu_pct << endl;
-                                cerr << "NOTICE: Setting how much CPU time the virtual CPU can use: " << max_vm_cpu_pct << endl;
-                        }
+                        LOG_NOTICE("Maximum usage of CPU: " << max_vm_cpu_pct);
+                        LOG_NOTICE("Setting how much CPU time the virtual CPU can use: " << max_vm_cpu_pct);
 
                         std::stringstream out;
                         out << int(max_vm_cpu_pct);
     
                         arg_list = " controlvm " + virtual_machine_name + " cpuexecutioncap " + out.str();
                         if (!vbm_popen(arg_list)) {
-                                cerr << "ERROR: Impossible to set up CPU percentage usage limit" << endl;
+                                LOG_ERROR("Impossible to set up CPU percentage usage limit");
                         }
                         else {
-                            if (debug_level >= 3) {
-                                    cerr << "NOTICE: Success!" << endl;
-                            }
+                            LOG_NOTICE("Success!");
                         }
                 }
         }
@@ -381,134 +383,120 @@ void VM::throttle()
 
 bool VM::is_status(string status) 
 {
+        Trace::Span span("VM::is_status");
+        span.arg("status", status);
         boinc_begin_critical_section();
-        char buffer[1024];
-        int poll_err_number = 0;
-
-        string arg_list = "showvminfo " + virtual_machine_name + " --machinereadable";
-        if (!vbm_popen(arg_list, buffer, sizeof(buffer))) {
-                // Increase the number of errors
-                double wait_time = 5.0;
-                poll_err_number += 1;
-                cerr << "ERROR: Checking if VM is " + status + " failed  " << poll_err_number << " times!" << endl;
-                if (debug_level >= 3) {
-                        cerr << "WARNING: Sleeping " + status + " check for " << wait_time << " seconds" << endl;
-                }
-                boinc_sleep(wait_time);
-                if (debug_level >= 3) {
-                        cerr << "INFO: Resumming " + status + " check" << endl;
-                } 
-                if (poll_err_number > 10) {
-                        cerr << "ERROR: Get " + status + " check from the VM has failed " << poll_err_number << " times!" << endl;
-                        cerr << "ERROR: Aborting the execution" << endl;
-                        remove();
+        RetryState retry(RETRY_STATUS);
+
+        for (;;) {
+                string state, output;
+                if (hypervisor->state(virtual_machine_name, state, output)) {
+                        retry.reset();
                         boinc_end_critical_section();
-                        boinc_finish(1);
-                        return false;
+                        return (state == status);
                 }
-        }
-        else {
-                string output;
-                output = buffer;
 
-                if (output.find("VMState=\"" + status + "\"") != string::npos) {
-                        return true;
+                // The state could not be read (e.g. the VM is locked)
+                LOG_ERROR("Checking if VM is " + status + " failed  " << retry.attempts() + 1 << " times!");
+                if (!retry.retry(Retry::classify(output))) {
+                        LOG_ERROR("Get " + status + " check from the VM has failed " << retry.attempts() << " times!");
+                        LOG_ERROR("Aborting the execution");
+                        remove();
                         boinc_end_critical_section();
-                }
-                else {
+                        Log::finish(1);
                         return false;
-                        boinc_end_critical_section();
                 }
-        
+                LOG_NOTICE("Resumming " + status + " check");
         }
-
 }
 
 void VM::start(bool vrde=false, bool headless=false) 
 {
+        Trace::Span span("VM::start");
         // Start the VM in headless mode
         boinc_begin_critical_section();
         string arg_list="";
-        char buffer[1024];
     
         if (headless) arg_list = " startvm " + virtual_machine_name + " --type headless";
         else arg_list = " startvm " + virtual_machine_name;
-        if (!vbm_popen(arg_list, buffer, sizeof(buffer))) {
-                start_err_number += 1;
-                cerr << "ERROR: Impossible to start the VM, seems to be locked " << start_err_number << " time" << endl;
 
-                if (debug_level >= 3 ) {
-                        cerr << "NOTICE: Waiting 2 seconds to unlock the VM" << endl;
+        // Left paused by a shutdown that had no time to save the state
+        string state, output;
+        bool resumed = false;
+        if (hypervisor->state(virtual_machine_name, state, output) && state == "paused") {
+                if (hypervisor->resume(virtual_machine_name, output)) {
+                        LOG_NOTICE("The VM was left paused by the last shutdown, resumed it");
+                        resumed = true;
                 }
-                boinc_sleep(2);
-    
-                if (start_err_number > 4) {
-                        cerr << "ERROR: Impossible to start the VM after " << start_err_number << " times" << endl;
-                        cerr << "ERROR: Removing the VM" << endl;
+                else {
+                        LOG_WARNING("Impossible to resume the VM left paused by the last shutdown");
+                        if (!output.empty()) LOG_WARNING(output);
+                }
+        }
+        span.arg("resumed", resumed ? "yes" : "no");
+        while (!resumed) {
+                string output;
+                if (hypervisor->start(virtual_machine_name, headless, output)) break;
+
+                // Two or more cores need VT-x/AMD-V: start again with one
+                if (n_cpus > 1 && no_vtx(output)) {
+                        disable_multicore("");
+                        continue;
+                }
+
+                start_err_number = start_retry.attempts() + 1;
+                LOG_ERROR("Impossible to start the VM, seems to be locked " << start_err_number << " time");
+                if (!start_retry.retry(Retry::classify(output))) {
+                        LOG_ERROR("Impossible to start the VM after " << start_err_number << " times");
+                        if (!output.empty()) LOG_ERROR(output);
+                        LOG_ERROR("Removing the VM");
                         remove();
                         boinc_end_critical_section();
-                        boinc_finish(1);
+                        Log::finish(1);
                 }
         }
-        else {
-                // Check if two or more cores can be used as Virtualization Extensions are required
+        start_retry.reset();
+        {
+                // VirtualBox starts a new VBox.log for every start
+                log_scanner.set_file(vbox_log_path());
+
+                // Follow VBox.log until the VM is running, or until it reports that
+                // Virtualization Extensions, required for two or more cores, are missing.
+                // With a single core the main loop keeps following the log instead.
+                Trace::Span scan_span("VBox.log VT-x scan");
                 if (n_cpus > 1) {
-                        #ifdef _WIN32
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: I'm running in a Windows system..." << endl;
-                        }
-                        string vmlog = getenv("HOMEDRIVE");
-                        vmlog += getenv("HOMEPATH");
-                        vmlog +=  "\\VirtualBox VMs\\" + virtual_machine_name + "\\Logs\\VBox.log";
-                        #else 
-                        // *nix systems
-                        string env = getenv("HOME");
-    
-                        string vmlog = env + "/VirtualBox VMs/" + virtual_machine_name + "/Logs/VBox.log";
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: I'm running in a *nix system..." << endl;
-                        }
-                        #endif
-                        // Give time to VBoxManage to report if Virtualization Extensions are enabled
-                        boinc_sleep(2);
-                        // Read the error file
-                        std::ifstream errors(vmlog.c_str());
-                        if (errors.is_open()) {
-                                string line;
-                                cerr << "INFO: Checking if it is possible to use two or more cores in the VM..." << endl;
-                                while (!errors.eof()) {
-                                        std::getline(errors,line);
-                                        if ((line.find("VERR_VMX_MSR_LOCKED_OR_DISABLED") != string::npos) || (line.find("VERR_SVM_DISABLED") != string::npos) || 
-                                            (line.find("VERR_VMX_NO_VMX") != string::npos)) {
-                                                cerr << "ERROR: Virtualization extensions are not supported, so multi-core extension has to be disabled!" << endl;
-                                                // Disabling the number of cores
-                                                string tmp;
-                                                boinc_sleep(5);
-                                                tmp = "modifyvm " + virtual_machine_name + " --cpus 1";
-                                                if (!vbm_popen(tmp)) {
-                                                        cerr << "ERROR: Disabling multi-core feature failed!" << endl;
-                                                        cerr << "ERROR: Aborting work unit" << endl;
-                                                        boinc_finish(1);
-                                                }       
-                                                else {
-                                                        n_cpus = 1;
-                                                        cerr << "INFO: Disabling multi-core feature worked! Re-starting VM..." << endl;
-                                                        vbm_popen(arg_list);
-                                                }
-                                                break;
-                                        }
+                        LOG_NOTICE("Following " << vbox_log_path() << " until the VM is running...");
+                }
+                double deadline = dtime() + LOGSCAN_START_TIMEOUT;
+                bool scanning = (n_cpus > 1) && !resumed;
+                while (scanning && dtime() < deadline) {
+                        std::vector<LogEvent> events;
+                        log_scanner.scan(events);
+                        for (size_t i = 0; i < events.size(); i++) {
+                                if (events[i].type == LOG_EVENT_VM_RUNNING) {
+                                        scan_span.arg("vtx", "available");
+                                        scanning = false;
+                                }
+                                else if (events[i].type == LOG_EVENT_NO_VTX) {
+                                        scan_span.arg("vtx", "unavailable");
+                                        scan_span.arg("signature", events[i].signature);
+                                        scanning = false;
+                                        disable_multicore(arg_list);
+                                        break;
+                                }
+                                else {
+                                        handle_log_event(events[i]);
                                 }
-                                cerr << "INFO: Finished the scan Virtualization Extensions" << endl;
-                                errors.close();
-                        }
-                        else {
-                                cerr << "ERROR: Impossible to read the VBox.log file!" << endl;
                         }
+                        if (scanning) boinc_sleep(LOGSCAN_PERIOD);
+                }
+                if (scanning) {
+                        LOG_WARNING("VBox.log did not report the VM as running after " << LOGSCAN_START_TIMEOUT << " seconds");
                 }
 
                 // Resetting the error counter
                 start_err_number = 0;
-                if (debug_level >=3) cerr << "NOTICE: VM has been started!" << endl;
+                LOG_NOTICE("VM has been started!");
     
                 // Enable or disable VRDP for the VM: (by default is disabled)
                 if (vrde) {
@@ -531,38 +519,139 @@ void VM::start(bool vrde=false, bool headless=false)
                 }
     
                 throttle();
+                balloon.attach(virtual_machine_name);
+                io_throttle.attach(virtual_machine_name);
         }
         boinc_end_critical_section();
 }
 
-void VM::pause() 
+// Path of the log of the current VM session
+string VM::vbox_log_path()
 {
+        #ifdef _WIN32
+        string vmlog = getenv("HOMEDRIVE");
+        vmlog += getenv("HOMEPATH");
+        vmlog +=  "\\VirtualBox VMs\\" + virtual_machine_name + "\\Logs\\VBox.log";
+        #else 
+        // *nix systems
+        string env = getenv("HOME");
+        string vmlog = env + "/VirtualBox VMs/" + virtual_machine_name + "/Logs/VBox.log";
+        #endif
+        return vmlog;
+}
 
-        boinc_begin_critical_section();
-        string pause_cmd = "controlvm " + virtual_machine_name + " pause";
-        int i = 0;
-        bool failed = true;
-        // Try to Pause the VM for 10 times
-        for (i;i<=9;i++) {
-                vbm_popen(pause_cmd);
-
-                if (is_status("paused")) {
-                        cerr << "INFO: VM paused!" << endl;
-                        suspended = true;
-                        time_t current_time = time(NULL);
-                        current_period += difftime (current_time, last_poll_point);
-                        failed = false;
-                        break;
+// Whether a failed startvm was caused by missing Virtualization Extensions,
+// from its output or from the VBox.log of the attempt
+bool VM::no_vtx(const string &output)
+{
+        if (log_scanner.matches(output, LOG_EVENT_NO_VTX)) return true;
+        log_scanner.set_file(vbox_log_path());
+        std::vector<LogEvent> events;
+        log_scanner.scan(events);
+        for (size_t i = 0; i < events.size(); i++) {
+                if (events[i].type == LOG_EVENT_NO_VTX) return true;
+        }
+        return false;
+}
+
+// The VM failed to start because Virtualization Extensions are not available:
+// run it with a single core. It is started again with start_cmd, unless it
+// is empty.
+void VM::disable_multicore(string start_cmd)
+{
+        LOG_ERROR("Virtualization extensions are not supported, so multi-core extension has to be disabled!");
+
+        // Wait for the failed VM process to go away before changing the VM
+        for (int i = 0; i < 10; i++) {
+                if (!is_status("running") && !is_status("starting")) break;
+                boinc_sleep(0.5);
+        }
+
+        string tmp = "modifyvm " + virtual_machine_name + " --cpus 1";
+        if (!vbm_popen(tmp)) {
+                LOG_ERROR("Disabling multi-core feature failed!");
+                LOG_ERROR("Aborting work unit");
+                Log::finish(1);
+        }       
+        else {
+                n_cpus = 1;
+                LOG_NOTICE("Disabling multi-core feature worked! Re-starting VM...");
+                log_scanner.rewind();
+                if (!start_cmd.empty()) vbm_popen(start_cmd);
+        }
+}
+
+// Read what VirtualBox has appended to VBox.log since the last call and react to it
+// Returns whether VBox.log had something to report
+bool VM::check_log()
+{
+        std::vector<LogEvent> events;
+        log_scanner.scan(events);
+        for (size_t i = 0; i < events.size(); i++) {
+                handle_log_event(events[i]);
+        }
+        return !events.empty();
+}
+
+void VM::handle_log_event(const LogEvent &event)
+{
+        Trace::instant("VBox.log", event.line);
+        switch (event.type) {
+        case LOG_EVENT_GURU_MEDITATION:
+        case LOG_EVENT_GUEST_PANIC:
+                LOG_ERROR("VBox.log reports that the VM has crashed: " << event.line);
+                LOG_ERROR("Powering off the VM and trying again in 5 minutes");
+                vbm_popen("controlvm " + virtual_machine_name + " poweroff");
+                Log::temporary_exit(Retry::exit_delay(300));
+                break;
+        case LOG_EVENT_VBOX_ERROR:
+                LOG_WARNING("VBox.log: " << event.line);
+                break;
+        default:
+                LOG_INFO("VBox.log: " << event.line);
+                break;
+        }
+}
+
+// Run "controlvm <vm> <action>" until the VM reaches the expected state.
+// Returns false when the retry policy gives up.
+bool VM::control(string action, string expected_state)
+{
+        RetryState retry(RETRY_CONTROL);
+
+        for (;;) {
+                string output;
+                hypervisor->control(virtual_machine_name, action, output);
+
+                if (is_status(expected_state)) {
+                        retry.reset();
+                        return true;
                 }
-                else {
-                        cerr << "WARNING: The VM has not been paused yet. Retrying..." << endl;
-                        boinc_sleep(2);
+
+                LOG_WARNING("The VM is not " << expected_state << " yet. Retrying...");
+                if (!retry.retry(Retry::classify(output))) {
+                        LOG_WARNING("The VM is not " << expected_state << " after " << retry.attempts() << " tries!");
+                        if (!output.empty()) LOG_WARNING(output);
+                        return false;
                 }
         }
-        if (failed) {
-                cerr << "WARNING: The VM has not been paused after 10 times!" << endl;
-                cerr << "WARNING: BOINC_TEMPORARY_EXIT issued!" << endl;
-                boinc_temporary_exit(0);
+}
+
+void VM::pause() 
+{
+        Trace::Span span("VM::pause");
+
+        boinc_begin_critical_section();
+        if (control("pause", "paused")) {
+                LOG_NOTICE("VM paused!");
+                suspended = true;
+                Snapshot::set_vm_state("paused");
+                time_t current_time = time(NULL);
+                current_period += difftime (current_time, last_poll_point);
+        }
+        else {
+                LOG_WARNING("BOINC_TEMPORARY_EXIT issued!");
+                Log::temporary_exit(0);
         }
 
         boinc_end_critical_section();
@@ -570,49 +659,38 @@ void VM::pause()
 
 void VM::resume() 
 {
+        Trace::Span span("VM::resume");
         boinc_begin_critical_section();
         if (is_status("paused")) {
-                string arg_list("controlvm " + virtual_machine_name + " resume");
-                int i = 0;
-                bool failed = true;
-                // Try to resume the VM 10 times
-                for (i;i<=9;i++) {
-                        vbm_popen(arg_list);
-                        if (is_status("running")) {
-                                cerr << "INFO: VM resumed!" << endl;
-                                suspended = false;
-                                last_poll_point = time(NULL);
-                                failed = false;
-                                boinc_end_critical_section();
-                                break;
-                        }
-                        else {
-                                cerr << "WARNING: VM has not been resumed yet. Retrying..." << endl;
-                                boinc_sleep(2);
-                        }
+                if (control("resume", "running")) {
+                        LOG_NOTICE("VM resumed!");
+                        suspended = false;
+                        Snapshot::set_vm_state("running");
+                        last_poll_point = time(NULL);
+                        boinc_end_critical_section();
                 }
-
-                if (failed) {
-                        cerr << "WARNING: The VM has not been resumed after 10 tries!" << endl;
-                        cerr << "WARNING: BOINC_TEMPORARY_EXIT issued!" << endl;
-                        cerr << "WARNING: Trying again in 5 minutes!" << endl;
+                else {
+                        int delay = Retry::exit_delay(300);
+                        LOG_WARNING("BOINC_TEMPORARY_EXIT issued!");
+                        LOG_WARNING("Trying again in " << delay << " seconds!");
                         boinc_end_critical_section();
-                        boinc_temporary_exit(300);
+                        Log::temporary_exit(delay);
                 }
         }
         else {
-                cerr << "INFO: VM is not paused, so it is impossible to resume it!" << endl;
-                cerr << "INFO: Checking if the VM is saved, so we can start it again..." << endl;
+                LOG_NOTICE("VM is not paused, so it is impossible to resume it!");
+                LOG_NOTICE("Checking if the VM is saved, so we can start it again...");
 
                 if (is_status("saved")) {
-                        cerr << "INFO: VM is saved, while it should be suspend!" << endl;
-                        cerr << "INFO: Restarting VM in any case..." << endl;
-                        boinc_temporary_exit(30);
+                        LOG_NOTICE("VM is saved, while it should be suspend!");
+                        LOG_NOTICE("Restarting VM in any case...");
+                        Log::temporary_exit(Retry::exit_delay(30));
                 }
                 else {
-                        cerr << "INFO: VM is not saved or paused, so something went wrong..." << endl;
-                        cerr << "INFO: Retrying in 5 minutes to check everything again!" << endl;
-                        boinc_temporary_exit(300);
+                        int delay = Retry::exit_delay(300);
+                        LOG_NOTICE("VM is not saved or paused, so something went wrong...");
+                        LOG_NOTICE("Retrying in " << delay << " seconds to check everything again!");
+                        Log::temporary_exit(delay);
                 }
                 boinc_end_critical_section();
         }
@@ -622,34 +700,110 @@ void VM::resume()
 
 void VM::savestate()
 {
+        Trace::Span span("VM::savestate");
         boinc_begin_critical_section();
-        string savestate_cmd = "controlvm " + virtual_machine_name + " savestate";
-        int i = 0;
-        bool failed = true;
-        // First try to save the state of the VM (sometimes may fail because the VM is locked)
-        for (i;i<=9;i++) {
-                vbm_popen(savestate_cmd);
+        // The process of the VM ends with it: keep its last CPU time
+        if (CpuTime::update()) CpuTime::save();
+        Helper::save_progress();
+        // Saving the state sometimes fails because the VM is locked
+        double begin = dtime();
+        if (control("savestate", "saved")) {
+                LOG_NOTICE("VM state saved!");
+                Shutdown::record(dtime() - begin);
+        }
+        else {
+                LOG_WARNING("BOINC_TEMPORARY_EXIT!");
+                Log::temporary_exit(0);
+        }
 
-                if (is_status("saved")) {
-                        cerr << "INFO: VM state saved!" << endl;
-                        failed = false;
-                        break;
-                }
-                else {
-                        cerr << "WARNING: The VM has not been saved yet. Retrying..." << endl;
+        boinc_end_critical_section();
+}
+
+// Stop the VM before deadline (a dtime()), when the client asks the wrapper
+// to quit. The state is saved if the saves timed so far fit in the time
+// left, otherwise, or if the save fails, the VM is only paused: a save
+// killed half way would leave a corrupt state, a paused VM is resumed by
+// the next start().
+void VM::shutdown(double deadline)
+{
+        Trace::Span span("VM::shutdown");
+        boinc_begin_critical_section();
+        if (CpuTime::update()) CpuTime::save();
+        Helper::save_progress();
+
+        double left = deadline - dtime() - SHUTDOWN_MARGIN;
+        double expected = Shutdown::estimate(balloon.ceiling_mb);
+        span.arg("left", left);
+        span.arg("expected", expected);
+        if (expected <= left) {
+                LOG_NOTICE("Saving the state of the VM (" << expected << " s expected, " << (int)left << " s left)");
+                if (save_monitored(deadline)) {
+                        span.arg("action", "savestate");
+                        boinc_end_critical_section();
+                        return;
                 }
+                LOG_WARNING("Saving the state of the VM failed, pausing it instead");
         }
-        if (failed) {
-                cerr << "WARNING: The VM has not been saved after 10 tries!" << endl;
-                cerr << "WARNING: BOINC_TEMPORARY_EXIT!" << endl;
-                boinc_temporary_exit(0);
+        else {
+                LOG_NOTICE("No time to save the state of the VM (" << expected << " s expected, " << (int)left
+                           << " s left), pausing it instead");
         }
 
+        span.arg("action", "pause");
+        for (;;) {
+                string state, output;
+                if (hypervisor->state(virtual_machine_name, state, output) && state == "paused") {
+                        LOG_NOTICE("VM paused, it will be resumed by the next start");
+                        suspended = true;
+                        Snapshot::set_vm_state("paused");
+                        break;
+                }
+                if (state == "saved" || state == "poweroff" || state == "aborted") break;
+                if (dtime() + SHUTDOWN_MONITOR_PERIOD > deadline) {
+                        LOG_WARNING("The VM could not be paused before the deadline");
+                        break;
+                }
+                hypervisor->pause(virtual_machine_name, output);
+                boinc_sleep(SHUTDOWN_MONITOR_PERIOD);
+        }
         boinc_end_critical_section();
 }
 
+// One savestate, followed by a thread that logs how much of the state is
+// written. Records how long it took.
+bool VM::save_monitored(double deadline)
+{
+        string state, output;
+        Shutdown::Monitor monitor;
+        if (hypervisor->state(virtual_machine_name, state, output)) {
+                size_t begin = output.find("SnapFldr=\"");
+                size_t end = (begin == string::npos) ? string::npos : output.find('"', begin + 10);
+                if (end != string::npos) monitor.folder = output.substr(begin + 10, end - begin - 10);
+        }
+        if (state == "saved") return true;
+        monitor.expected_bytes = balloon.ceiling_mb * 1024.0 * 1024;
+        monitor.begin = dtime();
+        monitor.deadline = deadline;
+        monitor.stop = 0;
+        Threads::Handle handle;
+        bool monitoring = Threads::spawn(handle, Shutdown::monitor, &monitor);
+
+        hypervisor->savestate(virtual_machine_name, output);
+        bool saved = hypervisor->state(virtual_machine_name, state, output) && state == "saved";
+
+        monitor.stop = 1;
+        if (monitoring) Threads::join(handle);
+        if (!saved) return false;
+        double secs = dtime() - monitor.begin;
+        LOG_NOTICE("VM state saved in " << secs << " s");
+        Shutdown::record(secs);
+        Snapshot::set_vm_state("saved");
+        return true;
+}
+
 void VM::remove() 
 {
+        Trace::Span span("VM::remove");
         boinc_begin_critical_section();
         string arg_list, vminfo, vboxfolder, vboxXML, vboxXMLNew, vmfolder, vmdisk;
         char *env;
@@ -657,54 +811,38 @@ void VM::remove()
     
         arg_list = " discardstate " + virtual_machine_name;
         if (vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: VM state discarded!" << endl;
-                }
+                LOG_NOTICE("VM state discarded!");
         }
         else {
-                if (debug_level >= 2) {
-                        cerr << "WARNING: it was not possible to discard the state of the VM" << endl;
-                }
+                LOG_WARNING("it was not possible to discard the state of the VM");
         }
     
         // Wait to allow to discard the VM state cleanly
         boinc_sleep(2);
 
         // Unregistervm command with --delete option. VBox 4.1 should work well
-        arg_list.clear();
-        arg_list = " unregistervm " + virtual_machine_name + " --delete";
-        if (vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: VM removed via VBoxManage" << endl;
-                }
+        if (hypervisor->remove(virtual_machine_name)) {
+                LOG_NOTICE("VM removed via VBoxManage");
         }
         else {
-            if (debug_level >= 2) {
-                    cerr << "WARNING: The VM could not be removed via VBoxManage" << endl;
-            }
+            LOG_WARNING("The VM could not be removed via VBoxManage");
         }
         
         // We test if we can remove the hard disk controller. If the command works, the cernvm.vmdk virtual disk will be also
         // removed automatically
     
         arg_list.clear();
-        arg_list = " storagectl  " + virtual_machine_name + " --name \"IDE Controller\" --remove";
+        arg_list = " storagectl  " + virtual_machine_name + " --name \"" + storage.controller_name() + "\" --remove";
         if (vbm_popen(arg_list)) {
-            if (debug_level >= 3) {
-                    cerr << "NOTICE: Hard disk removed!" << endl;
-            }
+            LOG_NOTICE("Hard disk removed!");
         }
         else {
-                if (debug_level >= 2) {
-                        cerr << "WARNING: it was not possible to remove the IDE controller" << endl;
-                }
+                LOG_WARNING("it was not possible to remove the " << storage.controller_name());
         } 
     
         #ifdef _WIN32
     	env = getenv("HOMEDRIVE");
-    	if (debug_level >= 3) {
-                cerr << "NOTICE: I'm running in a Windows system..." << endl;
-        }
+    	LOG_NOTICE("I'm running in a Windows system...");
     	vboxXML = string(env);
     	env = getenv("HOMEPATH");
     	vboxXML = vboxXML + string(env);
@@ -719,17 +857,13 @@ void VM::remove()
             // GNU/Linux
             vboxXML = vboxXML + "/.VirtualBox/VirtualBox.xml";
             vboxfolder = string(env) + "/.VirtualBox/";
-            if (debug_level >= 3) {
-                    cerr << "NOTICE: I'm running in a GNU/Linux system..." << endl;
-            }
+            LOG_NOTICE("I'm running in a GNU/Linux system...");
         }
         else {
             // Mac OS X
             vboxXML = vboxXML + "/Library/VirtualBox/VirtualBox.xml";
             vboxfolder = string(env) + "/Library/VirtualBox/";
-            if (debug_level >= 3) {
-                    cerr << "NOTICE: I'm running in a Mac OS X system..." << endl;
-            }
+            LOG_NOTICE("I'm running in a Mac OS X system...");
         }
         #endif
     
@@ -748,19 +882,13 @@ void VM::remove()
                                 out << line + "\n";
                         else {
                                 vmRegistered = true; 
-                                if (debug_level >= 3) {
-                                        cerr << "NOTICE: Obtaining the VM folder..." << endl;
-                                }
+                                LOG_NOTICE("Obtaining the VM folder...");
                                 found_init = line.find("src=");
                                 found_end = line.find(virtual_machine_name + ".vbox");
                                 if (found_end != string::npos)
-                                    if (debug_level >= 3) {
-                                            cerr << "NOTICE: .vbox found at line: " << line_n << " in the VirtualBox.xml file" << endl;
-                                    }
+                                    LOG_NOTICE(".vbox found at line: " << line_n << " in the VirtualBox.xml file");
                                 vmfolder = line.substr(found_init + 5, found_end - (found_init+5));
-                                if (debug_level >= 3) {
-                                        cerr << "NOTICE: Done!" << endl;
-                                }
+                                LOG_NOTICE("Done!");
                         }
                         line_n +=1;
                 }
@@ -771,31 +899,27 @@ void VM::remove()
         // When the project is reset, we have to first unregister the VM, else we will have an error.
         arg_list = "unregistervm " + virtual_machine_name;
         if (!vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: CernVM does not exist, so it is not necessary to unregister it" << endl;
-                }
+                LOG_NOTICE("CernVM does not exist, so it is not necessary to unregister it");
         }
         else {
-            if (debug_level >= 3) {
-                    cerr << "NOTICE: Successfully unregistered the CernVM" << endl;
-            }
+            LOG_NOTICE("Successfully unregistered the CernVM");
         }
 
         // Create a backup of old VirtualBox.xml and replace it with the new one
-        cerr << "==========================================================" << endl;
-        cerr << "INFO: Backing up previous VirtualBox.xml configuration ..." << endl;
+        LOG_MSG("==========================================================");
+        LOG_NOTICE("Backing up previous VirtualBox.xml configuration ...");
         string backup = vboxXML + ".bak";
         std::ifstream f(backup.c_str());
         if (f.is_open()) {
-                cerr << "WARNING: VirtualBox.xml.bak already exists, skipping this step" << endl;
+                LOG_WARNING("VirtualBox.xml.bak already exists, skipping this step");
                 f.close();
         }
         else {
                 std::rename(vboxXML.c_str(), backup.c_str());
-                cerr << "Backup Done! VirtualBox.xml.bak created with previous set up" << endl;
+                LOG_MSG("Backup Done! VirtualBox.xml.bak created with previous set up");
 
         }
-        cerr << "==========================================================" << endl;
+        LOG_MSG("==========================================================");
         // Delete old VirtualBox.xml as a backup has been created
         std::remove(vboxXML.c_str());
         // Rename the clean and new VirtualBox.xml configuration
@@ -806,30 +930,20 @@ void VM::remove()
     	if (vmRegistered) {
     	        vmfolder = "RMDIR \"" + vmfolder + "\" /s /q";
     	        if (system(vmfolder.c_str()) == 0) {
-    			if (debug_level >= 3) {
-                                cerr << "NOTICE: VM folder deleted!" << endl;
-                        }
+    			LOG_NOTICE("VM folder deleted!");
                 }
     		else {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: System was clean, nothing to delete" << endl;
-                        }
+                        LOG_NOTICE("System was clean, nothing to delete");
                 }
     	}
         else {
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: VM was not registered, deleting old VM folders..." << endl;
-                }
+                LOG_NOTICE("VM was not registered, deleting old VM folders...");
                 vmfolder = "RMDIR \"" + vboxfolder + virtual_machine_name + "\" /s /q";
                 if (system(vmfolder.c_str()) == 0) {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: VM folder deleted!" << endl;
-                        }
+                        LOG_NOTICE("VM folder deleted!");
                 }
                 else {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: System was clean, nothing to delete" << endl;
-                        }
+                        LOG_NOTICE("System was clean, nothing to delete");
                 }
         }
     
@@ -838,85 +952,71 @@ void VM::remove()
         if (vmRegistered) {
                 vmfolder = "rm -rf \"" + vmfolder + "\"";
                 if (system(vmfolder.c_str()) == 0) {
-                    if (debug_level >= 3) {
-                            cerr << "NOTICE: VM folder deleted!" << endl;
-                    }
+                    LOG_NOTICE("VM folder deleted!");
                 }
                 else {
-                    if (debug_level >= 3) {
-                            cerr << "NOTICE: System was clean, nothing to delete" << endl;
-                    }
+                    LOG_NOTICE("System was clean, nothing to delete");
                 }
         }
         else {
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: VM was not registered, deleting old VM folders..." << endl;
-                }
+                LOG_NOTICE("VM was not registered, deleting old VM folders...");
                 vmfolder = "rm -rf \"" + string(env) + "/VirtualBox VMs/" + virtual_machine_name + "\" ";
                 if ( system(vmfolder.c_str()) == 0 ) {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: VM folder deleted!" << endl; 
-                        }
+                        LOG_NOTICE("VM folder deleted!");
                 }
                 else {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: System was clean, nothing to delete" << endl;
-                        }
+                        LOG_NOTICE("System was clean, nothing to delete");
                 }
         }
         #endif
+        Journal::record("removed");
         boinc_end_critical_section();
 }
     
 void VM::release()
 {
+    Trace::Span span("VM::release");
     boinc_begin_critical_section();
     string arg_list("closemedium disk " + disk_path);
     if(!vbm_popen(arg_list)) {
-            cerr << "ERROR: It was impossible to release the virtual hard disk" << endl;
+            LOG_ERROR("It was impossible to release the virtual hard disk");
     }
     else {
-            if (debug_level >= 3) {
-                    cerr << "NOTICE: Virtual hard disk unregistered" << endl;
-            }
+            LOG_NOTICE("Virtual hard disk unregistered");
     }
     boinc_end_critical_section();
 }
 
 void VM::poll() 
 {
+    Trace::Span span("VM::poll");
     boinc_begin_critical_section();
-    string arg_list, status;
-    char buffer[1024];
+    string status, output;
     time_t current_time;
     
-    arg_list = "showvminfo " + virtual_machine_name + " --machinereadable";
-    if (!vbm_popen(arg_list, buffer, sizeof(buffer))) {
-            // Increase the number of errors
-            double wait_time = 5.0;
-            poll_err_number += 1;
-            cerr << "ERROR: Get status from VM failed " << poll_err_number << " times!" << endl;
-            if (debug_level >= 3) {
-                    cerr << "WARNING: Sleeping poll for " << wait_time << " seconds" << endl;
-            }
-            boinc_sleep(wait_time);
-            if (debug_level >= 3) {
-                    cerr << "INFO: Resumming poll" << endl;
-            } 
-            if (poll_err_number > 4) {
-                    cerr << "ERROR: Get status from the VM has failed " << poll_err_number << " times!" << endl;
-                    cerr << "ERROR: Aborting the execution" << endl;
+    if (!hypervisor->state(virtual_machine_name, status, output)) {
+            // Increase the number of errors, the retry policy decides how long to wait
+            poll_err_number = poll_retry.attempts() + 1;
+            LOG_ERROR("Get status from VM failed " << poll_err_number << " times!");
+            span.arg("errors", (double)poll_err_number);
+            if (!poll_retry.retry(Retry::classify(output))) {
+                    LOG_ERROR("Get status from the VM has failed " << poll_err_number << " times!");
+                    LOG_ERROR("Aborting the execution");
                     remove();
                     boinc_end_critical_section();
-                    boinc_finish(1);
+                    Log::finish(1);
             }
+            LOG_NOTICE("Resumming poll");
+            boinc_end_critical_section();
     }
     else {
             // Each time we read the status we reset the counter of errors
             poll_err_number = 0;
+            poll_retry.reset();
 
-            status = buffer;
-            if (status.find("VMState=\"running\"") != string::npos) {
+            if (status == "running") {
+                    span.arg("state", "running");
+                    Snapshot::set_vm_state("running");
                     if (suspended) {
                             suspended = false;
                             last_poll_point = time(NULL);
@@ -925,100 +1025,301 @@ void VM::poll()
                             current_time = time(NULL);
                             current_period += difftime (current_time,last_poll_point);
                             last_poll_point = current_time;
-                            if (debug_level >= 4) {
-                                    cerr << "INFO: VM poll is running" << endl;
-                            }
+                            LOG_INFO("VM poll is running");
                     }
 
                     boinc_end_critical_section();
 
                     // Reset poweroff error counter, as the VM is running:
-                    if ((debug_level >= 3) && (poweroff_err_number > 0)) {
-                            cerr << "NOTICE: Resetting poweroff counter!" << endl;
-                            cerr << "NOTICE: Virtual Machine up and running again" << endl;
+                    if (poweroff_err_number > 0) {
+                            LOG_NOTICE("Resetting poweroff counter!");
+                            LOG_NOTICE("Virtual Machine up and running again");
                     }
 
                     poweroff_err_number = 0;
+                    poweroff_retry.reset();
                     return;
             } 
 
-            if (status.find("VMState=\"paused\"") != string::npos) {
+            if (status == "paused") {
+                    span.arg("state", "paused");
+                    Snapshot::set_vm_state("paused");
                     if (!suspended) {
                             suspended = true;
                             time_t current_time = time(NULL);
                             current_period += difftime (current_time, last_poll_point);
                     }
 
-                    if (debug_level >= 3) {
-                            cerr << "NOTICE: VM is paused!" << endl;
-                    }
+                    LOG_NOTICE("VM is paused!");
                     boinc_end_critical_section();
                     return;
             }
 
-            if (status.find("VMState=\"poweroff\"") != string::npos) {
-                    poweroff_err_number += 1;
-                    if (debug_level >= 3) {
-                            cerr << "WARNING: VM is powered off and it shouldn't (" << poweroff_err_number << " times!)" << endl;
-                            cerr << "WARNING: Retrying in 2 seconds" << endl;
-                    }
-                    boinc_sleep(2);
+            if (status == "poweroff") {
+                    span.arg("state", "poweroff");
+                    Snapshot::set_vm_state("poweroff");
+                    poweroff_err_number = poweroff_retry.attempts() + 1;
+                    LOG_WARNING("VM is powered off and it shouldn't (" << poweroff_err_number << " times!)");
+                    bool retry = poweroff_retry.retry();
                     boinc_end_critical_section();
 
-                    if (poweroff_err_number > 4) {
-                            cerr << "ERROR: VM has been powered off for the last " << poweroff_err_number << " poll calls!" << endl;
-                            cerr << "ERROR: Cancelling Work Unit!" << endl;
-                            boinc_finish(1);
+                    if (!retry) {
+                            LOG_ERROR("VM has been powered off for the last " << poweroff_err_number << " poll calls!");
+                            LOG_ERROR("Cancelling Work Unit!");
+                            Log::finish(1);
                     }
+                    return;
             }
+            boinc_end_critical_section();
     }
 }
 
+// State shared by the first-start pipeline stages
+struct StartupPipeline {
+        VM *vm;
+        Journal::State *done;
+        string image;
+        string disk_part;
+        int unzip_retval;
+        bool config_failed;     // the VM could not be configured
+        unsigned int crc;
+        double config_secs;
+        double unzip_secs;
+};
+
+void pipeline_config(void *arg)
+{
+        StartupPipeline *p = static_cast<StartupPipeline *>(arg);
+        Trace::Span span("clean up and configure VM");
+        double t0 = dtime();
+
+        if (p->done->configured) {
+                // Registered and configured before the wrapper was restarted.
+                // Only the floppy image may have to be created again.
+                if (!p->done->storage.empty()) p->vm->storage.bus = p->done->storage;
+                std::ifstream floppy(p->done->floppy_name.c_str());
+                if (!floppy.is_open()) {
+                        LOG_NOTICE("Floppy image " << p->done->floppy_name << " is missing, attaching a new one");
+                        p->config_failed = !p->vm->attach_floppy();
+                }
+        }
+        else {
+                // Old VMs have to be gone before the new one is registered with the same name
+                p->vm->remove();
+                p->config_failed = !p->vm->create_config();
+        }
+        p->config_secs = dtime() - t0;
+}
+
+void pipeline_checkpoint(long long bytes, unsigned int crc)
+{
+        std::ostringstream offset;
+        offset << bytes;
+        Journal::Fields fields;
+        fields["offset"] = offset.str();
+        fields["crc32c"] = Journal::hex(crc);
+        Journal::record("unzip", fields);
+}
+
+void pipeline_unzip(void *arg)
+{
+        StartupPipeline *p = static_cast<StartupPipeline *>(arg);
+        double t0 = dtime();
+
+        p->crc = p->done->unzip_crc;
+        if (p->done->unzipped) return;
+
+        Trace::Span span("Helper::unzip");
+        span.arg("image", p->image);
+        span.arg("resume_offset", (double)p->done->unzip_offset);
+        if (p->done->unzip_offset) {
+                LOG_NOTICE("Resuming the decompression after " << p->done->unzip_offset << " bytes");
+        }
+        p->unzip_retval = Helper::unzip(p->image.c_str(), p->disk_part.c_str(), 
+                                        p->done->unzip_offset, pipeline_checkpoint, &p->crc);
+        span.arg("retval", (double)p->unzip_retval);
+        span.arg("crc32c", Journal::hex(p->crc));
+        if (!p->unzip_retval) Journal::record("unzipped", "crc32c", Journal::hex(p->crc));
+        p->unzip_secs += dtime() - t0;
+}
+
+// Compare the CRC32C computed while decompressing with the manifest of the
+// work unit. Returns false if the disk is corrupt.
+bool pipeline_verify(StartupPipeline *p)
+{
+        string manifest_path;
+        Image::Manifest manifest;
+        if (p->done->verified) return true;
+        if (boinc_resolve_filename_s(IMAGE_MANIFEST_FN, manifest_path) ||
+            !Image::read_manifest(manifest_path.c_str(), manifest)) {
+                LOG_NOTICE("No " << IMAGE_MANIFEST_FN << " in the work unit, the disk is not verified");
+                return true;
+        }
+
+        Trace::Span span("verify disk");
+        long long size;
+        if (!Helper::file_size(p->disk_part, size) && !Helper::file_size(p->vm->disk_name, size)) size = 0;
+        bool ok = (p->crc == manifest.crc32c) && (!manifest.has_size || (double)size == manifest.size);
+        span.arg("ok", ok ? "true" : "false");
+        if (!ok) {
+                LOG_ERROR("The decompressed disk is corrupt: CRC32C " << Journal::hex(p->crc) << " and " << size
+                          << " bytes, the manifest expects " << Journal::hex(manifest.crc32c) << " and " << manifest.size << " bytes");
+                return false;
+        }
+        LOG_NOTICE("Disk verified, CRC32C " << Journal::hex(p->crc));
+        Journal::record("verified", "crc32c", Journal::hex(p->crc));
+        p->done->verified = true;
+        return true;
+}
+
+// Create a brand new VM from the compressed image.
+// Cleaning old VMs and building the VM configuration run at the same time as the
+// decompression, and the disk is only attached when both have finished.
+// The image is decompressed to a temporary name, as unregistervm --delete may
+// remove a disk with the final name that was still attached to an old VM.
+// Every step goes to the journal, and the steps already done by an
+// interrupted run of the wrapper are skipped.
+void create_pipelined(VM& vm, string image)
+{
+        Trace::Span span("create_pipelined");
+        StartupPipeline p;
+        Journal::State done;
+        Threads::Handle config_thread;
+        bool threaded;
+        double t0 = dtime();
+
+        long long image_size;
+        if (!Helper::file_size(image, image_size)) image_size = 0;
+        if (Journal::replay(done) && (done.vm_name == vm.virtual_machine_name) &&
+            (done.image == image) && (done.image_size == image_size)) {
+                LOG_NOTICE("Resuming the creation of the VM, already done:" << Journal::describe(done));
+                span.arg("resumed", Journal::describe(done));
+        }
+        else {
+                done = Journal::State();
+                Journal::reset();
+                std::ostringstream size;
+                size << image_size;
+                Journal::Fields fields;
+                fields["vm"] = vm.virtual_machine_name;
+                fields["image"] = image;
+                fields["size"] = size.str();
+                Journal::record("begin", fields);
+        }
+
+        p.vm = &vm;
+        p.done = &done;
+        p.image = image;
+        p.disk_part = vm.disk_name + ".part";
+        p.unzip_retval = 0;
+        p.config_failed = false;
+        p.crc = 0;
+        p.config_secs = 0;
+        p.unzip_secs = 0;
+
+        threaded = Threads::spawn(config_thread, pipeline_config, &p);
+        if (!threaded) {
+                LOG_WARNING("Impossible to create the startup thread, running the steps one after another");
+        }
+
+        pipeline_unzip(&p);
+
+        if (threaded) Threads::join(config_thread);
+        else pipeline_config(&p);
+
+        // Only the main thread ends the work unit, once the disk is no longer written
+        if (p.config_failed) {
+                LOG_ERROR("Configuring the VM failed! Aborting");
+                vm.remove();
+                std::remove(p.disk_part.c_str());
+                Log::finish(1);
+        }
+
+        if (p.unzip_retval) {
+                LOG_ERROR("Decompressing " << image << " failed! Aborting");
+                vm.remove();
+                std::remove(p.disk_part.c_str());
+                Log::finish(1);
+        }
+
+        // A torn write is repaired by decompressing once more, a second
+        // mismatch means the image itself is bad
+        if (!done.attached && !pipeline_verify(&p)) {
+                LOG_WARNING("Decompressing the image again");
+                Journal::record("corrupt");
+                done.unzipped = false;
+                done.unzip_offset = 0;
+                done.unzip_crc = 0;
+                pipeline_unzip(&p);
+                if (p.unzip_retval || !pipeline_verify(&p)) {
+                        LOG_ERROR("The image " << image << " is corrupt! Aborting");
+                        vm.remove();
+                        std::remove(p.disk_part.c_str());
+                        Log::finish(1);
+                }
+        }
+
+        if (done.attached) {
+                // Only the VMName file was missing
+                vm.save_name();
+        }
+        else {
+                std::ifstream part(p.disk_part.c_str());
+                bool renamed = done.unzipped && !part.is_open();
+                part.close();
+                if (!renamed) {
+                        std::remove(vm.disk_name.c_str());
+                        if (std::rename(p.disk_part.c_str(), vm.disk_name.c_str())) {
+                                LOG_ERROR("Renaming " << p.disk_part << " to " << vm.disk_name << " failed! Aborting");
+                                vm.remove();
+                                Log::finish(1);
+                        }
+                }
+                LOG_MSG("Virtual Disk uncompressed. Attaching it to the VM");
+
+                vm.attach_disk();
+        }
+
+        LOG_NOTICE("VM clean up and configuration took " << p.config_secs << " seconds");
+        LOG_NOTICE("Decompression took " << p.unzip_secs << " seconds");
+        LOG_NOTICE("VM created in " << dtime() - t0 << " seconds");
+}
+
 void poll_boinc_messages(VM& vm, BOINC_STATUS &status) 
 {
         if (status.reread_init_data_file) {
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: Project preferences have changed" << endl;
-                }
+                LOG_NOTICE("Project preferences have changed");
                 // Revert back the status to false
                 status.reread_init_data_file = false;
                 vm.throttle();
+                // throttle() has reread init_data.xml
+                Snapshot::set_init_data(aid);
         }
 
         if (status.no_heartbeat) {
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: BOINC no_heartbeat" << endl;
-                }
-                vm.savestate();
-                boinc_temporary_exit(0);
+                LOG_NOTICE("BOINC no_heartbeat");
+                vm.shutdown(dtime() + SHUTDOWN_QUIT_DEADLINE);
+                Log::temporary_exit(0);
         }
 
         if (status.quit_request) {
-                if (vm.debug_level >= 3) {
-                        cerr << "NOTICE: Suspending the VM" << endl;
-                }
-                vm.savestate();
-                boinc_temporary_exit(0);
+                LOG_NOTICE("Suspending the VM");
+                vm.shutdown(dtime() + SHUTDOWN_QUIT_DEADLINE);
+                Log::temporary_exit(0);
         }
 
         if (status.abort_request) {
-                if (vm.debug_level >= 3) {
-                        cerr << "WARNING: User request to abort the WU" << endl;
-                }
+                LOG_WARNING("User request to abort the WU");
                 vm.savestate();
                 vm.remove();
-                boinc_finish(EXIT_ABORTED_BY_CLIENT);
+                Log::finish(EXIT_ABORTED_BY_CLIENT);
         }
 
         if (status.suspended) {
-                if (vm.debug_level >= 4) {
-                        cerr << "INFO: Pausing the VM!" << endl;
-                }
+                LOG_INFO("Pausing the VM!");
                 if (!vm.suspended) vm.pause();
         } else {
-                if (vm.debug_level >= 4) {
-                        cerr << "INFO: Resuming the VM!" << endl;
-                }
+                LOG_INFO("Resuming the VM!");
                 if (vm.suspended) vm.resume();
         }
 }
@@ -0,0 +1,162 @@
+// vm_check.cpp: runs the VM operations of the wrapper against the mock backend
+//
+// Usage: vm_check [DIR]
+//
+// The floppy images and the journal of the VMs are written to DIR, a new
+// temporary directory by default. Every case prints one line, and the
+// program returns the number of cases that failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "boinc_api.h"
+#include "diagnostics.h"
+#include "filesys.h"
+#include "parse.h"
+#include "str_util.h"
+#include "str_replace.h"
+#include "util.h"
+#include "error_numbers.h"
+#include "graphics2.h"
+#include "vbox.h"
+
+int failures = 0;
+
+void check(const std::string &name, bool ok, const std::string &detail)
+{
+        printf("%-48s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+        if (!ok) {
+                printf("    %s\n", detail.c_str());
+                failures++;
+        }
+}
+
+// Value of a key of showvminfo --machinereadable
+std::string vm_info(const std::string &vm, const std::string &key)
+{
+        std::string output;
+        if (hypervisor->run("showvminfo " + vm + " --machinereadable", output) != 0) return "";
+        size_t begin = output.find(key + "=");
+        if (begin == std::string::npos) return "";
+        begin += key.size() + 1;
+        std::string value = output.substr(begin, output.find('\n', begin) - begin);
+        if (value.size() >= 2 && value[0] == '"') value = value.substr(1, value.size() - 2);
+        return value;
+}
+
+// Commands received by the mock since index first that start with cmd,
+// with the blanks squeezed
+std::vector<std::string> commands(size_t first, const std::string &cmd)
+{
+        std::vector<std::string> found;
+        for (size_t i = first; i < Backend::mock.commands.size(); i++) {
+                std::istringstream in(Backend::mock.commands[i]);
+                std::string word, line;
+                while (in >> word) line += (line.empty() ? "" : " ") + word;
+                if (!line.compare(0, cmd.size() + 1, cmd + " ")) found.push_back(line);
+        }
+        return found;
+}
+
+bool has(const std::string &line, const std::string &args)
+{
+        return (line.find(args) != std::string::npos);
+}
+
+// The storage profile reaches storagectl, bandwidthctl and storageattach
+void check_storage(const std::string &bus, const std::string &controller, const std::string &add, bool options)
+{
+        std::string name = "storage " + bus + (options ? " with options" : "");
+        VM vm;
+        vm.virtual_machine_name = "vm_check_" + bus;
+        vm.storage.bus = bus;
+        if (options) {
+                vm.storage.hostiocache = 0;
+                vm.storage.ssd = true;
+                vm.storage.discard = true;
+                vm.storage.bandwidth = "50M";
+        }
+        size_t first = Backend::mock.commands.size();
+        if (!vm.create_config()) {
+                check(name, false, "create_config failed");
+                return;
+        }
+        vm.attach_disk();
+
+        std::vector<std::string> ctl = commands(first, "storagectl");
+        std::vector<std::string> bandwidth = commands(first, "bandwidthctl");
+        std::vector<std::string> attach = commands(first, "storageattach");
+        std::string detail;
+        if (ctl.empty() || attach.empty()) detail = "no storagectl or storageattach";
+        else {
+                const std::string &c = ctl[0];
+                const std::string &a = attach[attach.size() - 1];
+                if (!has(c, "--name \"" + controller + "\" " + add)) detail = "controller: " + c;
+                else if (has(c, "--hostiocache off") != options || has(c, "--hostiocache on")) detail = "host I/O cache: " + c;
+                else if (!has(a, "--storagectl \"" + controller + "\"")) detail = "disk controller: " + a;
+                else if (has(a, "--nonrotational on") != options) detail = "SSD: " + a;
+                else if (has(a, "--discard on") != options) detail = "discard: " + a;
+                else if (has(a, "--bandwidthgroup " STORAGE_BANDWIDTH_GROUP) != options) detail = "bandwidth group: " + a;
+                else if (options && (bandwidth.empty() || !has(bandwidth[0], "add " STORAGE_BANDWIDTH_GROUP " --type disk --limit 50M"))) {
+                        detail = "bandwidthctl: " + (bandwidth.empty() ? std::string("none") : bandwidth[0]);
+                }
+                else if (!options && !bandwidth.empty()) detail = "bandwidthctl: " + bandwidth[0];
+        }
+        check(name, detail.empty(), detail);
+        vm.remove();
+}
+
+// A host without VT-x/AMD-V refuses to start a VM with two cores: the
+// wrapper has to start it again with one
+void check_no_vtx()
+{
+        Backend::mock.no_vtx = true;
+        VM vm;
+        vm.virtual_machine_name = "vm_check_no_vtx";
+        vm.n_cpus = 2;
+        if (!vm.create_config()) {
+                check("no VT-x: start with one core", false, "create_config failed");
+                return;
+        }
+        vm.start(false, true);
+        std::string state, output;
+        hypervisor->state(vm.virtual_machine_name, state, output);
+        std::string cpus = vm_info(vm.virtual_machine_name, "cpus");
+        check("no VT-x: start with one core", state == "running" && cpus == "1" && vm.n_cpus == 1,
+              "state " + state + ", " + cpus + " cores");
+        hypervisor->control(vm.virtual_machine_name, "poweroff", output);
+        vm.remove();
+        Backend::mock.no_vtx = false;
+}
+
+int main(int argc, char **argv)
+{
+        char dir[] = "/tmp/vm_check.XXXXXX";
+        const char *work_dir = (argc > 1) ? argv[1] : mkdtemp(dir);
+        if (!work_dir || chdir(work_dir)) {
+                fprintf(stderr, "Cannot use %s as working directory\n", work_dir ? work_dir : dir);
+                return 1;
+        }
+        // No VBox.log is read from the home of the user
+        setenv("HOME", work_dir, 1);
+        Log::level = LOG_LEVEL_ERROR;
+        hypervisor = &Backend::mock;
+
+        check_storage("ide", "IDE Controller", "--add ide --controller PIIX4", false);
+        check_storage("ide", "IDE Controller", "--add ide --controller PIIX4", true);
+        check_storage("sata", "SATA Controller", "--add sata --controller IntelAhci --portcount 1", true);
+        check_storage("virtio-scsi", "VirtIO Controller", "--add virtio --controller VirtIO", true);
+        check_no_vtx();
+
+        printf("%d failed\n", failures);
+        return failures;
+}